@@ -0,0 +1,220 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+// OverlayDisk.cpp: implementation of the BlockDeviceInterface_Overlay class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "OverlayDisk.h"
+#include <string.h>
+
+#define MAP_CHUNK_BYTES		(MAP_CHUNK_SECTORS/8)
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+BlockDeviceInterface_Overlay::BlockDeviceInterface_Overlay(BlockDeviceInterface* pBase, unsigned long nSectors, BlockDeviceInterface* pDelta, const char* szDriverID)
+{
+	ASSERT(pBase!=NULL);
+	m_pBase = pBase;
+	m_pRamDelta = pDelta==NULL ? new BlockDeviceInterface_RamDisk(nSectors) : NULL;
+	m_pDelta = pDelta==NULL ? m_pRamDelta : pDelta;
+	m_szDriverID = szDriverID;
+	m_nSectors = nSectors;
+	m_nChunks = (nSectors + MAP_CHUNK_SECTORS - 1) / MAP_CHUNK_SECTORS;
+	m_pMap = new unsigned char*[m_nChunks];
+	memset(m_pMap, 0, m_nChunks*sizeof(unsigned char*));
+	m_nChanged = 0;
+}
+
+BlockDeviceInterface_Overlay::~BlockDeviceInterface_Overlay()
+{
+	Reset();
+	delete [] m_pMap;
+	delete m_pRamDelta;
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::MountHW(void* /*custom*/, unsigned long /*lMountFlags*/)
+{
+	// base and delta are mounted by the owner; sectors are copied between them as they are
+	if (m_pBase->GetSectorSize()!=SECTOR_SIZE || m_pDelta->GetSectorSize()!=SECTOR_SIZE)
+		return IO_UNSUPPORTED_SECTOR_SIZE;
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::UnmountHW()
+{
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::FlushHW()
+{
+	return m_pDelta->FlushHW();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Bitmap of changed sectors
+
+bool BlockDeviceInterface_Overlay::IsChanged(unsigned long lba) const
+{
+	const unsigned char* pChunk = m_pMap[lba/MAP_CHUNK_SECTORS];
+	if (pChunk==NULL)
+		return false;
+	const unsigned long i = lba%MAP_CHUNK_SECTORS;
+	return (pChunk[i>>3] & (1<<(i&7)))!=0;
+}
+
+unsigned int BlockDeviceInterface_Overlay::GetRun(unsigned long lba, unsigned int n, bool bChanged) const
+{
+	unsigned int nRun = 0;
+	while (nRun<n)
+	{
+		if (!bChanged && m_pMap[lba/MAP_CHUNK_SECTORS]==NULL)
+		{
+			// skip the rest of an unchanged chunk at once
+			const unsigned long nLeft = MAP_CHUNK_SECTORS - lba%MAP_CHUNK_SECTORS;
+			if (nLeft>=n-nRun)
+				return n;
+			nRun += (unsigned int)nLeft;
+			lba += nLeft;
+			continue;
+		}
+		if (IsChanged(lba)!=bChanged)
+			break;
+		nRun++;
+		lba++;
+	}
+	return nRun;
+}
+
+void BlockDeviceInterface_Overlay::SetChanged(unsigned long lba, unsigned int n)
+{
+	for (; n>0; n--, lba++)
+	{
+		unsigned char*& pChunk = m_pMap[lba/MAP_CHUNK_SECTORS];
+		if (pChunk==NULL)
+		{
+			pChunk = new unsigned char[MAP_CHUNK_BYTES];
+			memset(pChunk, 0, MAP_CHUNK_BYTES);
+		}
+		const unsigned long i = lba%MAP_CHUNK_SECTORS;
+		const unsigned char mask = (unsigned char)(1<<(i&7));
+		if ((pChunk[i>>3] & mask)==0)
+		{
+			pChunk[i>>3] |= mask;
+			m_nChanged++;
+		}
+	}
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::Reset()
+{
+	for (unsigned long i=0; i<m_nChunks; i++)
+	{
+		if (m_pMap[i]==NULL)
+			continue;
+		if (m_pRamDelta==NULL)
+		{
+			// give the space of the changed sectors back (e.g. of a sparse file)
+			const unsigned long lba = i*MAP_CHUNK_SECTORS;
+			const unsigned long lbaEnd = lba+MAP_CHUNK_SECTORS<m_nSectors ? lba+MAP_CHUNK_SECTORS : m_nSectors;
+			m_pDelta->TrimHW(lba, lbaEnd-lba);
+		}
+		delete [] m_pMap[i];
+		m_pMap[i] = NULL;
+	}
+	m_nChanged = 0;
+	if (m_pRamDelta!=NULL)
+		m_pRamDelta->Clear(); // release the memory of the changed sectors
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::Commit()
+{
+	char buffer[COMMIT_SECTORS*SECTOR_SIZE];
+	const unsigned int nMax = COMMIT_SECTORS;
+
+	for (unsigned long iChunk=0; iChunk<m_nChunks; iChunk++)
+	{
+		if (m_pMap[iChunk]==NULL)
+			continue;
+		const unsigned long lbaEnd = (iChunk+1)*MAP_CHUNK_SECTORS<m_nSectors ? (iChunk+1)*MAP_CHUNK_SECTORS : m_nSectors;
+		unsigned long lba = iChunk*MAP_CHUNK_SECTORS;
+		while (lba<lbaEnd)
+		{
+			// copy runs of changed sectors, in parts that fit the buffer
+			const unsigned int nLeft = lbaEnd-lba<nMax ? (unsigned int)(lbaEnd-lba) : nMax;
+			if (!IsChanged(lba))
+			{
+				lba += GetRun(lba, nLeft, false);
+				continue;
+			}
+			const unsigned int n = GetRun(lba, nLeft, true);
+			IO_RESULT res = m_pDelta->ReadSectors(lba, n, buffer);
+			if (res>=IO_OK)
+				res = m_pBase->WriteSectors(lba, n, buffer);
+			if (res<IO_OK)
+				return res; // the changes are kept, so Commit() can be retried
+			lba += n;
+		}
+	}
+	IO_RESULT res = m_pBase->FlushHW();
+	if (res<IO_OK)
+		return res;
+	return Reset();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Transfers
+
+IO_RESULT BlockDeviceInterface_Overlay::ReadSector(unsigned long lba, char* pData)
+{
+	return ReadSectors(lba, 1, pData);
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::WriteSector(unsigned long lba, const char* pData)
+{
+	return WriteSectors(lba, 1, pData);
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::ReadSectors(unsigned long lba, unsigned int n, char* pData)
+{
+	if (lba>=m_nSectors || n>m_nSectors-lba)
+		return IO_ILLEGAL_LBA;
+	while (n>0)
+	{
+		// read runs of (un)changed sectors from the delta or the base
+		const bool bChanged = IsChanged(lba);
+		const unsigned int nRun = GetRun(lba, n, bChanged);
+		BlockDeviceInterface* pDev = bChanged ? m_pDelta : m_pBase;
+		IO_RESULT res = pDev->ReadSectors(lba, nRun, pData);
+		if (res<IO_OK)
+			return res;
+		lba += nRun;
+		pData += (unsigned long)nRun*SECTOR_SIZE;
+		n -= nRun;
+	}
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Overlay::WriteSectors(unsigned long lba, unsigned int n, const char* pData)
+{
+	if (lba>=m_nSectors || n>m_nSectors-lba)
+		return IO_ILLEGAL_LBA;
+	IO_RESULT res = m_pDelta->WriteSectors(lba, n, pData);
+	if (res<IO_OK)
+		return res;
+	SetChanged(lba, n);
+	return IO_OK;
+}
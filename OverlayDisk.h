@@ -0,0 +1,85 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+//////////////////////////////////////////////////////////////////////
+// OverlayDisk.h: interface for the BlockDeviceInterface_Overlay class.
+// A copy-on-write view of a read-only base image.
+//////////////////////////////////////////////////////////////////////
+
+#ifndef __OverlayDisk_h
+#define __OverlayDisk_h
+
+#include "uFS.h"
+#include "RamDisk.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceInterface_Overlay
+//
+// Reads come from the base device, except for sectors that were written
+// through the overlay: those are stored at the same lba in the delta device
+// and read back from there. A bitmap (allocated per MAP_CHUNK_SECTORS)
+// records which sectors are in the delta. The base is never written, except
+// by Commit(), so many overlays can share one base that was mounted read-only
+// (e.g. a BlockDeviceInterface_Posix on a reference image).
+// The delta can be any device of at least nSectors sectors, e.g. a
+// BlockDeviceInterface_Posix on a sparse file. Without a delta device the
+// overlay keeps the changed sectors in memory, in a sparse RAM disk.
+// Reset() forgets all changes and Commit() writes them to the base; both cost
+// time in proportion to the nr of changed sectors only. Reset() trims the 
+// changed ranges of the delta (see BlockDeviceInterface::TrimHW), so e.g. a 
+// sparse delta file gives its space back. Unmount the volume before either 
+// call, so the cache doesn't keep sectors of the old contents.
+// The overlay doesn't mount or unmount the base and delta devices, but 
+// MountHW() fails with IO_UNSUPPORTED_SECTOR_SIZE unless both have sectors 
+// of SECTOR_SIZE bytes.
+
+class BlockDeviceInterface_Overlay : public BlockDeviceInterface
+{
+public:
+	BlockDeviceInterface_Overlay(BlockDeviceInterface* pBase, unsigned long nSectors, BlockDeviceInterface* pDelta=NULL, const char* szDriverID="ATA");
+	virtual ~BlockDeviceInterface_Overlay();
+
+	virtual IO_RESULT MountHW(void* custom=0, unsigned long lMountFlags=0);
+	virtual IO_RESULT UnmountHW();
+	virtual IO_RESULT ReadSector(unsigned long lba, char* pData);
+	virtual IO_RESULT WriteSector(unsigned long lba, const char* pData);
+	virtual IO_RESULT ReadSectors(unsigned long lba, unsigned int n, char* pData);
+	virtual IO_RESULT WriteSectors(unsigned long lba, unsigned int n, const char* pData);
+	virtual IO_RESULT FlushHW();
+
+	virtual const char* GetDriverID() { return m_szDriverID; }
+	virtual int GetSectorSize() { return SECTOR_SIZE; }
+	unsigned long GetNrOfSectors() const { return m_nSectors; }
+
+	IO_RESULT Reset();	// discard all changes
+	IO_RESULT Commit();	// write all changes to the base (which must be writable), then reset
+	unsigned long GetNrOfChangedSectors() const { return m_nChanged; }
+
+	enum { MAP_CHUNK_SECTORS = 32768, COMMIT_SECTORS = 16 };
+
+protected:
+	bool IsChanged(unsigned long lba) const;
+	unsigned int GetRun(unsigned long lba, unsigned int n, bool bChanged) const; // nr of sectors with the same state
+	void SetChanged(unsigned long lba, unsigned int n);
+
+	BlockDeviceInterface* m_pBase;
+	BlockDeviceInterface* m_pDelta;
+	BlockDeviceInterface_RamDisk* m_pRamDelta;	// owned delta if none was given
+	const char* m_szDriverID;
+	unsigned long m_nSectors;
+	unsigned long m_nChunks;
+	unsigned char** m_pMap;		// m_nChunks bitmaps of MAP_CHUNK_SECTORS bits, or NULL if unchanged
+	unsigned long m_nChanged;
+};
+
+#endif // __OverlayDisk_h
@@ -1,14 +1,51 @@
 #ifndef __pagedfile_h
 #define __pagedfile_h
 
+#ifdef _WIN32
 #ifndef _WINDOWS_
 #include <windows.h>
 #endif
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the win32 types and constants that are used by the interface below
+typedef int BOOL;
+typedef unsigned long DWORD;
+typedef long long LONGLONG;
+typedef char TCHAR;
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+#define GENERIC_READ	0x80000000
+#define GENERIC_WRITE	0x40000000
+#define FILE_MAP_WRITE	0x0002
+#define FILE_MAP_READ	0x0004
+#define __fastcall
+#endif
 
 #ifndef ASSERT
 #define ASSERT(a)
 #endif
 
+///////////////////////////////////////////////////////////////////////////////
+// Access pattern hints for FileMapping::AdviseData() (madvise() on POSIX 
+// systems, ignored on win32)
+
+enum fileMappingAdvice
+{
+	adviceNormal = 0,
+	adviceSequential,	// the data will be accessed in order; read ahead aggressively
+	adviceRandom,		// the data will be accessed randomly; don't read ahead
+	adviceWillNeed		// the data will be accessed soon; start reading it
+};
+
+#ifdef _WIN32
 
 ///////////////////////////////////////////////////////////////////////////////
 // FileMappingCore
@@ -105,6 +142,17 @@ public:
 		return ::UnmapViewOfFile(p);
 	}
 
+	// write n modified bytes at p of a view to the file (n==0: up to the end of the view)
+	BOOL __fastcall FlushViewOfFile(const void* p, DWORD n=0) const
+	{
+		return ::FlushViewOfFile(p, n);
+	}
+
+	BOOL __fastcall AdviseViewOfFile(const void* /*p*/, DWORD /*n*/, fileMappingAdvice /*advice*/) const
+	{
+		return TRUE; // not supported
+	}
+
 	HANDLE __fastcall GetMapHandle() const { return m_hFileMapping; }
 	HANDLE __fastcall GetFileHandle() const { return m_hFile; }
 	DWORD __fastcall GetFileAccess() const { return m_dwFileAccess; }
@@ -124,6 +172,164 @@ private:
 	HANDLE	m_hFileMapping;
 };
 
+#else // _WIN32
+
+///////////////////////////////////////////////////////////////////////////////
+// FileMappingCore
+// POSIX implementation of the interface above, using mmap(). Like win32, a 
+// mapping that is larger than the file extends the file. Only one view can
+// be mapped at a time (which is all that FileMapping needs).
+
+class FileMappingAPI
+{
+public:
+	FileMappingAPI() : 
+		m_dwFileAccess(0),
+		m_fd(-1), 
+		m_llMapSize(0),
+		m_pView(NULL),
+		m_nViewSize(0)
+		{ }
+
+	virtual ~FileMappingAPI() 
+	{ 
+		CloseFile(); 
+	}
+
+	BOOL __fastcall CreateFile(const TCHAR* strFilename, BOOL bAllowCreation=FALSE, DWORD dwDesiredAccess=GENERIC_WRITE|GENERIC_READ)
+	{
+		const int flags = (dwDesiredAccess&GENERIC_WRITE) ? O_RDWR : O_RDONLY;
+		m_fd = ::open(strFilename, flags|(bAllowCreation ? O_CREAT : 0), 0666);
+		m_dwFileAccess = dwDesiredAccess;
+		return IsOpen();
+	}
+
+	bool __fastcall IsOpen() const
+	{
+		return m_fd>=0;
+	}
+
+	void __fastcall CloseFile() 
+	{ 
+		CloseFileMapping(); 
+		if (IsOpen()) 
+		{ 
+			::close(m_fd); 
+			m_fd = -1; 
+		} 
+	}
+
+	BOOL __fastcall CreateFileMapping(LONGLONG int64MaximumSize=0)
+	{
+		ASSERT(m_fd>=0); // first close mapping then the file
+		LONGLONG llSize = GetFileSize();
+		if (int64MaximumSize>llSize)
+		{
+			if (IsReadOnly() || ::ftruncate(m_fd, (off_t)int64MaximumSize)!=0)
+				return FALSE;
+			llSize = int64MaximumSize;
+		}
+		m_llMapSize = llSize;
+		return llSize>0; // empty files can't be mapped (same as win32)
+	}
+
+	virtual void __fastcall CloseFileMapping() 
+	{ 
+		m_llMapSize = 0;
+	}
+
+	char* __fastcall MapViewOfFile(
+		 LONGLONG int64FileOffset=0,
+		 DWORD dwNumberOfBytesToMap=0,
+		 DWORD dwDesiredAccess=FILE_MAP_WRITE
+		) const
+	{
+		if (m_llMapSize==0 || m_pView!=NULL || int64FileOffset>=m_llMapSize)
+			return NULL;
+		const size_t n = dwNumberOfBytesToMap ? dwNumberOfBytesToMap : (size_t)(m_llMapSize-int64FileOffset);
+		const int prot = (dwDesiredAccess&FILE_MAP_WRITE) ? PROT_READ|PROT_WRITE : PROT_READ;
+		void* p = ::mmap(NULL, n, prot, MAP_SHARED, m_fd, (off_t)int64FileOffset);
+		if (p==MAP_FAILED)
+			return NULL;
+		m_pView = (char*)p;
+		m_nViewSize = n;
+		return m_pView;
+	}
+ 
+	BOOL __fastcall UnmapViewOfFile(void* p) const
+	{
+		if (p==NULL || p!=m_pView)
+			return FALSE;
+		::munmap(m_pView, m_nViewSize);
+		m_pView = NULL;
+		m_nViewSize = 0;
+		return TRUE;
+	}
+
+	// write n modified bytes at p of the view to the file (n==0: up to the end of the view)
+	BOOL __fastcall FlushViewOfFile(const void* p, DWORD n=0) const
+	{
+		char* pStart = NULL;
+		size_t nBytes = 0;
+		if (!GetPageRange(p, n, pStart, nBytes))
+			return FALSE;
+		return ::msync(pStart, nBytes, MS_SYNC)==0;
+	}
+
+	BOOL __fastcall AdviseViewOfFile(const void* p, DWORD n, fileMappingAdvice advice) const
+	{
+		char* pStart = NULL;
+		size_t nBytes = 0;
+		if (!GetPageRange(p, n, pStart, nBytes))
+			return FALSE;
+		int iAdvice = MADV_NORMAL;
+		switch (advice)
+		{
+		case adviceNormal:		iAdvice = MADV_NORMAL; break;
+		case adviceSequential:	iAdvice = MADV_SEQUENTIAL; break;
+		case adviceRandom:		iAdvice = MADV_RANDOM; break;
+		case adviceWillNeed:	iAdvice = MADV_WILLNEED; break;
+		}
+		return ::madvise(pStart, nBytes, iAdvice)==0;
+	}
+
+	int __fastcall GetFileHandle() const { return m_fd; }
+	DWORD __fastcall GetFileAccess() const { return m_dwFileAccess; }
+	bool __fastcall IsReadOnly() const { return (GetFileAccess()&GENERIC_WRITE)==0; }
+
+	LONGLONG GetFileSize() const 
+	{ 
+		struct stat st;
+		if (!IsOpen() || ::fstat(m_fd, &st)!=0) 
+			return 0;
+		return st.st_size;
+	}
+
+private:
+	bool __fastcall GetPageRange(const void* p, DWORD n, char*& pStart, size_t& nBytes) const
+	{
+		// msync() and madvise() need a page aligned start address
+		const char* pc = (const char*)p;
+		if (m_pView==NULL || pc<m_pView || pc>=m_pView+m_nViewSize)
+			return false;
+		if (n==0 || n>(size_t)(m_pView+m_nViewSize-pc))
+			n = (DWORD)(m_pView+m_nViewSize-pc);
+		const size_t nPage = (size_t)::sysconf(_SC_PAGESIZE);
+		const size_t nOffset = (size_t)(pc-m_pView)%nPage; // views start at a page boundary
+		pStart = (char*)pc-nOffset;
+		nBytes = n+nOffset;
+		return true;
+	}
+
+	DWORD	m_dwFileAccess; // file opened in read and/or write mode
+	int		m_fd;
+	LONGLONG m_llMapSize;	// size of the mapping, 0 if none
+	mutable char* m_pView;	// the mapped view, if any
+	mutable size_t m_nViewSize;
+};
+
+#endif // _WIN32
+
 ///////////////////////////////////////////////////////////////////////////////
 // FileMapping
 // This class extends the FileMappingCore class so that it can be used
@@ -159,6 +365,18 @@ public:
 
 	void __fastcall CloseFile() { UnmapDataPtr(); FileMappingAPI::CloseFile(); }
 
+	// Write (part of) the modified data to the file (n==0: up to the end of the file).
+	BOOL __fastcall FlushData(LONGLONG offset=0, DWORD n=0) const
+	{
+		return m_pData!=NULL && FlushViewOfFile(m_pData+offset, n);
+	}
+
+	// Tell the OS how (part of) the data will be accessed (n==0: up to the end of the file).
+	BOOL __fastcall AdviseData(fileMappingAdvice advice, LONGLONG offset=0, DWORD n=0) const
+	{
+		return m_pData!=NULL && AdviseViewOfFile(m_pData+offset, n, advice);
+	}
+
 	// The following function lets you access the whole file at once,
 	// without the need of performing multiple and delicate unmapping calls.
 	char* __fastcall GetDataPtr(/*DWORD dwDesiredAccess=FILE_MAP_WRITE*/)
@@ -236,7 +454,7 @@ public:
 		char* pData = m_bAttached ? m_pagedFile.GetDataPtr() : NULL;
 		if (pData)
 		{
-			m_bAttached = AttachDataPtr(pData, true);
+			m_bAttached = this->AttachDataPtr(pData, true);
 			if (!m_bAttached)
 				m_pagedFile.CloseFile();
 		}
@@ -269,8 +487,8 @@ public:
 		m_pagedFile.CloseFile();
 	}
 
-	LONGLONG __fastcall GetCapacity() const { ULARGE_INTEGER li; li.LowPart = GetFileSize(m_pagedFile.GetFileHandle(),&li.HighPart); return li.QuadPart; }
-	LONGLONG __fastcall GetBytesInUse() const { return ((char*)GetEOF()) - ((char*)GetBOF()); }
+	LONGLONG __fastcall GetCapacity() const { return m_pagedFile.GetFileSize(); }
+	LONGLONG __fastcall GetBytesInUse() const { return ((char*)this->GetEOF()) - ((char*)this->GetBOF()); }
 	LONGLONG __fastcall GetBytesFree() const { return GetCapacity() - GetBytesInUse(); }
 
 	bool __fastcall Grow(LONGLONG nBytesToGrow)
@@ -282,7 +500,7 @@ public:
 			LONGLONG n = GetCapacity()+nBytesToGrow;
 			if (n&0xfff)
 				n = (n+0x1000)&~0xfff;
-			DetachDataPtr();
+			this->DetachDataPtr();
 			m_pagedFile.UnmapDataPtr();
 			b = m_pagedFile.FileMappingAPI::CreateFileMapping(n)==TRUE;
 			if (b)
@@ -290,7 +508,7 @@ public:
 				char* pData = m_pagedFile.GetDataPtr();
 				if (pData)
 				{
-					m_bAttached = AttachDataPtr(pData, false);
+					m_bAttached = this->AttachDataPtr(pData, false);
 					if (!m_bAttached)
 					{
 						m_pagedFile.CloseFile();
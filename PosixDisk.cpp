@@ -0,0 +1,219 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+// PosixDisk.cpp: implementation of the BlockDeviceInterface_Posix class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#define _FILE_OFFSET_BITS 64	// images and devices beyond 2GB on 32-bit hosts
+
+#include "stdafx.h"
+#include "PosixDisk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>	// BLKSSZGET, BLKGETSIZE64, BLKDISCARD
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+BlockDeviceInterface_Posix::BlockDeviceInterface_Posix(const char* szDriverID)
+{
+	m_szDriverID = szDriverID;
+	m_fd = -1;
+	m_bDirect = false;
+	m_nSectorSize = SECTOR_SIZE;
+	m_nAlignment = SECTOR_SIZE;
+	m_nSectors = 0;
+	m_pBounce = NULL;
+}
+
+BlockDeviceInterface_Posix::~BlockDeviceInterface_Posix()
+{
+	UnmountHW();
+}
+
+IO_RESULT BlockDeviceInterface_Posix::MountHW(void* custom, unsigned long lMountFlags)
+{
+	const char* szPath = (const char*)custom;
+	if (szPath==NULL)
+		return IO_ERROR;
+	UnmountHW();
+
+	const int flags = (lMountFlags&IO_MOUNT_WRITABLE) ? O_RDWR : O_RDONLY;
+#ifdef O_DIRECT
+	if (lMountFlags&IO_MOUNT_DIRECT)
+	{
+		m_fd = open(szPath, flags|O_DIRECT);
+		m_bDirect = m_fd>=0;
+	}
+	if (m_fd<0) // O_DIRECT isn't supported by all file systems (e.g. tmpfs)
+#endif
+		m_fd = open(szPath, flags);
+	if (m_fd<0)
+		return IO_DEVICE_NOT_FOUND;
+
+	struct stat st;
+	if (fstat(m_fd, &st)<0)
+	{
+		UnmountHW();
+		return IO_ERROR;
+	}
+
+	// image files have 512 byte sectors; ask block devices for their logical sector size
+	off_t llSize = st.st_size;
+	m_nSectorSize = SECTOR_SIZE;
+#ifdef __linux__
+	if (S_ISBLK(st.st_mode))
+	{
+		int nSectorSize = 0;
+		if (ioctl(m_fd, BLKSSZGET, &nSectorSize)==0 && nSectorSize>0)
+			m_nSectorSize = nSectorSize;
+		if (ioctl(m_fd, BLKGETSIZE64, &llSize)<0)
+			llSize = 0;
+	}
+#endif
+	if (m_nSectorSize!=SECTOR_SIZE)
+	{
+		UnmountHW();
+		return IO_UNSUPPORTED_SECTOR_SIZE;
+	}
+	m_nAlignment = m_nSectorSize;
+
+	llSize /= m_nSectorSize;
+	m_nSectors = llSize>(off_t)0xFFFFFFFFUL ? 0xFFFFFFFFUL : (unsigned long)llSize;
+
+	if (m_bDirect && posix_memalign((void**)&m_pBounce, m_nAlignment, BOUNCE_SECTORS*m_nSectorSize)!=0)
+	{
+		m_pBounce = NULL;
+		UnmountHW();
+		return IO_ERROR;
+	}
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Posix::UnmountHW()
+{
+	if (m_fd>=0)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+	free(m_pBounce);
+	m_pBounce = NULL;
+	m_bDirect = false;
+	m_nSectors = 0;
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Posix::ReadSector(unsigned long lba, char* pData)
+{
+	return Transfer(lba, 1, pData, false);
+}
+
+IO_RESULT BlockDeviceInterface_Posix::WriteSector(unsigned long lba, const char* pData)
+{
+	return Transfer(lba, 1, (char*)pData, true);
+}
+
+IO_RESULT BlockDeviceInterface_Posix::ReadSectors(unsigned long lba, unsigned int n, char* pData)
+{
+	return Transfer(lba, n, pData, false);
+}
+
+IO_RESULT BlockDeviceInterface_Posix::WriteSectors(unsigned long lba, unsigned int n, const char* pData)
+{
+	return Transfer(lba, n, (char*)pData, true);
+}
+
+IO_RESULT BlockDeviceInterface_Posix::FlushHW()
+{
+	if (m_fd<0)
+		return IO_ERROR;
+	return fdatasync(m_fd)==0 ? IO_OK : IO_CANNOT_WRITE_SECTOR;
+}
+
+IO_RESULT BlockDeviceInterface_Posix::TrimHW(unsigned long lba, unsigned long n)
+{
+	if (m_fd<0)
+		return IO_ERROR;
+	if (lba>=m_nSectors)
+		return IO_OK;
+	if (n>m_nSectors-lba)
+		n = m_nSectors-lba;
+
+	// only a hint: without support (or on a read-only device) the sectors keep their space
+#ifdef __linux__
+	struct stat st;
+	if (fstat(m_fd, &st)<0)
+		return IO_OK;
+	if (S_ISBLK(st.st_mode))
+	{
+		__u64 range[2];
+		range[0] = (__u64)lba*m_nSectorSize;
+		range[1] = (__u64)n*m_nSectorSize;
+		ioctl(m_fd, BLKDISCARD, range);
+	}
+#ifdef FALLOC_FL_PUNCH_HOLE
+	else
+		fallocate(m_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)lba*m_nSectorSize, (off_t)n*m_nSectorSize);
+#endif
+#endif
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Posix::Transfer(unsigned long lba, unsigned int n, char* pData, bool bWrite)
+{
+	if (m_fd<0)
+		return IO_ERROR;
+	if (lba>=m_nSectors || n>m_nSectors-lba)
+		return IO_ILLEGAL_LBA;
+
+	while (n>0)
+	{
+		// O_DIRECT requires aligned buffers; use the bounce buffer for others
+		const bool bBounce = m_bDirect && ((size_t)pData&(m_nAlignment-1))!=0;
+		const unsigned int nPart = bBounce && n>(unsigned int)BOUNCE_SECTORS ? (unsigned int)BOUNCE_SECTORS : n;
+		char* p = bBounce ? m_pBounce : pData;
+		size_t nBytes = (size_t)nPart*m_nSectorSize;
+		off_t offset = (off_t)lba*m_nSectorSize;
+
+		if (bWrite && bBounce)
+			memcpy(p, pData, nBytes);
+		while (nBytes>0)
+		{
+			// pread/pwrite may transfer less than requested, or be interrupted
+			const ssize_t r = bWrite ? pwrite(m_fd, p, nBytes, offset) : pread(m_fd, p, nBytes, offset);
+			if (r<0 && errno==EINTR)
+				continue;
+			if (r<=0)
+				return bWrite ? IO_CANNOT_WRITE_SECTOR : IO_CANNOT_READ_SECTOR;
+			p += r;
+			offset += r;
+			nBytes -= (size_t)r;
+		}
+		if (!bWrite && bBounce)
+			memcpy(pData, m_pBounce, (size_t)nPart*m_nSectorSize);
+
+		lba += nPart;
+		pData += (size_t)nPart*m_nSectorSize;
+		n -= nPart;
+	}
+	return IO_OK;
+}
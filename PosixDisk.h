@@ -0,0 +1,73 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+//////////////////////////////////////////////////////////////////////
+// PosixDisk.h: interface for the BlockDeviceInterface_Posix class.
+// This class gives access to an image file or a block device (e.g. 
+// /dev/sdb) on Linux and other POSIX systems.
+//////////////////////////////////////////////////////////////////////
+
+#ifndef __PosixDisk_h
+#define __PosixDisk_h
+
+#include "uFS.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceInterface_Posix
+//
+// MountHW() takes the path of the file or device as 'custom' argument.
+// With IO_MOUNT_DIRECT the device is opened with O_DIRECT, bypassing the page 
+// cache; transfers from or to buffers that aren't aligned to the logical 
+// sector size then go through an aligned bounce buffer. FlushHW() calls 
+// fdatasync(), so DeviceIoManager::Flush() puts the data on the medium.
+// TrimHW() punches a hole in an image file, or discards the sectors of a
+// block device (Linux only).
+// Devices with a logical sector size other than SECTOR_SIZE aren't mounted
+// (IO_UNSUPPORTED_SECTOR_SIZE); the cache and the drivers assume SECTOR_SIZE.
+
+class BlockDeviceInterface_Posix : public BlockDeviceInterface
+{
+public:
+	BlockDeviceInterface_Posix(const char* szDriverID="ATA");
+	virtual ~BlockDeviceInterface_Posix();
+
+	virtual IO_RESULT MountHW(void* custom=0, unsigned long lMountFlags=0);
+	virtual IO_RESULT UnmountHW();
+	virtual IO_RESULT ReadSector(unsigned long lba, char* pData);
+	virtual IO_RESULT WriteSector(unsigned long lba, const char* pData);
+	virtual IO_RESULT ReadSectors(unsigned long lba, unsigned int n, char* pData);
+	virtual IO_RESULT WriteSectors(unsigned long lba, unsigned int n, const char* pData);
+	virtual IO_RESULT FlushHW();
+	virtual IO_RESULT TrimHW(unsigned long lba, unsigned long n);
+
+	virtual const char* GetDriverID() { return m_szDriverID; }
+	virtual int GetSectorSize() { return m_nSectorSize; }
+	unsigned long GetNrOfSectors() const { return m_nSectors; }
+	int GetFileDescriptor() const { return m_fd; }
+	bool IsDirect() const { return m_bDirect; }
+
+protected:
+	IO_RESULT Transfer(unsigned long lba, unsigned int n, char* pData, bool bWrite);
+
+	enum { BOUNCE_SECTORS = 64 };	// size of the bounce buffer for unaligned O_DIRECT transfers
+
+	const char* m_szDriverID;
+	int m_fd;
+	bool m_bDirect;
+	int m_nSectorSize;				// logical sector size of the device
+	int m_nAlignment;				// required buffer alignment for O_DIRECT
+	unsigned long m_nSectors;
+	char* m_pBounce;				// aligned buffer of BOUNCE_SECTORS sectors (O_DIRECT only)
+};
+
+#endif // __PosixDisk_h
@@ -0,0 +1,293 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+// RamDisk.cpp: implementation of the BlockDeviceInterface_RamDisk class.
+//
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "RamDisk.h"
+#include <string.h>
+#include <new>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+BlockDeviceInterface_RamDisk::BlockDeviceInterface_RamDisk(unsigned long nSectors, const char* szDriverID)
+{
+	m_szDriverID = szDriverID;
+	m_nSectors = nSectors;
+	m_nChunks = (nSectors + PAGE_SECTORS*CHUNK_PAGES - 1) / (PAGE_SECTORS*CHUNK_PAGES);
+	m_pChunks = new(std::nothrow) Page**[m_nChunks];
+	if (m_pChunks==NULL)
+		m_nSectors = m_nChunks = 0; // MountHW() fails
+	else
+		memset(m_pChunks, 0, m_nChunks*sizeof(Page**));
+	m_nPages = 0;
+	m_lCommandMicros = 0;
+	m_lSectorMicros = 0;
+	m_nReads = 0;
+	m_nWrites = 0;
+}
+
+BlockDeviceInterface_RamDisk::~BlockDeviceInterface_RamDisk()
+{
+	Clear();
+	delete [] m_pChunks;
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::MountHW(void* /*custom*/, unsigned long /*lMountFlags*/)
+{
+	if (m_pChunks==NULL)
+		return IO_ERROR;
+	return IO_OK; // the contents survive unmounting, use Clear() to erase
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::UnmountHW()
+{
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::ReadSector(unsigned long lba, char* pData)
+{
+	return Transfer(lba, 1, pData, false);
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::WriteSector(unsigned long lba, const char* pData)
+{
+	return Transfer(lba, 1, (char*)pData, true);
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::ReadSectors(unsigned long lba, unsigned int n, char* pData)
+{
+	return Transfer(lba, n, pData, false);
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::WriteSectors(unsigned long lba, unsigned int n, const char* pData)
+{
+	return Transfer(lba, n, (char*)pData, true);
+}
+
+void BlockDeviceInterface_RamDisk::SetLatency(unsigned long lCommandMicros, unsigned long lSectorMicros)
+{
+	m_lCommandMicros = lCommandMicros;
+	m_lSectorMicros = lSectorMicros;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Pages
+
+void BlockDeviceInterface_RamDisk::Clear()
+{
+	for (unsigned long i=0; i<m_nChunks; i++)
+	{
+		Page** pChunk = m_pChunks[i];
+		if (pChunk==NULL)
+			continue;
+		for (int j=0; j<CHUNK_PAGES; j++)
+			ReleasePage(pChunk[j]);
+		delete [] pChunk;
+		m_pChunks[i] = NULL;
+	}
+	m_nPages = 0;
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::TrimHW(unsigned long lba, unsigned long n)
+{
+	if (lba>=m_nSectors)
+		return IO_OK;
+	if (n>m_nSectors-lba)
+		n = m_nSectors-lba;
+	const unsigned long iEnd = (lba+n)/PAGE_SECTORS;
+	for (unsigned long iPage=(lba+PAGE_SECTORS-1)/PAGE_SECTORS; iPage<iEnd; iPage++)
+	{
+		Page** pp = GetSlot(iPage, false);
+		if (pp==NULL)
+		{
+			iPage |= CHUNK_PAGES-1; // skip the rest of an empty chunk
+			continue;
+		}
+		if (*pp!=NULL)
+		{
+			ReleasePage(*pp);
+			*pp = NULL;
+			m_nPages--;
+		}
+	}
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::Snapshot(BlockDeviceInterface_RamDisk& snapshot) const
+{
+	return snapshot.Share(*this);
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::Restore(const BlockDeviceInterface_RamDisk& snapshot)
+{
+	return Share(snapshot);
+}
+
+IO_RESULT BlockDeviceInterface_RamDisk::Share(const BlockDeviceInterface_RamDisk& src)
+{
+	if (&src==this)
+		return IO_OK;
+	if (src.m_nSectors!=m_nSectors)
+		return IO_ERROR;
+	Clear();
+	for (unsigned long i=0; i<m_nChunks; i++)
+	{
+		const Page* const* pSrcChunk = src.m_pChunks[i];
+		if (pSrcChunk==NULL)
+			continue;
+		Page** pChunk = new(std::nothrow) Page*[CHUNK_PAGES];
+		if (pChunk==NULL)
+		{
+			Clear();
+			return IO_ERROR;
+		}
+		for (int j=0; j<CHUNK_PAGES; j++)
+		{
+			pChunk[j] = (Page*)pSrcChunk[j];
+			if (pChunk[j]!=NULL)
+			{
+				pChunk[j]->nRefs++; // copied on the next write to either disk
+				m_nPages++;
+			}
+		}
+		m_pChunks[i] = pChunk;
+	}
+	return IO_OK;
+}
+
+BlockDeviceInterface_RamDisk::Page** BlockDeviceInterface_RamDisk::GetSlot(unsigned long iPage, bool bCreate)
+{
+	Page**& pChunk = m_pChunks[iPage/CHUNK_PAGES];
+	if (pChunk==NULL)
+	{
+		if (!bCreate)
+			return NULL;
+		pChunk = new(std::nothrow) Page*[CHUNK_PAGES];
+		if (pChunk==NULL)
+			return NULL;
+		memset(pChunk, 0, CHUNK_PAGES*sizeof(Page*));
+	}
+	return &pChunk[iPage%CHUNK_PAGES];
+}
+
+void BlockDeviceInterface_RamDisk::ReleasePage(Page* p)
+{
+	if (p!=NULL && --p->nRefs==0)
+		delete p;
+}
+
+bool BlockDeviceInterface_RamDisk::IsZero(const char* pData, unsigned long nBytes)
+{
+	for (unsigned long i=0; i<nBytes; i++)
+		if (pData[i]!=0)
+			return false;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Transfers
+
+IO_RESULT BlockDeviceInterface_RamDisk::Transfer(unsigned long lba, unsigned int n, char* pData, bool bWrite)
+{
+	if (lba>=m_nSectors || n>m_nSectors-lba)
+		return IO_ILLEGAL_LBA;
+	Delay(n);
+	if (bWrite)
+		m_nWrites += n;
+	else
+		m_nReads += n;
+
+	while (n>0)
+	{
+		// part of the transfer within one page
+		const unsigned long iPage = lba/PAGE_SECTORS;
+		const unsigned int iFirst = (unsigned int)(lba%PAGE_SECTORS);
+		const unsigned int nPart = n<PAGE_SECTORS-iFirst ? n : PAGE_SECTORS-iFirst;
+		const unsigned long nBytes = (unsigned long)nPart*SECTOR_SIZE;
+
+		if (!bWrite)
+		{
+			Page** pp = GetSlot(iPage, false);
+			if (pp==NULL || *pp==NULL)
+				memset(pData, 0, nBytes); // never written
+			else
+				memcpy(pData, (*pp)->data + iFirst*SECTOR_SIZE, nBytes);
+		}
+		else
+		{
+			Page** pp = GetSlot(iPage, false);
+			if ((pp==NULL || *pp==NULL) && IsZero(pData, nBytes))
+				; // zeros on an empty page (e.g. formatting) need no memory
+			else
+			{
+				if (pp==NULL)
+					pp = GetSlot(iPage, true);
+				if (pp==NULL)
+					return IO_CANNOT_WRITE_SECTOR;
+				Page* p = *pp;
+				if (p==NULL)
+				{
+					p = new(std::nothrow) Page;
+					if (p==NULL)
+						return IO_CANNOT_WRITE_SECTOR;
+					p->nRefs = 1;
+					memset(p->data, 0, sizeof(p->data));
+					*pp = p;
+					m_nPages++;
+				}
+				else if (p->nRefs>1)
+				{
+					// shared with a snapshot: copy before writing (still one page of this disk)
+					Page* pCopy = new(std::nothrow) Page;
+					if (pCopy==NULL)
+						return IO_CANNOT_WRITE_SECTOR;
+					pCopy->nRefs = 1;
+					memcpy(pCopy->data, p->data, sizeof(p->data));
+					p->nRefs--;
+					*pp = p = pCopy;
+				}
+				memcpy(p->data + iFirst*SECTOR_SIZE, pData, nBytes);
+			}
+		}
+
+		lba += nPart;
+		pData += nBytes;
+		n -= nPart;
+	}
+	return IO_OK;
+}
+
+void BlockDeviceInterface_RamDisk::Delay(unsigned int n)
+{
+	const unsigned long lMicros = m_lCommandMicros + n*m_lSectorMicros;
+	if (lMicros==0)
+		return;
+#ifdef _WIN32
+	Sleep((lMicros+999)/1000);
+#else
+	struct timespec ts;
+	ts.tv_sec = lMicros/1000000;
+	ts.tv_nsec = (lMicros%1000000)*1000;
+	while (nanosleep(&ts, &ts)!=0)
+		; // interrupted: sleep the remaining time
+#endif
+}
@@ -0,0 +1,103 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+//////////////////////////////////////////////////////////////////////
+// RamDisk.h: interface for the BlockDeviceInterface_RamDisk class.
+// A sparse disk in memory, e.g. for tests and benchmarks.
+//////////////////////////////////////////////////////////////////////
+
+#ifndef __RamDisk_h
+#define __RamDisk_h
+
+#include "uFS.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceInterface_RamDisk
+//
+// Sectors are stored in pages of PAGE_SECTORS sectors that are allocated on
+// the first write of non-zero data. Sectors that were never written read as
+// zeros and take no memory, so a large volume costs only the memory of its
+// file system structures and written data. A two level table keeps the
+// overhead of empty regions small (one pointer per CHUNK_PAGES pages).
+// Snapshot() and Restore() share the pages between two disks; a shared page
+// is copied on the next write, so both are cheap. Unmount the volume before
+// Restore(), so the cache doesn't keep sectors of the old contents.
+// When memory runs out, writes fail with IO_CANNOT_WRITE_SECTOR and
+// Snapshot() or Restore() with IO_ERROR. TrimHW() releases the pages that
+// lie entirely within the trimmed range.
+// SetLatency() makes every command wait, to mimic the timing of real media.
+
+class BlockDeviceInterface_RamDisk : public BlockDeviceInterface
+{
+public:
+	BlockDeviceInterface_RamDisk(unsigned long nSectors, const char* szDriverID="ATA");
+	virtual ~BlockDeviceInterface_RamDisk();
+
+	virtual IO_RESULT MountHW(void* custom=0, unsigned long lMountFlags=0);
+	virtual IO_RESULT UnmountHW();
+	virtual IO_RESULT ReadSector(unsigned long lba, char* pData);
+	virtual IO_RESULT WriteSector(unsigned long lba, const char* pData);
+	virtual IO_RESULT ReadSectors(unsigned long lba, unsigned int n, char* pData);
+	virtual IO_RESULT WriteSectors(unsigned long lba, unsigned int n, const char* pData);
+	virtual IO_RESULT TrimHW(unsigned long lba, unsigned long n);
+
+	virtual const char* GetDriverID() { return m_szDriverID; }
+	virtual int GetSectorSize() { return SECTOR_SIZE; }
+	unsigned long GetNrOfSectors() const { return m_nSectors; }
+
+	void Clear(); // all sectors read as zeros again
+	IO_RESULT Snapshot(BlockDeviceInterface_RamDisk& snapshot) const; // snapshot becomes a copy of this disk
+	IO_RESULT Restore(const BlockDeviceInterface_RamDisk& snapshot);  // this disk becomes a copy of snapshot
+
+	// every command waits lCommandMicros plus lSectorMicros per sector
+	void SetLatency(unsigned long lCommandMicros, unsigned long lSectorMicros);
+
+	unsigned long GetNrOfPages() const { return m_nPages; } // pages in use by this disk (shared pages included)
+	unsigned long GetNrOfReads() const { return m_nReads; } // sectors read since construction
+	unsigned long GetNrOfWrites() const { return m_nWrites; } // sectors written since construction
+
+	enum { PAGE_SECTORS = 8, CHUNK_PAGES = 1024 };
+
+protected:
+	struct Page
+	{
+		unsigned nRefs; // nr of disks that share this page
+		char data[PAGE_SECTORS*SECTOR_SIZE];
+	};
+
+	IO_RESULT Transfer(unsigned long lba, unsigned int n, char* pData, bool bWrite);
+	Page** GetSlot(unsigned long iPage, bool bCreate);
+	IO_RESULT Share(const BlockDeviceInterface_RamDisk& src);
+	void Delay(unsigned int n);
+	static void ReleasePage(Page* p);
+	static bool IsZero(const char* pData, unsigned long nBytes);
+
+private:
+	// not copyable, use Snapshot()
+	BlockDeviceInterface_RamDisk(const BlockDeviceInterface_RamDisk&);
+	BlockDeviceInterface_RamDisk& operator=(const BlockDeviceInterface_RamDisk&);
+
+protected:
+
+	const char* m_szDriverID;
+	unsigned long m_nSectors;
+	unsigned long m_nChunks;
+	Page*** m_pChunks;			// m_nChunks entries, each NULL or CHUNK_PAGES page pointers
+	unsigned long m_nPages;
+	unsigned long m_lCommandMicros;
+	unsigned long m_lSectorMicros;
+	unsigned long m_nReads;
+	unsigned long m_nWrites;
+};
+
+#endif // __RamDisk_h
@@ -0,0 +1,411 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+// UringDisk.cpp: implementation of the BlockDeviceInterface_Uring class.
+//
+// The rings are set up with the raw system calls, so liburing isn't needed.
+//////////////////////////////////////////////////////////////////////
+
+#define _FILE_OFFSET_BITS 64	// images and devices beyond 2GB on 32-bit hosts
+
+#include "stdafx.h"
+#include "UringDisk.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// the kernel reads and writes the ring indices concurrently
+#define LOAD_ACQUIRE(p)			__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+BlockDeviceInterface_Uring::BlockDeviceInterface_Uring(const char* szDriverID, unsigned int nEntries)
+	: m_disk(szDriverID)
+{
+	m_nEntries = nEntries>0 ? nEntries : 1;
+	m_fdRing = -1;
+	m_pSqRing = m_pCqRing = NULL;
+	m_nSqRingSize = m_nCqRingSize = 0;
+	m_pSqes = NULL;
+	m_nSqesSize = 0;
+	m_pSqHead = m_pSqTail = m_pCqHead = m_pCqTail = NULL;
+	m_nSqMask = m_nSqEntries = m_nCqMask = 0;
+	m_pCqes = NULL;
+	m_nSqTail = 0;
+	m_nQueued = 0;
+	m_pFixed = NULL;
+	m_nFixed = 0;
+	m_pInFlight = NULL;
+	m_nInFlight = 0;
+	m_pDoneHead = m_pDoneTail = NULL;
+	m_nDone = 0;
+}
+
+BlockDeviceInterface_Uring::~BlockDeviceInterface_Uring()
+{
+	UnmountHW();
+}
+
+IO_RESULT BlockDeviceInterface_Uring::MountHW(void* custom, unsigned long lMountFlags)
+{
+	UnmountHW();
+	IO_RESULT res = m_disk.MountHW(custom, lMountFlags);
+	if (res<IO_OK)
+		return res;
+	SetupRing(); // without a ring requests are carried out synchronously
+	return IO_OK;
+}
+
+IO_RESULT BlockDeviceInterface_Uring::UnmountHW()
+{
+	// finish the pending requests first
+	while (PollWait()>0)
+		;
+	ReleaseRing();
+	return m_disk.UnmountHW();
+}
+
+IO_RESULT BlockDeviceInterface_Uring::FlushHW()
+{
+	while (PollWait()>0)
+		;
+	return m_disk.FlushHW();
+}
+
+IO_RESULT BlockDeviceInterface_Uring::TrimHW(unsigned long lba, unsigned long n)
+{
+	Drain(); // writes in the ring may fill the sectors again
+	return m_disk.TrimHW(lba, n);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Ring setup
+
+IO_RESULT BlockDeviceInterface_Uring::SetupRing()
+{
+#ifdef __NR_io_uring_setup
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_fdRing = (int)syscall(__NR_io_uring_setup, m_nEntries, &params);
+	if (m_fdRing<0)
+		return IO_ERROR; // ENOSYS on old kernels, EPERM when disabled
+
+	m_nSqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	m_nCqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (m_nCqRingSize>m_nSqRingSize)
+			m_nSqRingSize = m_nCqRingSize;
+		m_nCqRingSize = 0;
+	}
+
+	m_pSqRing = mmap(NULL, m_nSqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fdRing, IORING_OFF_SQ_RING);
+	if (m_pSqRing==MAP_FAILED)
+	{
+		m_pSqRing = NULL;
+		ReleaseRing();
+		return IO_ERROR;
+	}
+	if (m_nCqRingSize==0)
+		m_pCqRing = m_pSqRing;
+	else
+	{
+		m_pCqRing = mmap(NULL, m_nCqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fdRing, IORING_OFF_CQ_RING);
+		if (m_pCqRing==MAP_FAILED)
+		{
+			m_pCqRing = NULL;
+			ReleaseRing();
+			return IO_ERROR;
+		}
+	}
+	m_nSqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+	void* pSqes = mmap(NULL, m_nSqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fdRing, IORING_OFF_SQES);
+	if (pSqes==MAP_FAILED)
+	{
+		ReleaseRing();
+		return IO_ERROR;
+	}
+	m_pSqes = (struct io_uring_sqe*)pSqes;
+
+	char* pSq = (char*)m_pSqRing;
+	char* pCq = (char*)m_pCqRing;
+	m_pSqHead = (unsigned*)(pSq + params.sq_off.head);
+	m_pSqTail = (unsigned*)(pSq + params.sq_off.tail);
+	m_nSqMask = *(unsigned*)(pSq + params.sq_off.ring_mask);
+	m_nSqEntries = params.sq_entries;
+	m_pCqHead = (unsigned*)(pCq + params.cq_off.head);
+	m_pCqTail = (unsigned*)(pCq + params.cq_off.tail);
+	m_nCqMask = *(unsigned*)(pCq + params.cq_off.ring_mask);
+	m_pCqes = (struct io_uring_cqe*)(pCq + params.cq_off.cqes);
+
+	// slot i of the submission ring always refers to sqe i
+	unsigned* pArray = (unsigned*)(pSq + params.sq_off.array);
+	for (unsigned i=0; i<m_nSqEntries; i++)
+		pArray[i] = i;
+	m_nSqTail = *m_pSqTail;
+	m_nQueued = 0;
+	return IO_OK;
+#else
+	return IO_ERROR;
+#endif
+}
+
+void BlockDeviceInterface_Uring::ReleaseRing()
+{
+	if (m_pSqes!=NULL)
+		munmap(m_pSqes, m_nSqesSize);
+	if (m_pCqRing!=NULL && m_pCqRing!=m_pSqRing)
+		munmap(m_pCqRing, m_nCqRingSize);
+	if (m_pSqRing!=NULL)
+		munmap(m_pSqRing, m_nSqRingSize);
+	if (m_fdRing>=0)
+		close(m_fdRing); // also releases the registered buffer
+	m_fdRing = -1;
+	m_pSqRing = m_pCqRing = NULL;
+	m_pSqes = NULL;
+	m_pSqHead = m_pSqTail = m_pCqHead = m_pCqTail = NULL;
+	m_pCqes = NULL;
+	m_nSqEntries = 0;
+	m_nQueued = 0;
+	m_pFixed = NULL;
+	m_nFixed = 0;
+}
+
+IO_RESULT BlockDeviceInterface_Uring::RegisterBuffer(char* pBuffer, unsigned long nBytes)
+{
+#ifdef __NR_io_uring_register
+	if (m_fdRing<0)
+		return IO_ERROR;
+	Drain(); // fixed transfers in the ring refer to the current buffer
+	if (m_pFixed!=NULL)
+	{
+		syscall(__NR_io_uring_register, m_fdRing, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		m_pFixed = NULL;
+		m_nFixed = 0;
+	}
+	if (pBuffer==NULL || nBytes==0)
+		return IO_OK;
+
+	struct iovec iov;
+	iov.iov_base = pBuffer;
+	iov.iov_len = nBytes;
+	if (syscall(__NR_io_uring_register, m_fdRing, IORING_REGISTER_BUFFERS, &iov, 1)<0)
+		return IO_ERROR; // e.g. RLIMIT_MEMLOCK exceeded; transfers still work unregistered
+	m_pFixed = pBuffer;
+	m_nFixed = nBytes;
+	return IO_OK;
+#else
+	return IO_ERROR;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+// Requests
+
+IO_RESULT BlockDeviceInterface_Uring::Submit(BlockDeviceRequest* pRequest)
+{
+	if (pRequest->n==0 || pRequest->pData==NULL)
+		return IO_ERROR;
+	const unsigned long nSectors = m_disk.GetNrOfSectors();
+	if (pRequest->lba>=nSectors || pRequest->n>nSectors-pRequest->lba)
+		return IO_ILLEGAL_LBA;
+
+	const int nSectorSize = m_disk.GetSectorSize();
+	const unsigned long nBytes = (unsigned long)pRequest->n*nSectorSize;
+	pRequest->res = IO_PENDING;
+	pRequest->pNext = NULL;
+
+	// O_DIRECT needs aligned buffers; the Posix device bounces the others
+	const bool bUnaligned = m_disk.IsDirect() && ((size_t)pRequest->pData&(nSectorSize-1))!=0;
+	if (m_fdRing<0 || bUnaligned)
+	{
+		Drain();
+		Complete(pRequest, -EAGAIN);
+		return IO_PENDING;
+	}
+
+	// make room in the ring; the completion ring is twice as large, so it can't overflow
+	while (m_nInFlight>=(int)m_nSqEntries)
+	{
+		Enter(1);
+		Reap();
+	}
+
+	struct io_uring_sqe* sqe = &m_pSqes[m_nSqTail & m_nSqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	const bool bFixed = m_pFixed!=NULL && pRequest->pData>=m_pFixed && pRequest->pData+nBytes<=m_pFixed+m_nFixed;
+	if (bFixed)
+		sqe->opcode = pRequest->bWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		sqe->opcode = pRequest->bWrite ? IORING_OP_WRITE : IORING_OP_READ;
+	if (Overlaps(pRequest))
+		sqe->flags = IOSQE_IO_DRAIN; // start after all earlier requests are completed
+	sqe->fd = m_disk.GetFileDescriptor();
+	sqe->off = (__u64)pRequest->lba*nSectorSize;
+	sqe->addr = (__u64)(size_t)pRequest->pData;
+	sqe->len = (unsigned)nBytes;
+	sqe->buf_index = 0;
+	sqe->user_data = (__u64)(size_t)pRequest;
+	m_nSqTail++;
+	m_nQueued++;
+
+	pRequest->pNext = m_pInFlight;
+	m_pInFlight = pRequest;
+	m_nInFlight++;
+	return IO_PENDING;
+}
+
+int BlockDeviceInterface_Uring::Poll()
+{
+	if (m_nQueued>0)
+		Enter(0); // one system call for all requests submitted since the last poll
+	if (m_nInFlight>0)
+		Reap();
+
+	// callbacks may submit new requests
+	RunDeferred();
+	while (m_pDoneHead!=NULL)
+	{
+		BlockDeviceRequest* p = m_pDoneHead;
+		m_pDoneHead = p->pNext;
+		if (m_pDoneHead==NULL)
+			m_pDoneTail = NULL;
+		m_nDone--;
+		p->pNext = NULL;
+		Done(p); // deferred within Wait()
+	}
+	return m_nInFlight + m_nDone + m_nDeferred;
+}
+
+int BlockDeviceInterface_Uring::PollWait()
+{
+	// sleep in the kernel until a request completes, instead of spinning on Poll()
+	const int nInFlight = m_nInFlight;
+	if (nInFlight>0)
+	{
+		Reap();
+		if (m_nInFlight==nInFlight && Enter(1)>=0)
+			Reap();
+	}
+	return Poll();
+}
+
+int BlockDeviceInterface_Uring::Enter(unsigned int nMinComplete)
+{
+#ifdef __NR_io_uring_enter
+	STORE_RELEASE(m_pSqTail, m_nSqTail);
+	const unsigned flags = nMinComplete>0 ? IORING_ENTER_GETEVENTS : 0;
+	for (;;)
+	{
+		const int r = (int)syscall(__NR_io_uring_enter, m_fdRing, m_nQueued, nMinComplete, flags, NULL, 0);
+		if (r>=0)
+		{
+			m_nQueued -= (unsigned)r<m_nQueued ? (unsigned)r : m_nQueued;
+			return r;
+		}
+		if (errno!=EINTR)
+			return -1; // EAGAIN/EBUSY: try again after reaping
+	}
+#else
+	return -1;
+#endif
+}
+
+void BlockDeviceInterface_Uring::Reap()
+{
+	unsigned head = *m_pCqHead;
+	const unsigned tail = LOAD_ACQUIRE(m_pCqTail);
+	while (head!=tail)
+	{
+		const struct io_uring_cqe* cqe = &m_pCqes[head & m_nCqMask];
+		BlockDeviceRequest* pRequest = (BlockDeviceRequest*)(size_t)cqe->user_data;
+		const int nResult = cqe->res;
+		head++;
+
+		// remove it from the in-flight list
+		BlockDeviceRequest** pp = &m_pInFlight;
+		while (*pp!=NULL && *pp!=pRequest)
+			pp = &(*pp)->pNext;
+		ASSERT(*pp==pRequest);
+		if (*pp!=NULL)
+		{
+			*pp = pRequest->pNext;
+			m_nInFlight--;
+		}
+		pRequest->pNext = NULL;
+		Complete(pRequest, nResult);
+	}
+	STORE_RELEASE(m_pCqHead, head);
+}
+
+void BlockDeviceInterface_Uring::Drain()
+{
+	while (m_nInFlight>0)
+	{
+		Enter(1);
+		Reap();
+	}
+}
+
+void BlockDeviceInterface_Uring::Complete(BlockDeviceRequest* pRequest, int nResult)
+{
+	const unsigned long nBytes = (unsigned long)pRequest->n*m_disk.GetSectorSize();
+	IO_RESULT res;
+	if (nResult>=0 && (unsigned long)nResult==nBytes)
+		res = IO_OK;
+	else if (nResult>=0)
+		res = TransferSync(pRequest, (unsigned long)nResult); // short transfer: do the rest
+	else if (nResult==-EAGAIN || nResult==-EINTR)
+		res = TransferSync(pRequest, 0);
+	else
+		res = pRequest->bWrite ? IO_CANNOT_WRITE_SECTOR : IO_CANNOT_READ_SECTOR;
+
+	pRequest->res = res;
+	pRequest->pNext = NULL;
+	if (pRequest->pfnDone==NULL)
+		return; // nothing left to do (the submitter may already have released it)
+
+	// queue for the callback in Poll()
+	if (m_pDoneTail!=NULL)
+		m_pDoneTail->pNext = pRequest;
+	else
+		m_pDoneHead = pRequest;
+	m_pDoneTail = pRequest;
+	m_nDone++;
+}
+
+IO_RESULT BlockDeviceInterface_Uring::TransferSync(BlockDeviceRequest* pRequest, unsigned long lSkip)
+{
+	// continue from the last complete sector
+	const unsigned int nDone = (unsigned int)(lSkip/m_disk.GetSectorSize());
+	const unsigned long lba = pRequest->lba + nDone;
+	const unsigned int n = pRequest->n - nDone;
+	char* pData = pRequest->pData + (unsigned long)nDone*m_disk.GetSectorSize();
+	return pRequest->bWrite ? m_disk.WriteSectors(lba, n, pData) : m_disk.ReadSectors(lba, n, pData);
+}
+
+bool BlockDeviceInterface_Uring::Overlaps(const BlockDeviceRequest* pRequest) const
+{
+	for (const BlockDeviceRequest* p=m_pInFlight; p!=NULL; p=p->pNext)
+	{
+		if ((p->bWrite || pRequest->bWrite) && p->lba<pRequest->lba+pRequest->n && pRequest->lba<p->lba+p->n)
+			return true;
+	}
+	return false;
+}
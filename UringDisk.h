@@ -0,0 +1,116 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+//////////////////////////////////////////////////////////////////////
+// UringDisk.h: interface for the BlockDeviceInterface_Uring class.
+// This class gives asynchronous access to an image file or a block
+// device on Linux, using io_uring (kernel 5.1 and later).
+//////////////////////////////////////////////////////////////////////
+
+#ifndef __UringDisk_h
+#define __UringDisk_h
+
+#include "uFS.h"
+#include "PosixDisk.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceInterface_Uring
+//
+// MountHW() takes the same arguments as BlockDeviceInterface_Posix, which is
+// used to open the device. Submit() only queues a request in the submission
+// ring; Poll() hands all queued requests to the kernel with a single system
+// call and then collects the completions from the completion ring without
+// any system call. So a burst of submitted requests costs one system call.
+// Requests that overlap an earlier pending request wait until all earlier
+// requests are completed. 'res' is set as soon as a completion is collected;
+// the callback follows in the next Poll(), so a request with a callback must
+// stay valid until its callback has run. Wait() sleeps in the kernel until
+// a completion arrives (see PollWait()).
+// RegisterBuffer() registers a memory range with the kernel, so transfers
+// from or to that range skip the page mapping of each request. The sector
+// buffers of the cache are one such range (see DeviceIoManager::GetCacheArena),
+// but they aren't aligned to the sector size, so with O_DIRECT their
+// transfers are synchronous (see below); register them for buffered mounts.
+// Without io_uring support in the kernel, or for O_DIRECT transfers from or
+// to unaligned buffers, requests are carried out synchronously on submission
+// and completed by the next Poll().
+
+class BlockDeviceInterface_Uring : public AsyncBlockDeviceInterface
+{
+public:
+	BlockDeviceInterface_Uring(const char* szDriverID="ATA", unsigned int nEntries=64);
+	virtual ~BlockDeviceInterface_Uring();
+
+	virtual IO_RESULT MountHW(void* custom=0, unsigned long lMountFlags=0);
+	virtual IO_RESULT UnmountHW();
+	virtual IO_RESULT FlushHW();
+	virtual IO_RESULT TrimHW(unsigned long lba, unsigned long n);
+
+	virtual const char* GetDriverID() { return m_disk.GetDriverID(); }
+	virtual int GetSectorSize() { return m_disk.GetSectorSize(); }
+	unsigned long GetNrOfSectors() const { return m_disk.GetNrOfSectors(); }
+
+	virtual IO_RESULT Submit(BlockDeviceRequest* pRequest);
+	virtual int Poll(); // nr of requests that are still pending
+	virtual int PollWait(); // Poll(), after waiting for a completion if none is available
+
+	IO_RESULT RegisterBuffer(char* pBuffer, unsigned long nBytes); // NULL unregisters
+	bool IsRingEnabled() const { return m_fdRing>=0; }
+
+protected:
+	IO_RESULT SetupRing();
+	void ReleaseRing();
+	int Enter(unsigned int nMinComplete); // submit the queued requests
+	void Reap();	// move completed requests to the done list
+	void Drain();	// wait until all requests in the ring are completed
+	void Complete(BlockDeviceRequest* pRequest, int nResult);
+	IO_RESULT TransferSync(BlockDeviceRequest* pRequest, unsigned long lSkip);
+	bool Overlaps(const BlockDeviceRequest* pRequest) const;
+
+	BlockDeviceInterface_Posix m_disk;
+	unsigned int m_nEntries;		// requested size of the submission ring
+
+	int m_fdRing;
+	void* m_pSqRing;				// mapped submission ring
+	unsigned long m_nSqRingSize;
+	void* m_pCqRing;				// mapped completion ring (may equal m_pSqRing)
+	unsigned long m_nCqRingSize;
+	io_uring_sqe* m_pSqes;
+	unsigned long m_nSqesSize;
+
+	volatile unsigned* m_pSqHead;
+	volatile unsigned* m_pSqTail;
+	unsigned m_nSqMask;
+	unsigned m_nSqEntries;
+	volatile unsigned* m_pCqHead;
+	volatile unsigned* m_pCqTail;
+	unsigned m_nCqMask;
+	io_uring_cqe* m_pCqes;
+
+	unsigned m_nSqTail;				// our tail, published by Enter()
+	unsigned m_nQueued;				// nr of requests queued but not yet submitted
+
+	char* m_pFixed;					// registered buffer, or NULL
+	unsigned long m_nFixed;
+
+	BlockDeviceRequest* m_pInFlight;	// requests in the ring
+	int m_nInFlight;
+	BlockDeviceRequest* m_pDoneHead;	// completed requests, callbacks pending
+	BlockDeviceRequest* m_pDoneTail;
+	int m_nDone;
+};
+
+#endif // __UringDisk_h
@@ -17,7 +17,7 @@
 #include "stdafx.h"
 #include "VirtualDisk.h"
 
-#ifdef _DEBUG
+#if defined(_DEBUG) && defined(DEBUG_NEW)
 #undef THIS_FILE
 static char THIS_FILE[]=__FILE__;
 #define new DEBUG_NEW
@@ -42,7 +42,7 @@ VirtualDisk::~VirtualDisk()
 
 bool VirtualDisk::Create(const char *szFilename, unsigned long nSectors, unsigned short nBytesPerSector)
 {
-	LONGLONG llDiskSize = nSectors * nBytesPerSector;
+	LONGLONG llDiskSize = (LONGLONG)nSectors * nBytesPerSector;
 	bool b = m_diskfile.CreateFileMapping(szFilename,TRUE,GENERIC_WRITE|GENERIC_READ, llDiskSize)!=FALSE;
 	if (b)
 	{
@@ -97,7 +97,18 @@ bool VirtualDisk::IsOpen()
 
 bool VirtualDisk::ReadSector(unsigned long iSector, char *pData)
 {
-	if (iSector>=m_nSectors)
+	return ReadSectors(iSector, 1, pData);
+}
+
+bool VirtualDisk::WriteSector(unsigned long iSector, const char *pData)
+{
+	return WriteSectors(iSector, 1, pData);
+}
+
+bool VirtualDisk::ReadSectors(unsigned long iSector, unsigned long n, char *pData)
+{
+	// the sectors are consecutive in the mapping, so copy them at once
+	if (iSector>=m_nSectors || n>m_nSectors-iSector)
 	{
 		ASSERT(FALSE);
 		return false;
@@ -105,13 +116,13 @@ bool VirtualDisk::ReadSector(unsigned long iSector, char *pData)
 	ASSERT(m_nBytesPerSector!=0);
 	ASSERT(m_pData!=NULL);
 	ASSERT(pData!=NULL);
-	memcpy(pData, m_pData+iSector*m_nBytesPerSector, m_nBytesPerSector);
+	memcpy(pData, m_pData+(LONGLONG)iSector*m_nBytesPerSector, (size_t)n*m_nBytesPerSector);
 	return true;
 }
 
-bool VirtualDisk::WriteSector(unsigned long iSector, const char *pData)
+bool VirtualDisk::WriteSectors(unsigned long iSector, unsigned long n, const char *pData)
 {
-	if (iSector>=m_nSectors || m_bReadOnly)
+	if (iSector>=m_nSectors || n>m_nSectors-iSector || m_bReadOnly)
 	{
 		ASSERT(FALSE);
 		return false;
@@ -119,6 +130,18 @@ bool VirtualDisk::WriteSector(unsigned long iSector, const char *pData)
 	ASSERT(m_nBytesPerSector!=0);
 	ASSERT(m_pData!=NULL);
 	ASSERT(pData!=NULL);
-	memcpy(m_pData+iSector*m_nBytesPerSector, pData, m_nBytesPerSector);
+	memcpy(m_pData+(LONGLONG)iSector*m_nBytesPerSector, pData, (size_t)n*m_nBytesPerSector);
 	return true;
 }
+
+bool VirtualDisk::Flush()
+{
+	if (m_pData==NULL)
+		return false;
+	return m_bReadOnly || m_diskfile.FlushData()!=FALSE;
+}
+
+bool VirtualDisk::Advise(fileMappingAdvice advice)
+{
+	return m_pData!=NULL && m_diskfile.AdviseData(advice)!=FALSE;
+}
@@ -24,7 +24,7 @@
 #pragma once
 #endif // _MSC_VER > 1000
 
-#include "pagedfile.h"
+#include "PagedFile.h"
 
 class VirtualDisk  
 {
@@ -40,6 +40,10 @@ public:
 
 	bool WriteSector(unsigned long iSector, const char* pData);
 	bool ReadSector(unsigned long iSector, char* pData);
+	bool WriteSectors(unsigned long iSector, unsigned long n, const char* pData);
+	bool ReadSectors(unsigned long iSector, unsigned long n, char* pData);
+	bool Flush();									// write modified sectors to the image file
+	bool Advise(fileMappingAdvice advice);			// expected access pattern of the whole disk
 
 	long GetNrOfSectors() const { return m_nSectors; }
 
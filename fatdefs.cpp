@@ -221,6 +221,208 @@ int GetDosVolumeID(const DirEntry* dir, char* buf/*at least 8+1+3+1=13 bytes*/,
 	return len;
 }
 
+
+
+/////////////////////////////////////
+// long filenames
+
+// byte offsets of the 13 characters in a DirLfnEntry
+static const unsigned char _lfnCharOffsets[FAT_LFN_CHARS] = { 1,3,5,7,9, 14,16,18,20,22,24, 28,30 };
+
+static const char _szIllegalLfnChars[] = "\\/:*?\"<>|";
+
+int GetLfnEntryCount(const char* szName, int len)
+{
+	int i;
+	char buf[5];
+	if (len<=0 || len>FAT_LFN_MAX_LEN)
+		return 0;
+	for (i=0; i<len; i++)
+	{
+		const unsigned char c = (unsigned char)szName[i];
+		if (c<0x20 || strchr(_szIllegalLfnChars,c)!=NULL)
+			return 0;
+	}
+	// trailing dots and spaces are not stored (this also rejects "." and "..")
+	if (szName[len-1]=='.' || szName[len-1]==' ')
+		return 0;
+	if (len<(int)sizeof(buf))
+	{
+		memcpy(buf, szName, len);
+		buf[len] = '\0';
+		if (IsReservedDosFilename(buf))
+			return 0;
+	}
+	return (len+FAT_LFN_CHARS-1)/FAT_LFN_CHARS;
+}
+
+unsigned char GetDosChecksum(const DirEntry* e)
+{
+	// checksum of the 11 bytes of the 8.3 name, as stored in its LFN entries
+	int i;
+	unsigned char sum = 0;
+	for (i=0; i<8; i++)
+		sum = (unsigned char)(((sum&1)<<7) + (sum>>1) + (unsigned char)e->sName[i]);
+	for (i=0; i<3; i++)
+		sum = (unsigned char)(((sum&1)<<7) + (sum>>1) + (unsigned char)e->sExt[i]);
+	return sum;
+}
+
+int CompareLfnEntry(const DirLfnEntry* e, const char* szName, int len)
+{
+	// Compare the characters of a single LFN entry with the corresponding part 
+	// of szName (case insensitive), without assembling the complete name.
+	// The caller must check that the number of entries matches the length of szName.
+	int k;
+	const unsigned char* p = (const unsigned char*)e;
+	const int iSequenceNr = e->cSequenceNr & FAT_LFN_SEQUENCE_MASK;
+	int pos = (iSequenceNr-1)*FAT_LFN_CHARS;
+	if (iSequenceNr==0)
+		return -1;
+	for (k=0; k<FAT_LFN_CHARS; k++, pos++)
+	{
+		const unsigned uc = p[_lfnCharOffsets[k]] | (p[_lfnCharOffsets[k]+1]<<8);
+		if (pos>=len)
+			return uc==0 ? 0 : 1; // name must end here
+		if (uc>0xFF || toupper(uc)!=toupper((unsigned char)szName[pos]))
+			return 1;
+	}
+	return 0;
+}
+
+void SetLfnEntry(DirLfnEntry* e, const char* szName, int len, int iSequenceNr, unsigned char cCheckSum)
+{
+	int k;
+	unsigned char* p = (unsigned char*)e;
+	int pos = (iSequenceNr-1)*FAT_LFN_CHARS;
+	e->cSequenceNr = (unsigned char)iSequenceNr;
+	if (pos+FAT_LFN_CHARS>=len)
+		e->cSequenceNr |= FAT_LFN_LAST_ENTRY;
+	e->cAttributes = FAT_ATTR_LFN;
+	e->cType = 0;
+	e->cCheckSum = cCheckSum;
+	e->ucReserved = 0;
+	for (k=0; k<FAT_LFN_CHARS; k++, pos++)
+	{
+		unsigned uc = FAT_LFN_UNUSED;
+		if (pos<len)
+			uc = (unsigned char)szName[pos];
+		else if (pos==len)
+			uc = 0; // terminator, unless the name fills the last entry
+		p[_lfnCharOffsets[k]] = (unsigned char)uc;
+		p[_lfnCharOffsets[k]+1] = (unsigned char)(uc>>8);
+	}
+}
+
+static char ToAliasChar(char c)
+{
+	c = toupper(c);
+	return IsValidDosnameChar(c) ? c : '_';
+}
+
+int SetDosAlias(DirEntry* e, const char* szName, int len, int iTail)
+{
+	// Derive a short 8.3 name from a long filename: spaces and dots are removed from 
+	// the base name, other illegal characters are replaced by underscores. The 
+	// extension is taken from the characters after the last dot (if any). 
+	// Returns 0 if iTail is out of range (1..999999).
+	int i, k, nBase;
+	int iExt = len;
+	memset(e->sName, ' ', sizeof(e->sName));
+	memset(e->sExt, ' ', sizeof(e->sExt));
+	for (i=len-1; i>0; i--)
+		if (szName[i]=='.')
+		{
+			iExt = i;
+			break;
+		}
+
+	for (i=0, nBase=0; i<iExt && nBase<8; i++)
+		if (szName[i]!=' ' && szName[i]!='.')
+			e->sName[nBase++] = ToAliasChar(szName[i]);
+	if (nBase==0)
+		e->sName[nBase++] = '_';
+	for (i=iExt+1, k=0; i<len && k<3; i++)
+		if (szName[i]!=' ')
+			e->sExt[k++] = ToAliasChar(szName[i]);
+
+	if (iTail>0)
+		nBase = SetDosAliasTail(e, iTail);
+	return nBase;
+}
+
+int SetDosAliasHash(DirEntry* e, const char* szName, int len)
+{
+	// Replace all but the first two characters of an alias basis (see SetDosAlias())
+	// by four hex digits of a hash of the complete long filename. Used when the
+	// first few numeric tails are taken, so very similar names still get a short
+	// alias with a free tail.
+	static const char _hex[] = "0123456789ABCDEF";
+	unsigned int h = 0;
+	int i, nBase;
+	for (i=0; i<len; i++)
+		h = (h*37 + (unsigned char)toupper(szName[i])) & 0xffff;
+	for (nBase=0; nBase<2 && e->sName[nBase]!=' '; nBase++)
+		;
+	for (i=12; i>=0; i-=4)
+		e->sName[nBase++] = _hex[(h>>i)&0xf];
+	for (i=nBase; i<8; i++)
+		e->sName[i] = ' ';
+	return nBase;
+}
+
+int SetDosAliasTail(DirEntry* e, int iTail)
+{
+	// Append ~N to an alias basis, truncating the basis if ~N doesn't fit.
+	// Returns 0 if iTail is out of range (1..999999).
+	int k, n = 0;
+	int nBase;
+	char buf[8];
+	char szTail[8];
+	if (iTail<=0 || iTail>999999)
+		return 0;
+	for (nBase=0; nBase<8 && e->sName[nBase]!=' '; nBase++)
+		;
+	while (iTail>0)
+	{
+		buf[n++] = (char)('0' + iTail%10);
+		iTail /= 10;
+	}
+	szTail[0] = '~';
+	for (k=1; n>0; k++)
+		szTail[k] = buf[--n];
+	if (nBase>8-k)
+		nBase = 8-k;
+	memcpy(e->sName+nBase, szTail, k);
+	return nBase + k;
+}
+
+int GetDosAliasTail(const DirEntry* e, const DirEntry* pBasis)
+{
+	int i, p, nBase;
+	int iTail = 0;
+	if (memcmp(e->sExt, pBasis->sExt, sizeof(e->sExt))!=0)
+		return 0;
+	for (p=1; p<8 && e->sName[p]!='~'; p++)
+		;
+	if (p>=7)
+		return 0;
+	for (i=p+1; i<8 && e->sName[i]!=' '; i++)
+	{
+		if (e->sName[i]<'0' || e->sName[i]>'9')
+			return 0;
+		iTail = iTail*10 + (e->sName[i]-'0');
+	}
+	// the base name must be truncated exactly like SetDosAlias() does
+	for (nBase=0; nBase<8 && pBasis->sName[nBase]!=' '; nBase++)
+		;
+	if (nBase>8-(i-p))
+		nBase = 8-(i-p);
+	if (p!=nBase || memcmp(e->sName, pBasis->sName, p)!=0)
+		return 0;
+	return iTail;
+}
+
 #ifdef __cplusplus
 }
 #endif
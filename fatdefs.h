@@ -250,15 +250,19 @@ void SetStartCluster(DirEntry* p, unsigned long s);
 
 
 #define FAT_LFN_UNUSED  0xFFFF
+#define FAT_LFN_LAST_ENTRY    0x40	// or'ed with the sequence nr of the first entry on disk
+#define FAT_LFN_SEQUENCE_MASK 0x1F
+#define FAT_LFN_CHARS         13	// nr of characters per LFN entry
+#define FAT_LFN_MAX_LEN       255	// max. nr of characters in a long filename
 
+// Long filename entries are stored in reverse order in front of the 8.3 entry 
+// (alias) that they belong to, i.e. the entry with FAT_LFN_LAST_ENTRY comes first.
 typedef PACKED struct DirLfnEntry_struct
 {
-	unsigned char   iSequenceNr : 5; // >0; LFN can consist of max. (2^5-1)*(5+6+2) = 403 char's ???
-	unsigned char   bLastEntry  : 1; // 1 if this is last LFN entry of sequence
-	unsigned char   iReserved   : 2; // should be 0
-
+	unsigned char   cSequenceNr; // 1..20, or'ed with FAT_LFN_LAST_ENTRY (FAT_FILE_REMOVED if deleted)
 	unsigned short  ucPart1[5];  // unused unicode should be FAT_LFN_UNUSED
 	DosAttributes	cAttributes; // should be FAT_ATTR_LFN
+	unsigned char   cType;       // should be 0
 	unsigned char   cCheckSum;   // CS of short alias that follows this LFN sequence
 	unsigned short  ucPart2[6];  // unused unicode should be 0xFFFF
 	unsigned short  ucReserved;  // should be 0x0000
@@ -302,6 +306,16 @@ int GetDosFilename(const DirEntry* e, char* buf/*at least 8+1+3+1=13 bytes*/);
 int GetDosVolumeID(const DirEntry* e, char* buf/*at least 8+3+1=13 bytes*/, int bRemoveTrailingSpaces);
 int CompareDosFilename(const DirEntry* e, const char* buf, int len); // 0 if equal
 
+// long filenames (8 bit characters are stored as ISO-8859-1)
+int GetLfnEntryCount(const char* szName, int len); /* nr of LFN entries needed, 0 if not a valid long filename */
+unsigned char GetDosChecksum(const DirEntry* e);
+int CompareLfnEntry(const DirLfnEntry* e, const char* szName, int len); /* 0 if this part of the name is equal */
+void SetLfnEntry(DirLfnEntry* e, const char* szName, int len, int iSequenceNr, unsigned char cCheckSum);
+int SetDosAlias(DirEntry* e, const char* szName, int len, int iTail); /* NAME~N.EXT, without ~N if iTail==0 */
+int SetDosAliasHash(DirEntry* e, const char* szName, int len); /* NAhhhh basis, hhhh is a hash of the long filename */
+int SetDosAliasTail(DirEntry* e, int iTail); /* append ~N to the basis in e */
+int GetDosAliasTail(const DirEntry* e, const DirEntry* pBasis); /* N if e is pBasis with ~N, else 0 */
+
 #ifdef _MSC_VER
 // reset byte packing (for Visual C)
 #pragma pack( pop, enter_fatdefs )
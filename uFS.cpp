@@ -33,6 +33,175 @@ IO_RESULT DeviceIoClock::GetDosStamp(DeviceIoStamp& t)
 
 
 
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceInterface
+
+IO_RESULT BlockDeviceInterface::ReadSectors(unsigned long lba, unsigned int n, char* pData)
+{
+	// default implementation for hardware that can't transfer multiple sectors at once
+	const int iSectorSize = GetSectorSize();
+	IO_RESULT res = IO_OK;
+	while (n-- && res>=IO_OK)
+	{
+		res = ReadSector(lba++, pData);
+		pData += iSectorSize;
+	}
+	return res;
+}
+
+IO_RESULT BlockDeviceInterface::WriteSectors(unsigned long lba, unsigned int n, const char* pData)
+{
+	// default implementation for hardware that can't transfer multiple sectors at once
+	const int iSectorSize = GetSectorSize();
+	IO_RESULT res = IO_OK;
+	while (n-- && res>=IO_OK)
+	{
+		res = WriteSector(lba++, pData);
+		pData += iSectorSize;
+	}
+	return res;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AsyncBlockDeviceInterface
+
+IO_RESULT AsyncBlockDeviceInterface::Wait(BlockDeviceRequest* pRequest)
+{
+	// callbacks of other requests are deferred, see Done()
+	IO_RESULT res = IO_OK;
+	m_nWaiting++;
+	while (pRequest->res==IO_PENDING)
+	{
+		if (PollWait()==m_nDeferred && pRequest->res==IO_PENDING)
+		{
+			res = IO_ERROR; // not submitted to this device
+			break;
+		}
+	}
+	m_nWaiting--;
+	return res>=IO_OK ? pRequest->res : res;
+}
+
+void AsyncBlockDeviceInterface::Done(BlockDeviceRequest* pRequest)
+{
+	// 'res' of the request is set already
+	if (pRequest->pfnDone==NULL)
+		return;
+	if (m_nWaiting==0)
+	{
+		pRequest->pfnDone(pRequest); // may submit new requests
+		return;
+	}
+	pRequest->pNext = NULL;
+	if (m_pDeferredTail!=NULL)
+		m_pDeferredTail->pNext = pRequest;
+	else
+		m_pDeferredHead = pRequest;
+	m_pDeferredTail = pRequest;
+	m_nDeferred++;
+}
+
+void AsyncBlockDeviceInterface::RunDeferred()
+{
+	while (m_nWaiting==0 && m_pDeferredHead!=NULL)
+	{
+		BlockDeviceRequest* p = m_pDeferredHead;
+		m_pDeferredHead = p->pNext;
+		if (m_pDeferredHead==NULL)
+			m_pDeferredTail = NULL;
+		m_nDeferred--;
+		p->pNext = NULL;
+		p->pfnDone(p);
+	}
+}
+
+IO_RESULT AsyncBlockDeviceInterface::Transfer(unsigned long lba, unsigned int n, char* pData, bool bWrite)
+{
+	// synchronous transfer: earlier requests for the same sectors complete first
+	BlockDeviceRequest request;
+	request.lba = lba;
+	request.n = n;
+	request.pData = pData;
+	request.bWrite = bWrite;
+	const IO_RESULT res = Submit(&request);
+	if (res<IO_OK)
+		return res;
+	return Wait(&request);
+}
+
+IO_RESULT AsyncBlockDeviceInterface::ReadSector(unsigned long lba, char* pData)
+{
+	return Transfer(lba, 1, pData, false);
+}
+
+IO_RESULT AsyncBlockDeviceInterface::WriteSector(unsigned long lba, const char* pData)
+{
+	return Transfer(lba, 1, (char*)pData, true);
+}
+
+IO_RESULT AsyncBlockDeviceInterface::ReadSectors(unsigned long lba, unsigned int n, char* pData)
+{
+	return Transfer(lba, n, pData, false);
+}
+
+IO_RESULT AsyncBlockDeviceInterface::WriteSectors(unsigned long lba, unsigned int n, const char* pData)
+{
+	return Transfer(lba, n, (char*)pData, true);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceAsyncAdapter
+
+IO_RESULT BlockDeviceAsyncAdapter::UnmountHW()
+{
+	// finish the pending requests first
+	while (Poll()>0)
+		;
+	return m_pDevice->UnmountHW();
+}
+
+IO_RESULT BlockDeviceAsyncAdapter::FlushHW()
+{
+	while (Poll()>0)
+		;
+	return m_pDevice->FlushHW();
+}
+
+IO_RESULT BlockDeviceAsyncAdapter::Submit(BlockDeviceRequest* pRequest)
+{
+	if (pRequest->n==0 || pRequest->pData==NULL)
+		return IO_ERROR;
+	pRequest->res = IO_PENDING;
+	pRequest->pNext = NULL;
+	if (m_pTail!=NULL)
+		m_pTail->pNext = pRequest;
+	else
+		m_pHead = pRequest;
+	m_pTail = pRequest;
+	m_nPending++;
+	return IO_PENDING;
+}
+
+int BlockDeviceAsyncAdapter::Poll()
+{
+	// carry out one request, so the caller regains control between transfers
+	RunDeferred();
+	BlockDeviceRequest* p = m_pHead;
+	if (p==NULL)
+		return m_nDeferred;
+	m_pHead = p->pNext;
+	if (m_pHead==NULL)
+		m_pTail = NULL;
+	m_nPending--;
+	p->pNext = NULL;
+
+	p->res = p->bWrite ? m_pDevice->WriteSectors(p->lba, p->n, p->pData) : m_pDevice->ReadSectors(p->lba, p->n, p->pData);
+	Done(p);
+	return m_nPending + m_nDeferred;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // DeviceIoDriver
 
@@ -42,11 +211,26 @@ IO_RESULT DeviceIoDriver::LoadSector(unsigned long lba, char** pData, bool bWrit
 	return m_pManager->LoadSector(m_pHal, lba, pData, bWritable, bPreLoad);
 }
 
+IO_RESULT DeviceIoDriver::LoadCachedSector(unsigned long lba, char** pData)
+{
+	return m_pManager->LoadCachedSector(m_pHal, lba, pData);
+}
+
 IO_RESULT DeviceIoDriver::UnloadSector(char* pData/*, bool bFlush*/)
 {
 	return m_pManager->UnloadSector(pData/*, bFlush*/);
 }
 
+IO_RESULT DeviceIoDriver::DiscardSectors(unsigned long lba, unsigned long n, const char* pData)
+{
+	return m_pManager->DiscardSectors(m_pHal, lba, n, pData);
+}
+
+IO_RESULT DeviceIoDriver::MergeLockedSectors(unsigned long lba, unsigned long n, char* pData)
+{
+	return m_pManager->MergeLockedSectors(m_pHal, lba, n, pData);
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // DeviceIoManager
@@ -266,6 +450,15 @@ IO_RESULT DeviceIoManager::FileExist(const char* szFilename)
 	return res;
 }
 
+IO_RESULT DeviceIoManager::GetFileInfo(const char* szPath, DeviceIoFileInfo& info)
+{
+	IO_RESULT res = IO_DEVICE_NOT_FOUND;
+	DeviceIoDriver* p = GetFS(szPath, &szPath);
+	if (p)
+		res = p->GetFileInfo(szPath, info);
+	return res;
+}
+
 IO_RESULT DeviceIoManager::CreateDirectory(const char* szPath)
 {
 	TRACEUFS1("create directory %s\n",szPath);
@@ -276,6 +469,63 @@ IO_RESULT DeviceIoManager::CreateDirectory(const char* szPath)
 	return res;
 }
 
+IO_RESULT DeviceIoManager::CreateDirectories(const char* szPath)
+{
+	TRACEUFS1("create directories %s\n",szPath);
+	IO_RESULT res = IO_DEVICE_NOT_FOUND;
+	DeviceIoDriver* p = GetFS(szPath, &szPath);
+	if (p)
+		res = p->CreateDirectories(szPath);
+	return res;
+}
+
+IO_RESULT DeviceIoManager::CreateFiles(const char* szDirPath, const char* const* pszNames, const unsigned char* pAttributes, int nFiles, IO_RESULT* pResults)
+{
+	// create nFiles empty files in directory szDirPath (e.g. \ATA\0\LOGS)
+	TRACEUFS2("create %d files in %s\n",nFiles,szDirPath);
+	IO_RESULT res = IO_DEVICE_NOT_FOUND;
+	DeviceIoDriver* p = GetFS(szDirPath, &szDirPath);
+	if (p)
+		res = p->CreateFiles(szDirPath, pszNames, pAttributes, nFiles, pResults);
+	return res;
+}
+
+IO_RESULT DeviceIoManager::DeleteTree(const char* szPath, unsigned long lFlags)
+{
+	TRACEUFS1("delete tree %s\n",szPath);
+	IO_RESULT res = IO_DEVICE_NOT_FOUND;
+	DeviceIoDriver* p = GetFS(szPath, &szPath);
+	if (p)
+		res = p->DeleteTree(szPath, lFlags);
+	return res;
+}
+
+IO_RESULT DeviceIoManager::CompactDirectory(const char* szDirPath)
+{
+	TRACEUFS1("compact directory %s\n",szDirPath);
+	IO_RESULT res = IO_DEVICE_NOT_FOUND;
+	DeviceIoDriver* p = GetFS(szDirPath, &szDirPath);
+	if (p)
+		res = p->CompactDirectory(szDirPath);
+	return res;
+}
+
+IO_RESULT DeviceIoManager::Rename(const char* szFromPath, const char* szToPath)
+{
+	TRACEUFS2("rename %s to %s\n",szFromPath,szToPath);
+	IO_RESULT res = IO_DEVICE_NOT_FOUND;
+	DeviceIoDriver* p = GetFS(szFromPath, &szFromPath);
+	if (p)
+	{
+		// cannot move entries between devices
+		if (GetFS(szToPath, &szToPath)!=p)
+			res = IO_ILLEGAL_DEVICE;
+		else
+			res = p->Rename(szFromPath, szToPath);
+	}
+	return res;
+}
+
 IO_RESULT DeviceIoManager::DeleteFile(const char* szPath, unsigned long lFlags)
 {
 	TRACEUFS1("delete file %s\n",szPath);
@@ -333,15 +583,84 @@ IO_RESULT DeviceIoManager::Flush()
 	if(res<IO_OK)
 		return res;
 	
+	BlockDeviceInterface* pPrevHal = NULL;
 	while (p)
 	{
-		p->Flush();
+		IO_RESULT r = p->Flush();
+		// volumes on the same device share their hardware interface
+		BlockDeviceInterface* pHal = p->GetHal();
+		if (r>=IO_OK && pHal!=NULL && pHal!=pPrevHal)
+			r = pHal->FlushHW();
+		pPrevHal = pHal;
+		if (res>=IO_OK)
+			res = r;
 #if MAX_ALLOWED_DRIVERS>1
 		p = p->GetNextDriver();
 #else
 		p = NULL;
 #endif
 	}
+	return res;
+}
+
+IO_RESULT DeviceIoManager::OpenDirectory(const char* szPath, DeviceIoDirectory& dir)
+{
+	TRACEUFS1("open directory %s\n",szPath);
+	IO_RESULT res = IO_DEVICE_NOT_FOUND;
+	dir.Close();
+	DeviceIoDriver* p = GetFS(szPath, &szPath);
+	if (p)
+		res = p->OpenDirectory(szPath, dir);
+	return res;
+}
+
+IO_RESULT DeviceIoManager::OpenDirectory(const DeviceIoDirectory& dir, const char* szPath, DeviceIoDirectory& subDir)
+{
+	if (!dir.IsOpen())
+		return IO_INVALID_HANDLE;
+	// copy first; dir and subDir may refer to the same object
+	DeviceIoDriver* p = dir.m_pDriver;
+	const unsigned long lDir = dir.m_lDir;
+	subDir.Close();
+	return p->OpenDirectoryAt(lDir, szPath, subDir);
+}
+
+IO_RESULT DeviceIoManager::OpenFile(const DeviceIoDirectory& dir, const char* szPath, DeviceIoFile& f, unsigned long lFlags)
+{
+	TRACEUFS1("open or create file %s (relative)\n",szPath);
+	if (!dir.IsOpen())
+		return IO_INVALID_HANDLE;
+	return dir.m_pDriver->OpenFileAt(dir.m_lDir, szPath, f, lFlags);
+}
+
+IO_RESULT DeviceIoManager::FileExist(const DeviceIoDirectory& dir, const char* szFilename)
+{
+	if (!dir.IsOpen())
+		return IO_INVALID_HANDLE;
+	return dir.m_pDriver->FileExistAt(dir.m_lDir, szFilename);
+}
+
+IO_RESULT DeviceIoManager::GetFileInfo(const DeviceIoDirectory& dir, const char* szPath, DeviceIoFileInfo& info)
+{
+	if (!dir.IsOpen())
+		return IO_INVALID_HANDLE;
+	return dir.m_pDriver->GetFileInfoAt(dir.m_lDir, szPath, info);
+}
+
+IO_RESULT DeviceIoManager::CreateDirectory(const DeviceIoDirectory& dir, const char* szPath)
+{
+	TRACEUFS1("create directory %s (relative)\n",szPath);
+	if (!dir.IsOpen())
+		return IO_INVALID_HANDLE;
+	return dir.m_pDriver->CreateDirectoryAt(dir.m_lDir, szPath);
+}
+
+IO_RESULT DeviceIoManager::DeleteFile(const DeviceIoDirectory& dir, const char* szPath, unsigned long lFlags)
+{
+	TRACEUFS1("delete file %s (relative)\n",szPath);
+	if (!dir.IsOpen())
+		return IO_INVALID_HANDLE;
+	return dir.m_pDriver->DeleteFileAt(dir.m_lDir, szPath, lFlags);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -354,15 +673,21 @@ void BlockDeviceCache::Reset()
 		m_entries[i].Reset();
 }
 
-char* BlockDeviceCache::Lock(BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout)
+char* BlockDeviceCache::Lock(BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout, IO_RESULT* pResult)
 {
+	// *pResult (optional) returns IO_CACHE_FULL when no entry was free, or the
+	// error of reading the sector.
 	int i;
 	char* p = NULL;
 	CacheEntry* pBestMatch = NULL;
 	for (i=0; i<sizeof(m_entries)/sizeof(m_entries[0]); i++)
 	{
 		p = m_entries[i].LockDataOnMatch(pDev, lba, bWritable, timeout);
-		if (p) return p;
+		if (p)
+		{
+			if (pResult) *pResult = IO_OK;
+			return p;
+		}
 	}
 	for (i=0; i<sizeof(m_entries)/sizeof(m_entries[0]); i++)
 	{
@@ -399,7 +724,9 @@ char* BlockDeviceCache::Lock(BlockDeviceInterface* pDev, unsigned long lba, bool
 		}
 	}
 	if (pBestMatch)
-		p = pBestMatch->LockDataIfFree(pDev, lba, bWritable, bPreLoad, timeout, true);
+		p = pBestMatch->LockDataIfFree(pDev, lba, bWritable, bPreLoad, timeout, true, pResult);
+	else if (pResult)
+		*pResult = IO_CACHE_FULL;
 #ifdef TRACE_UFS_CACHE
 //	TRACEUFS2("Cache %i: lba=%li\n",(pBestMatch?((int)(pBestMatch)-(int)m_entries)/sizeof(m_entries[0]):-1),lba);
 #ifdef _DEBUG
@@ -412,6 +739,17 @@ char* BlockDeviceCache::Lock(BlockDeviceInterface* pDev, unsigned long lba, bool
 	return p;
 }
 
+char* BlockDeviceCache::LockIfCached(BlockDeviceInterface* pDev, unsigned long lba, unsigned long timeout)
+{
+	// same as Lock(), but never reads from the device
+	for (int i=0; i<CACHE_SIZE; i++)
+	{
+		char* p = m_entries[i].LockDataOnMatch(pDev, lba, false, timeout);
+		if (p) return p;
+	}
+	return NULL;
+}
+
 
 IO_RESULT BlockDeviceCache::Unlock(char* pData/*, bool bFlush*/)
 {
@@ -426,16 +764,54 @@ IO_RESULT BlockDeviceCache::Unlock(char* pData/*, bool bFlush*/)
 	return IO_NOMATCH_ENTRY;
 }
 
+IO_RESULT BlockDeviceCache::Discard(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, const char* pData)
+{
+	// Used after sectors were written directly to the device. The cache 
+	// writes through, so unlocked entries can be dropped without loosing data.
+	// Entries that are still locked (by other handles of the same file) are 
+	// not read from the device again. They take the new contents from pData
+	// (the data that was written), or are left alone if pData is NULL.
+	// Locked entries that are dirty must be saved by their owner first.
+	IO_RESULT res = IO_OK;
+	for (int i=0; i<CACHE_SIZE && res>=IO_OK; i++)
+		res = m_entries[i].DiscardOnMatch(pDev, lba, n, pData);
+	return res;
+}
+
+IO_RESULT BlockDeviceCache::MergeLocked(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, char* pData)
+{
+	// Used after n sectors were read directly from the device into pData.
+	// Sectors that are locked for writing (by other handles of the same file)
+	// may hold changes that are not written yet, so their cached copy wins.
+	IO_RESULT res = IO_OK;
+	for (int i=0; i<CACHE_SIZE && res>=IO_OK; i++)
+		res = m_entries[i].MergeOnMatch(pDev, lba, n, pData);
+	return res;
+}
+
 IO_RESULT BlockDeviceCache::Flush()
 {
-	IO_RESULT res;
-	for (int i=0; i<sizeof(m_entries)/sizeof(m_entries[0]); i++)
+	// sectors of asynchronous devices are submitted together and waited for once
+	BlockDeviceRequest requests[CACHE_SIZE];
+	AsyncBlockDeviceInterface* pDevices[CACHE_SIZE];
+	IO_RESULT res = IO_OK;
+	int i;
+	for (i=0; i<CACHE_SIZE; i++)
 	{
-		res = m_entries[i].Flush();
-		if (res<IO_OK)
-			return res; // either OK or some error
+		pDevices[i] = NULL;
+		if (res>=IO_OK)
+			res = m_entries[i].Flush(requests[i], pDevices[i]);
 	}
-	return IO_OK;
+	for (i=0; i<CACHE_SIZE; i++)
+	{
+		if (pDevices[i]!=NULL)
+		{
+			IO_RESULT r = pDevices[i]->Wait(&requests[i]);
+			if (res>=IO_OK)
+				res = r; // either OK or some error
+		}
+	}
+	return res;
 }
 
 void BlockDeviceCache::CacheEntry::Reset()
@@ -483,7 +859,7 @@ char* BlockDeviceCache::CacheEntry::LockDataOnMatch( BlockDeviceInterface* pDev,
 	return p;
 }
 
-char* BlockDeviceCache::CacheEntry::LockDataIfFree( BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout, bool bEntryIsLocked)
+char* BlockDeviceCache::CacheEntry::LockDataIfFree( BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout, bool bEntryIsLocked, IO_RESULT* pResult)
 {
 	IO_RESULT res = IO_ERROR;
 	char* p = NULL;
@@ -523,6 +899,7 @@ char* BlockDeviceCache::CacheEntry::LockDataIfFree( BlockDeviceInterface* pDev,
 	}
 	ASSERT_ME;
 	UnlockEntry();
+	if (pResult) *pResult = res;
 	return p;
 }
 
@@ -563,7 +940,7 @@ IO_RESULT BlockDeviceCache::CacheEntry::Unlock(char* pData/*, bool bFlush*/, uns
 	return res;
 }
 
-IO_RESULT BlockDeviceCache::CacheEntry::Flush()
+IO_RESULT BlockDeviceCache::CacheEntry::Flush(BlockDeviceRequest& request, AsyncBlockDeviceInterface*& pDevice)
 {
 	IO_RESULT res = IO_OK;
 //	LockEntry();
@@ -577,7 +954,20 @@ IO_RESULT BlockDeviceCache::CacheEntry::Flush()
 #ifdef TRACE_UFS_CACHE
 			TRACEUFS1("Writing lba=%li\n",m_lba);
 #endif
-			res = m_pDev->WriteSector(m_lba, m_pData);
+			unsigned long lba = m_lba;
+			pDevice = m_pDev->GetAsyncDevice(lba);
+			if (pDevice!=NULL)
+			{
+				request.lba = lba;
+				request.n = 1;
+				request.pData = m_pData;
+				request.bWrite = true;
+				res = pDevice->Submit(&request);
+				if (res<IO_OK)
+					pDevice = NULL;
+			}
+			else
+				res = m_pDev->WriteSector(m_lba, m_pData);
 		}
 /*		else
 		{
@@ -600,6 +990,51 @@ IO_RESULT BlockDeviceCache::CacheEntry::Flush()
 */	return res;
 }
 
+IO_RESULT BlockDeviceCache::CacheEntry::DiscardOnMatch(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, const char* pData)
+{
+	IO_RESULT res = IO_OK;
+	LockEntry();
+	ASSERT_ME;
+	if (m_pDev==pDev && m_lba>=lba && m_lba-lba<n)
+	{
+		if (IsFree())
+		{
+#ifdef TRACE_UFS_CACHE
+			TRACEUFS1("Discard lba=%li\n",m_lba);
+#endif
+			m_pDev = NULL;
+			m_bWritable = false;
+		}
+		else if (pData)
+		{
+			// another handle of the file holds this sector; give it the new contents
+#ifdef TRACE_UFS_CACHE
+			TRACEUFS1("Update lba=%li\n",m_lba);
+#endif
+			memcpy(m_pData, pData + (m_lba-lba)*SECTOR_SIZE, SECTOR_SIZE);
+		}
+	}
+	ASSERT_ME;
+	UnlockEntry();
+	return res;
+}
+
+IO_RESULT BlockDeviceCache::CacheEntry::MergeOnMatch(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, char* pData)
+{
+	LockEntry();
+	ASSERT_ME;
+	if (m_pDev==pDev && m_lba>=lba && m_lba-lba<n && !IsFree() && m_bWritable)
+	{
+#ifdef TRACE_UFS_CACHE
+		TRACEUFS1("Merge lba=%li\n",m_lba);
+#endif
+		memcpy(pData + (m_lba-lba)*SECTOR_SIZE, m_pData, SECTOR_SIZE);
+	}
+	ASSERT_ME;
+	UnlockEntry();
+	return IO_OK;
+}
+
 bool BlockDeviceCache::CacheEntry::LockEntry(unsigned long timeout)
 {
 #ifdef UFS_MULTI_THREADED
@@ -618,20 +1053,13 @@ bool BlockDeviceCache::CacheEntry::LockEntry(unsigned long timeout)
 	return true;
 }
 
-char* BlockDeviceCache::CacheEntry::LockData(unsigned long timeout)
+char* BlockDeviceCache::CacheEntry::LockData(unsigned long /*timeout*/)
 {
-#ifdef UFS_MULTI_THREADED
-	// TODO: must implement timed semaphores for multithreaded apps.
-	// For the time being we just fail immediatly if entry is locked!
-	timeout = 0;
-
-	while (m_lockData) 
-		if (timeout==0) 
-			return NULL;
-#else
-	ASSERT(m_lockData==0);
-#endif
-	m_lockData=1;
+	// Handles of the same file may lock the same sector, so the data locks are
+	// counted (also in multithreaded apps). The caller holds the entry lock, 
+	// which serializes the changes of the count.
+	// TODO: distinguish between reader and writer locks for multithreaded apps.
+	m_lockData++;
 	return m_pData;
 }
 
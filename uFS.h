@@ -103,6 +103,7 @@
 #define IO_FILE_OR_DIR_EXISTS		4
 #define IO_ALREADY_CLOSED			5
 #define IO_NOMATCH_ENTRY			6
+#define IO_PENDING					7			// asynchronous request not completed yet
 #define IO_ERROR					-1			// recoverable errors start here
 #define IO_DISK_FULL				-2
 #define IO_FILE_NOT_FOUND			-3
@@ -118,6 +119,8 @@
 #define IO_NOT_A_DIRECTORY			-13
 #define IO_DIRECTORY_NOT_EMPTY		-14
 #define IO_WRONG_ATTRIBUTES			-15
+#define IO_BUFFER_FULL				-16			// data was dropped, see DeviceIoStreamWriter
+#define IO_CACHE_FULL				-17			// all cache pages are locked
 #define IO_CORRUPT_FAT				-100		// serious errors start here (i.e. non recoverable)
 #define IO_ILLEGAL_LBA				-101
 #define IO_FAILED_TO_LOAD_DRIVER	-102
@@ -135,11 +138,13 @@
 #define IO_FILE_WRITABLE	0x00010000
 #define IO_FILE_RESET		0x00020000 // delete file contents while opening file
 #define IO_FILE_CREATE		0x00040000 // create file when it doesn't exist while opening
+#define IO_FILE_DIRECT		0x00080000 // transfer whole sectors between user buffer and device, bypassing the cache
 #define IO_FILE_STATE_MASK	0x0000ffff
 #define IO_FILE_UNUSED		0xffffffff
 
 // Device mounting flags
 #define IO_MOUNT_WRITABLE	0x00000001
+#define IO_MOUNT_DIRECT		0x00000002 // bypass caching by the host OS (if the interface supports it)
 
 #ifndef ASSERT_ME
 	#ifdef _DEBUG
@@ -159,6 +164,7 @@ class DeviceIoManager;
 class DeviceIoDriverFactory;
 class BlockDeviceCache;
 class DeviceIoFile;
+class DeviceIoDirectory;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Seek() mode values
@@ -170,6 +176,21 @@ enum seekMode
 	seekCurrent = -2
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// SetUpdatePolicy() values
+//
+// Decide when Flush() writes the size and start cluster of a file to its 
+// directory entry. Close() always updates the entry.
+
+enum updatePolicy
+{
+	updateOnFlush = 0,	// every Flush() (default)
+	updateBytes,		// the file grew by at least lInterval bytes since the last update
+	updateClusters,		// the file grew by at least lInterval clusters since the last update
+	updateOnClose,		// only when the file is closed, or the volume is flushed
+	updateTimer			// at least lInterval seconds elapsed since the last update (see DeviceIoClock)
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // DeviceIoClock
 //
@@ -197,6 +218,31 @@ public:
 	virtual IO_RESULT GetDosStamp(DeviceIoStamp& t);
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoVector
+//
+// One buffer of a scatter/gather transfer (see DeviceIoFile::ReadV/WriteV).
+
+struct DeviceIoVector
+{
+	char* pBuf;		// segment data (only read from by WriteV)
+	unsigned int n;	// segment length in bytes (may be zero)
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoFileInfo
+//
+// File or directory properties, as returned by DeviceIoManager::GetFileInfo().
+
+struct DeviceIoFileInfo
+{
+	unsigned long lSize;			// file size in bytes (0 for directories)
+	unsigned long lStartCluster;	// first cluster of the data (0 for empty files)
+	unsigned char cAttributes;		// attribute bits (FAT_ATTR_xxx compatible)
+	DeviceIoStamp created;			// time of creation
+	DeviceIoStamp modified;			// time of last modification
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // BlockDeviceInterface
 //
@@ -213,6 +259,14 @@ public:
 // Another useful application, is to replace the hardware interface with
 // an interface that mimics a device using only software. Such a virtual disk
 // is ideal for 'early bird' testing, without accessing the actual hardware.
+// ReadSectors() and WriteSectors() transfer sectors one by one by default; 
+// override them if the hardware can transfer more sectors with a single command.
+// FlushHW() is called by DeviceIoManager::Flush(); override it if the hardware
+// (or host OS) keeps written data in a volatile cache.
+// GetAsyncDevice() gives the asynchronous device (if any) that holds sector
+// lba, and translates lba to the numbering of that device.
+
+class AsyncBlockDeviceInterface;
 
 class BlockDeviceInterface
 {
@@ -221,11 +275,137 @@ public:
 	virtual IO_RESULT UnmountHW(/*long hSubDevice=-1*/) = 0;
 	virtual IO_RESULT ReadSector(unsigned long lba, char* pData) = 0;
 	virtual IO_RESULT WriteSector(unsigned long lba, const char* pData) = 0;
+	virtual IO_RESULT ReadSectors(unsigned long lba, unsigned int n, char* pData); // n consecutive sectors
+	virtual IO_RESULT WriteSectors(unsigned long lba, unsigned int n, const char* pData); // n consecutive sectors
+	virtual IO_RESULT FlushHW() { return IO_OK; } // commit written sectors to the medium
+	virtual IO_RESULT TrimHW(unsigned long /*lba*/, unsigned long /*n*/) { return IO_OK; } // n sectors are unused, the medium may reclaim them (their contents become undefined)
+	virtual AsyncBlockDeviceInterface* GetAsyncDevice(unsigned long& /*lba*/) { return NULL; }
 
 	virtual const char* GetDriverID(/*long hSubDevice=-1*/) = 0;
 	virtual int GetSectorSize(/*long hSubDevice=-1*/) = 0;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceRequest
+//
+// Transfer of n consecutive sectors, submitted to an AsyncBlockDeviceInterface.
+// The request and its data must remain valid until it is completed. On 
+// completion the device sets 'res' and then calls pfnDone (if not NULL).
+
+struct BlockDeviceRequest;
+typedef void (*BLOCK_DEVICE_CALLBACK)(BlockDeviceRequest* pRequest);
+
+struct BlockDeviceRequest
+{
+	BlockDeviceRequest()
+	{
+		lba = 0;
+		n = 0;
+		pData = NULL;
+		bWrite = false;
+		pfnDone = NULL;
+		pContext = NULL;
+		res = IO_OK;
+		pNext = NULL;
+	}
+
+	unsigned long lba;				// first sector
+	unsigned int n;					// nr of sectors
+	char* pData;					// n sectors of data (only read from by writes)
+	bool bWrite;
+	BLOCK_DEVICE_CALLBACK pfnDone;	// completion callback, or NULL
+	void* pContext;					// free for use by the submitter
+	volatile IO_RESULT res;			// IO_PENDING until the request is completed
+	BlockDeviceRequest* pNext;		// used by the device while the request is pending
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// AsyncBlockDeviceInterface
+//
+// Extension of BlockDeviceInterface for hardware that can transfer sectors 
+// while the CPU continues. Submit() queues a request and returns at once. 
+// Poll() must be called regularly (e.g. from the main loop): it completes 
+// the requests that are done and calls their callbacks, so callbacks never
+// run in interrupt context. Requests that access the same sectors complete 
+// in the order of submission; others may complete in any order.
+// The synchronous ReadSector(s)/WriteSector(s) calls (used by the cache and 
+// the drivers) submit a request and poll until it is completed.
+// Wait() completes only the request it waits for: the callbacks of other 
+// requests that complete meanwhile are deferred to the next Poll() outside
+// Wait(). So callbacks never run while the file system is busy (e.g. holds
+// cache locks), and they may call the file system.
+// Implementations complete a request with Done(), which takes care of this.
+
+class AsyncBlockDeviceInterface : public BlockDeviceInterface
+{
+public:
+	AsyncBlockDeviceInterface()
+	{
+		m_nWaiting = 0;
+		m_pDeferredHead = m_pDeferredTail = NULL;
+		m_nDeferred = 0;
+	}
+
+	virtual IO_RESULT Submit(BlockDeviceRequest* pRequest) = 0; // IO_PENDING, or an error if refused
+	virtual int Poll() = 0; // nr of requests that are still pending (including deferred callbacks)
+	virtual int PollWait() { return Poll(); } // may block until a request completes (used by Wait())
+
+	IO_RESULT Wait(BlockDeviceRequest* pRequest);
+	virtual AsyncBlockDeviceInterface* GetAsyncDevice(unsigned long& /*lba*/) { return this; }
+
+	virtual IO_RESULT ReadSector(unsigned long lba, char* pData);
+	virtual IO_RESULT WriteSector(unsigned long lba, const char* pData);
+	virtual IO_RESULT ReadSectors(unsigned long lba, unsigned int n, char* pData);
+	virtual IO_RESULT WriteSectors(unsigned long lba, unsigned int n, const char* pData);
+
+protected:
+	IO_RESULT Transfer(unsigned long lba, unsigned int n, char* pData, bool bWrite);
+	void Done(BlockDeviceRequest* pRequest);	// call the callback of a completed request, or defer it within Wait()
+	void RunDeferred();	// call the deferred callbacks (at the start of Poll())
+
+	int m_nWaiting;		// nr of nested Wait() calls
+	BlockDeviceRequest* m_pDeferredHead;	// completed requests of which the callback is deferred
+	BlockDeviceRequest* m_pDeferredTail;
+	int m_nDeferred;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// BlockDeviceAsyncAdapter
+//
+// Gives a synchronous BlockDeviceInterface the asynchronous interface.
+// Submitted requests are queued and carried out one at a time by Poll(),
+// so that a producer can submit a write and continue until the main loop
+// finds time to poll.
+
+class BlockDeviceAsyncAdapter : public AsyncBlockDeviceInterface
+{
+public:
+	BlockDeviceAsyncAdapter(BlockDeviceInterface* pDevice)
+	{
+		m_pDevice = pDevice;
+		m_pHead = m_pTail = NULL;
+		m_nPending = 0;
+	}
+
+	virtual IO_RESULT MountHW(void* custom=0, unsigned long lMountFlags=0)
+		{ return m_pDevice->MountHW(custom, lMountFlags); }
+	virtual IO_RESULT UnmountHW();
+	virtual IO_RESULT FlushHW();
+	virtual const char* GetDriverID()
+		{ return m_pDevice->GetDriverID(); }
+	virtual int GetSectorSize()
+		{ return m_pDevice->GetSectorSize(); }
+
+	virtual IO_RESULT Submit(BlockDeviceRequest* pRequest);
+	virtual int Poll();
+
+protected:
+	BlockDeviceInterface* m_pDevice;
+	BlockDeviceRequest* m_pHead;	// next request to carry out
+	BlockDeviceRequest* m_pTail;	// last submitted request
+	int m_nPending;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // DeviceIoDriver
 //
@@ -267,6 +447,9 @@ public:
 
 	virtual IO_RESULT LoadSector(unsigned long lba, char** ppData, bool bWritable, bool bPreLoad);
 	virtual IO_RESULT UnloadSector(char* pData/*, bool bFlush=true*/);
+	IO_RESULT LoadCachedSector(unsigned long lba, char** ppData); // IO_NOMATCH_ENTRY if not cached
+	IO_RESULT DiscardSectors(unsigned long lba, unsigned long n, const char* pData=NULL); // drop cached copies after writing pData around the cache
+	IO_RESULT MergeLockedSectors(unsigned long lba, unsigned long n, char* pData); // newer cached copies after reading around the cache
 
 //	virtual IO_RESULT GetType() const	// returns IO_DRIVER_TYPE_XXX or IO_ERROR
 //		{ return IO_ERROR; }
@@ -280,8 +463,15 @@ public:
 public:
 	virtual IO_RESULT OpenFile(const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags) = 0;
 	virtual IO_RESULT FileExist(const char* szFilename) = 0; 
+	virtual IO_RESULT GetFileInfo(const char* szFilePath, DeviceIoFileInfo& info) = 0;
 	virtual IO_RESULT CreateDirectory(const char* szFilePath) = 0;
+	virtual IO_RESULT CreateDirectories(const char* szFilePath) = 0; // including missing parents
+	virtual IO_RESULT CreateFiles(const char* szDirPath, const char* const* pszNames, const unsigned char* pAttributes, int nFiles, IO_RESULT* pResults) = 0;
 	virtual IO_RESULT DeleteFile(const char* szFilename, unsigned long lFlags=0) = 0; // also for deleting directories
+	virtual IO_RESULT DeleteTree(const char* szFilePath, unsigned long lFlags=0) = 0; // directory including its contents
+	virtual IO_RESULT Rename(const char* szFromPath, const char* szToPath) = 0; // within the same volume
+	virtual IO_RESULT CompactDirectory(const char* szDirPath) = 0;
+	virtual IO_RESULT OpenDirectory(const char* szDirPath, DeviceIoDirectory& dir) = 0;
 	virtual IO_RESULT GetNrOfFreeSectors(const char* szPath, unsigned long& n) = 0;
 	virtual IO_RESULT GetNrOfSectors(const char* szPath, unsigned long& n) = 0;
 	virtual IO_RESULT Flush() = 0;//Flush driver
@@ -292,10 +482,29 @@ protected:
 	virtual IO_RESULT CloseFile(IO_HANDLE pDriverData) = 0;
 	virtual IO_RESULT ReadFile(IO_HANDLE pDriverData, char* pBuf, unsigned int& n) = 0;
 	virtual IO_RESULT WriteFile(IO_HANDLE pDriverData, const char* pBuf, unsigned int& n) = 0;
+	virtual IO_RESULT ReadFileV(IO_HANDLE pDriverData, const DeviceIoVector* pVec, int nVec, unsigned long& n) = 0;
+	virtual IO_RESULT WriteFileV(IO_HANDLE pDriverData, const DeviceIoVector* pVec, int nVec, unsigned long& n) = 0;
+	virtual IO_RESULT ReadFileAt(IO_HANDLE pDriverData, unsigned long pos, char* pBuf, unsigned int& n) = 0;
+	virtual IO_RESULT WriteFileAt(IO_HANDLE pDriverData, unsigned long pos, const char* pBuf, unsigned int& n) = 0;
+	virtual IO_RESULT MapFile(IO_HANDLE pDriverData, const char*& p, unsigned int& n) = 0;
+	virtual IO_RESULT ReleaseFile(IO_HANDLE pDriverData) = 0;
+	virtual IO_RESULT ReserveFile(IO_HANDLE pDriverData, char*& p, unsigned int& n) = 0;
+	virtual IO_RESULT CommitFile(IO_HANDLE pDriverData, unsigned int nUsed) = 0;
 	virtual IO_RESULT Seek(IO_HANDLE pDriverData, seekMode mode, long pos) = 0;
 	virtual IO_RESULT Tell(IO_HANDLE pDriverData, unsigned long& pos) = 0;
 	virtual IO_RESULT Flush(IO_HANDLE pDriverData) = 0;//Flush file
 	virtual IO_RESULT GetFileSize(IO_HANDLE pDriverData, unsigned long& s) = 0;
+	virtual IO_RESULT PreallocateFile(IO_HANDLE pDriverData, unsigned long n) = 0;
+	virtual IO_RESULT SetUpdatePolicy(IO_HANDLE pDriverData, updatePolicy policy, unsigned long lInterval) = 0;
+	virtual IO_RESULT ReadFileAsync(IO_HANDLE pDriverData, char* pBuf, unsigned int n, BlockDeviceRequest& r, AsyncBlockDeviceInterface*& pDevice) = 0;
+
+	// relative paths (lDir is the driver specific reference of a DeviceIoDirectory)
+	virtual IO_RESULT OpenDirectoryAt(unsigned long lDir, const char* szDirPath, DeviceIoDirectory& dir) = 0;
+	virtual IO_RESULT OpenFileAt(unsigned long lDir, const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags) = 0;
+	virtual IO_RESULT FileExistAt(unsigned long lDir, const char* szFilename) = 0;
+	virtual IO_RESULT GetFileInfoAt(unsigned long lDir, const char* szFilePath, DeviceIoFileInfo& info) = 0;
+	virtual IO_RESULT CreateDirectoryAt(unsigned long lDir, const char* szFilePath) = 0;
+	virtual IO_RESULT DeleteFileAt(unsigned long lDir, const char* szFilename, unsigned long lFlags=0) = 0;
 	
 
 	void SetDeviceIoManager(DeviceIoManager* pManager) 
@@ -350,10 +559,20 @@ public:
 	}
 
 	void Reset();
-	char* Lock(BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout=-1);
+	char* Lock(BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout=-1, IO_RESULT* pResult=NULL);
+	char* LockIfCached(BlockDeviceInterface* pDev, unsigned long lba, unsigned long timeout=-1); // read-only, NULL if not cached
+	IO_RESULT Discard(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, const char* pData=NULL); // forget cached copies of n sectors, locked ones take pData
+	IO_RESULT MergeLocked(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, char* pData); // copy writable locked sectors over pData
 	IO_RESULT Unlock(char* pData/*, bool bFlush*/);
 	IO_RESULT Flush();
 
+	// memory range that holds all sector buffers (e.g. for registering with a device)
+	void GetArena(char*& pArena, unsigned long& nBytes)
+	{
+		pArena = (char*)m_entries;
+		nBytes = sizeof(m_entries);
+	}
+
 protected:
 
 	class CacheEntry
@@ -366,9 +585,11 @@ protected:
 
 		void Reset();
 		char* LockDataOnMatch( BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, unsigned long timeout=-1);
-		char* LockDataIfFree( BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout=-1, bool bEntryIsLocked=false);
+		char* LockDataIfFree( BlockDeviceInterface* pDev, unsigned long lba, bool bWritable, bool bPreLoad, unsigned long timeout=-1, bool bEntryIsLocked=false, IO_RESULT* pResult=NULL);
 		IO_RESULT Unlock(char* pData/*, bool bFlush*/, unsigned timeNow);
-		IO_RESULT Flush();
+		IO_RESULT Flush(BlockDeviceRequest& request, AsyncBlockDeviceInterface*& pDevice); // pDevice!=NULL if the write is submitted to it
+		IO_RESULT DiscardOnMatch(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, const char* pData);
+		IO_RESULT MergeOnMatch(BlockDeviceInterface* pDev, unsigned long lba, unsigned long n, char* pData);
 
 #ifdef _DEBUG
 		void AssertValid(); // check internal structures
@@ -398,7 +619,8 @@ protected:
 		char* LockData(unsigned long timeout=-1);
 		void UnlockData()
 		{
-			m_lockData=0;
+			ASSERT(m_lockData>0);
+			m_lockData--;
 		}
 
 
@@ -413,7 +635,7 @@ protected:
 		unsigned long m_lba;
 		BlockDeviceInterface* m_pDev;
 		unsigned m_tLastAccessTime; // just an incrementing integer for LRU algorithm (Least Recently Used)
-		unsigned m_lockData;	// no distinction yet between reader/writer locks
+		unsigned m_lockData;	// nr of locks on the data (several files may share a sector), no distinction yet between reader/writer locks
 		unsigned m_lockEntry;	// no distinction yet between reader/writer locks
 		bool m_bWritable;		// true if this sector was locked as writable
 	};
@@ -424,6 +646,8 @@ protected:
 ///////////////////////////////////////////////////////////////////////////////
 // DeviceIoFile
 
+struct DeviceIoFileRequest;
+
 class DeviceIoFile
 {
 public:
@@ -432,6 +656,7 @@ public:
 		m_pDriver = NULL;
 		m_pDriverData = NULL;
 		m_lLastResult = IO_OK;
+		m_pRequest = NULL;
 	}
 
 	virtual ~DeviceIoFile()
@@ -460,6 +685,81 @@ public:
 		return m_lLastResult; 
 	}
 
+	// Scatter/gather read and write: transfer the nVec segments in order, 
+	// as if they were one contiguous buffer, at the file position. On return
+	// n holds the total number of bytes transferred. ReadV() returns IO_EOF 
+	// when the segments couldn't be filled because of the end of the file.
+	IO_RESULT ReadV(const DeviceIoVector* pVec, int nVec, unsigned long& n)
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->ReadFileV(m_pDriverData, pVec, nVec, n) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	IO_RESULT WriteV(const DeviceIoVector* pVec, int nVec, unsigned long& n)
+	{	if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->WriteFileV(m_pDriverData, pVec, nVec, n) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	// Positional read and write: transfer n bytes at byte offset 'pos' 
+	// without using or changing the file position. ReadAt() returns IO_EOF 
+	// when n was truncated by the end of the file. WriteAt() may extend the
+	// file, but pos must not lie beyond its end.
+	IO_RESULT ReadAt(unsigned long pos, char* pBuf, unsigned int& n)
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->ReadFileAt(m_pDriverData, pos, pBuf, n) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	IO_RESULT WriteAt(unsigned long pos, const char* pBuf, unsigned int& n)
+	{	if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->WriteFileAt(m_pDriverData, pos, pBuf, n) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	// Zero-copy read: p points into the locked cache sector that holds the
+	// current file position. On input n is the maximum number of bytes
+	// wanted, on return it holds the number of bytes that p refers to, which
+	// never runs beyond the end of the sector. The file position advances 
+	// by n. The data remains valid until Release() or the next operation on
+	// this file. Returns IO_EOF when n was truncated by the end of the file.
+	IO_RESULT MapNext(const char*& p, unsigned int& n)
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->MapFile(m_pDriverData, p, n) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	IO_RESULT Release()
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->ReleaseFile(m_pDriverData) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	// Zero-copy write: p points into the locked cache sector at the current
+	// file position, which can be filled in place. On input n is the maximum
+	// number of bytes wanted, on return it holds the number of bytes that
+	// can be written (up to the end of the sector). The file grows as needed.
+	// CommitWrite() advances the file position by the number of bytes that 
+	// were actually used. Any other operation on this file (except Tell()) 
+	// cancels the reservation, as if CommitWrite(0) was called.
+	IO_RESULT ReserveWrite(char*& p, unsigned int& n)
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->ReserveFile(m_pDriverData, p, n) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	IO_RESULT CommitWrite(unsigned int nUsed)
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->CommitFile(m_pDriverData, nUsed) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
 	IO_RESULT Seek(seekMode mode, long pos)
 	{ 
 		if (m_lLastResult>=IO_OK) 
@@ -488,6 +788,41 @@ public:
 		return m_lLastResult; 
 	}
 
+	// Allocate space for n more bytes beyond the end of the file, without
+	// changing the file size, so that appending doesn't have to look for 
+	// free space. Unused space is released when the file is closed.
+	IO_RESULT Preallocate(unsigned long n)
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->PreallocateFile(m_pDriverData, n) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	// Choose when Flush() updates the directory entry of the file (see 
+	// updatePolicy). The policy applies to all handles of the file.
+	// Other handles and GetFileInfo() see the actual size in the meantime.
+	IO_RESULT SetUpdatePolicy(updatePolicy policy, unsigned long lInterval=0)
+	{ 
+		if (m_lLastResult>=IO_OK) 
+			m_lLastResult = m_pDriver ? m_pDriver->SetUpdatePolicy(m_pDriverData, policy, lInterval) : IO_ERROR; 
+		return m_lLastResult; 
+	}
+
+	// Start reading whole sectors at the (sector aligned) file position 
+	// straight into pBuf, with a request r that is submitted to the
+	// asynchronous device pDevice. At most n bytes are read, up to the first 
+	// discontinuity on disk or the last whole sector of the file. The file
+	// position advances by r.n sectors at once. Returns IO_PENDING, or 
+	// IO_ERROR if this isn't possible (e.g. a synchronous device, an unaligned
+	// position, or changes that the writer of the file didn't save yet); 
+	// then use Read(). The error status of the file is not changed.
+	IO_RESULT ReadAsync(char* pBuf, unsigned int n, BlockDeviceRequest& r, AsyncBlockDeviceInterface*& pDevice)
+	{
+		if (m_lLastResult<IO_OK || m_pDriver==NULL)
+			return IO_ERROR;
+		return m_pDriver->ReadFileAsync(m_pDriverData, pBuf, n, r, pDevice);
+	}
+
 	IO_RESULT GetErrorStatus() const
 	{
 		return m_lLastResult;
@@ -502,9 +837,52 @@ public:
 
 protected:
 //	friend class DeviceIoManager;
+	friend class DeviceIoExecutor;
 	DeviceIoDriver* m_pDriver;		// object that is responsible for carrying out the job
 	IO_HANDLE m_pDriverData;		// handle to driver specific data
 	IO_RESULT m_lLastResult;
+	DeviceIoFileRequest* m_pRequest;	// pending request of a DeviceIoExecutor, or NULL
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoDirectory
+//
+// Opaque handle to a directory on a specific volume. Pass it to the 
+// DeviceIoManager functions that take a DeviceIoDirectory to resolve paths 
+// relative to this directory (paths with a leading backslash still start in 
+// the root of the volume). This saves the path walk from the root for 
+// each call. A handle doesn't occupy any driver resources, so there is no
+// need to close it. It is not updated when the directory is deleted though.
+
+class DeviceIoDirectory
+{
+public:
+	DeviceIoDirectory()
+	{
+		Close();
+	}
+
+	bool IsOpen() const
+	{
+		return m_pDriver!=NULL;
+	}
+
+	void Connect(DeviceIoDriver* pDriver, unsigned long lDir) // called by drivers
+	{
+		m_pDriver = pDriver;
+		m_lDir = lDir;
+	}
+
+	void Close()
+	{
+		m_pDriver = NULL;
+		m_lDir = 0;
+	}
+
+protected:
+	friend class DeviceIoManager;
+	DeviceIoDriver* m_pDriver;		// volume driver that resolved the directory
+	unsigned long m_lDir;			// driver specific reference (e.g. first cluster)
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -549,22 +927,55 @@ public:
 	// this is your starting point for creating files
 	IO_RESULT OpenFile(const char* szPath, DeviceIoFile& f, unsigned long lFlags);
 	IO_RESULT FileExist(const char* szFilename);
+	IO_RESULT GetFileInfo(const char* szFilePath, DeviceIoFileInfo& info); // doesn't need a file handle
 	IO_RESULT CreateDirectory(const char* szFilePath);
+	IO_RESULT CreateDirectories(const char* szFilePath); // like CreateDirectory, but also creates missing parents
+	IO_RESULT CreateFiles(const char* szDirPath, const char* const* pszNames, const unsigned char* pAttributes, int nFiles, IO_RESULT* pResults); // returns nr of created files
 	IO_RESULT DeleteFile(const char* szFilename, unsigned long lFlags=0);
+	IO_RESULT DeleteTree(const char* szFilePath, unsigned long lFlags=0);
+	IO_RESULT Rename(const char* szFromPath, const char* szToPath); // paths must be on the same volume
+	IO_RESULT CompactDirectory(const char* szDirPath); // no open files allowed in this directory
 	IO_RESULT GetNrOfFreeSectors(const char* szPath, unsigned long& n);
 	IO_RESULT GetNrOfSectors(const char* szPath, unsigned long& n);
 	IO_RESULT Flush();
 
+	// directory handles and operations relative to an open directory
+	IO_RESULT OpenDirectory(const char* szPath, DeviceIoDirectory& dir);
+	IO_RESULT OpenDirectory(const DeviceIoDirectory& dir, const char* szPath, DeviceIoDirectory& subDir);
+	IO_RESULT OpenFile(const DeviceIoDirectory& dir, const char* szPath, DeviceIoFile& f, unsigned long lFlags);
+	IO_RESULT FileExist(const DeviceIoDirectory& dir, const char* szFilename);
+	IO_RESULT GetFileInfo(const DeviceIoDirectory& dir, const char* szFilePath, DeviceIoFileInfo& info);
+	IO_RESULT CreateDirectory(const DeviceIoDirectory& dir, const char* szFilePath);
+	IO_RESULT DeleteFile(const DeviceIoDirectory& dir, const char* szFilename, unsigned long lFlags=0);
+
 	// cached load/unload sector routines
 	IO_RESULT LoadSector(BlockDeviceInterface* pHal, unsigned long lba, char** pData, bool bWritable, bool bPreLoad)
 	{
-		*pData = m_blockDeviceCache.Lock(pHal, lba, bWritable, bPreLoad);
-		return *pData ? IO_OK : IO_ERROR;
+		IO_RESULT res = IO_ERROR;
+		*pData = m_blockDeviceCache.Lock(pHal, lba, bWritable, bPreLoad, (unsigned long)-1, &res);
+		return res; // IO_CACHE_FULL, or the error of reading the sector
+	}
+	IO_RESULT LoadCachedSector(BlockDeviceInterface* pHal, unsigned long lba, char** pData)
+	{
+		*pData = m_blockDeviceCache.LockIfCached(pHal, lba);
+		return *pData ? IO_OK : IO_NOMATCH_ENTRY;
 	}
 	IO_RESULT UnloadSector(char* pData/*, bool bFlush*/)
 	{
 		return m_blockDeviceCache.Unlock(pData/*, bFlush*/);
 	}
+	IO_RESULT DiscardSectors(BlockDeviceInterface* pHal, unsigned long lba, unsigned long n, const char* pData=NULL)
+	{
+		return m_blockDeviceCache.Discard(pHal, lba, n, pData);
+	}
+	IO_RESULT MergeLockedSectors(BlockDeviceInterface* pHal, unsigned long lba, unsigned long n, char* pData)
+	{
+		return m_blockDeviceCache.MergeLocked(pHal, lba, n, pData);
+	}
+	void GetCacheArena(char*& pArena, unsigned long& nBytes)
+	{
+		m_blockDeviceCache.GetArena(pArena, nBytes);
+	}
 
 protected:
 	// we support a cache!
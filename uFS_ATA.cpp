@@ -209,6 +209,10 @@ IO_RESULT DeviceIoDriver_ATA::UnmountSW()
 				res = t; // remember this error, but continue
 		}
 	}
+	// the medium may change before the next mount; the volumes forgot their own
+	// sectors already, the master boot record is the only one read by this driver
+	if (m_pHal!=NULL)
+		DiscardSectors(0, 1);
 	return res;
 }
 
@@ -240,6 +244,33 @@ IO_RESULT DeviceIoDriver_ATA::CreateDirectory(const char* szFilePath)
 	return IO_ERROR; 
 }
 
+IO_RESULT DeviceIoDriver_ATA::CreateDirectories(const char* szFilePath)
+{
+	if (szFilePath[0]=='\\' && szFilePath[2]=='\\')
+	{
+		int iPartition = szFilePath[1] - '0';
+		if (iPartition>=0 && iPartition<m_nMounted)
+		{
+			return m_pVolumes[iPartition]->CreateDirectories(szFilePath+2);
+		}
+	}
+	return IO_ERROR; 
+}
+
+IO_RESULT DeviceIoDriver_ATA::CreateFiles(const char* szDirPath, const char* const* pszNames, const unsigned char* pAttributes, int nFiles, IO_RESULT* pResults)
+{
+	// directory may also be the partition root itself (i.e. \0 without trailing backslash)
+	if (szDirPath[0]=='\\' && (szDirPath[2]=='\\' || szDirPath[2]=='\0'))
+	{
+		int iPartition = szDirPath[1] - '0';
+		if (iPartition>=0 && iPartition<m_nMounted)
+		{
+			return m_pVolumes[iPartition]->CreateFiles(szDirPath+2, pszNames, pAttributes, nFiles, pResults);
+		}
+	}
+	return IO_ERROR; 
+}
+
 IO_RESULT DeviceIoDriver_ATA::DeleteFile(const char* szFilePath, unsigned long lFlags)
 {
 	if (szFilePath[0]=='\\' && szFilePath[2]=='\\')
@@ -253,6 +284,64 @@ IO_RESULT DeviceIoDriver_ATA::DeleteFile(const char* szFilePath, unsigned long l
 	return IO_ERROR; 
 }
 
+IO_RESULT DeviceIoDriver_ATA::DeleteTree(const char* szFilePath, unsigned long lFlags)
+{
+	if (szFilePath[0]=='\\' && szFilePath[2]=='\\')
+	{
+		int iPartition = szFilePath[1] - '0';
+		if (iPartition>=0 && iPartition<m_nMounted)
+		{
+			return m_pVolumes[iPartition]->DeleteTree(szFilePath+2, lFlags);
+		}
+	}
+	return IO_ERROR; 
+}
+
+IO_RESULT DeviceIoDriver_ATA::CompactDirectory(const char* szDirPath)
+{
+	// directory may also be the partition root itself
+	if (szDirPath[0]=='\\' && (szDirPath[2]=='\\' || szDirPath[2]=='\0'))
+	{
+		int iPartition = szDirPath[1] - '0';
+		if (iPartition>=0 && iPartition<m_nMounted)
+		{
+			return m_pVolumes[iPartition]->CompactDirectory(szDirPath+2);
+		}
+	}
+	return IO_ERROR; 
+}
+
+IO_RESULT DeviceIoDriver_ATA::Rename(const char* szFromPath, const char* szToPath)
+{
+	if (szFromPath[0]=='\\' && szFromPath[2]=='\\' && szToPath[0]=='\\' && szToPath[2]=='\\')
+	{
+		// cannot move entries between partitions
+		if (szFromPath[1]!=szToPath[1])
+			return IO_ILLEGAL_DEVICE;
+		int iPartition = szFromPath[1] - '0';
+		if (iPartition>=0 && iPartition<m_nMounted)
+		{
+			return m_pVolumes[iPartition]->Rename(szFromPath+2, szToPath+2);
+		}
+	}
+	return IO_ERROR; 
+}
+
+IO_RESULT DeviceIoDriver_ATA::OpenDirectory(const char* szDirPath, DeviceIoDirectory& dir)
+{
+	// directory may also be the partition root itself (i.e. \0 without trailing backslash);
+	// the handle will refer directly to the volume driver
+	if (szDirPath[0]=='\\' && (szDirPath[2]=='\\' || szDirPath[2]=='\0'))
+	{
+		int iPartition = szDirPath[1] - '0';
+		if (iPartition>=0 && iPartition<m_nMounted)
+		{
+			return m_pVolumes[iPartition]->OpenDirectory(szDirPath[2]=='\0' ? "\\" : szDirPath+2, dir);
+		}
+	}
+	return IO_ERROR; 
+}
+
 IO_RESULT DeviceIoDriver_ATA::OpenFile(const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags) 
 {
 	if (szFilePath[0]=='\\' && szFilePath[2]=='\\')
@@ -304,6 +393,19 @@ IO_RESULT DeviceIoDriver_ATA::Flush()
 	return res;
 }
 
+IO_RESULT DeviceIoDriver_ATA::GetFileInfo(const char* szFilePath, DeviceIoFileInfo& info)
+{	
+	if (szFilePath[0]=='\\' && szFilePath[2]=='\\')
+	{
+		int iPartition = szFilePath[1] - '0';
+		if (iPartition>=0 && iPartition<m_nMounted)
+		{
+			return m_pVolumes[iPartition]->GetFileInfo(szFilePath+2, info);
+		}
+	}
+	return IO_ERROR; 
+}
+
 IO_RESULT DeviceIoDriver_ATA::FileExist(const char* szFilePath/*szFilename*/)
 {	
 	if (szFilePath[0]=='\\' && szFilePath[2]=='\\')
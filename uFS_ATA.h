@@ -48,6 +48,19 @@ public:
 	{
 		return m_pHal->WriteSector(m_lStartOfPartition+lba, pData);
 	}
+	virtual IO_RESULT ReadSectors(unsigned long lba, unsigned int n, char* pData)
+	{
+		return m_pHal->ReadSectors(m_lStartOfPartition+lba, n, pData);
+	}
+	virtual IO_RESULT WriteSectors(unsigned long lba, unsigned int n, const char* pData)
+	{
+		return m_pHal->WriteSectors(m_lStartOfPartition+lba, n, pData);
+	}
+	virtual AsyncBlockDeviceInterface* GetAsyncDevice(unsigned long& lba)
+	{
+		lba += m_lStartOfPartition;
+		return m_pHal->GetAsyncDevice(lba);
+	}
 	virtual const char* GetDriverID(/*long hSubDevice=-1*/)
 	{
 		return m_pHal->GetDriverID();
@@ -90,6 +103,7 @@ public:
 	virtual IO_RESULT MountSW(BlockDeviceInterface* pHal, void* custom=NULL, long hDevice=-1);
 	virtual IO_RESULT UnmountSW();
 	virtual IO_RESULT FileExist(const char* szFilename);
+	virtual IO_RESULT GetFileInfo(const char* szFilePath, DeviceIoFileInfo& info);
 	virtual IO_RESULT Lock() { return IO_OK; }
 	virtual IO_RESULT Unlock() { return IO_OK; }
 
@@ -105,18 +119,41 @@ public:
 
 	// DeviceIoFile NOT supported (cannot put files outside partitions)
 	virtual IO_RESULT CreateDirectory(const char* szFilePath);
+	virtual IO_RESULT CreateDirectories(const char* szFilePath);
+	virtual IO_RESULT CreateFiles(const char* szDirPath, const char* const* pszNames, const unsigned char* pAttributes, int nFiles, IO_RESULT* pResults);
 	virtual IO_RESULT OpenFile(const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags);
 	virtual IO_RESULT DeleteFile(const char* szFilename, unsigned long lFlags=0); // also for deleting directories
+	virtual IO_RESULT DeleteTree(const char* szFilePath, unsigned long lFlags=0);
+	virtual IO_RESULT Rename(const char* szFromPath, const char* szToPath);
+	virtual IO_RESULT CompactDirectory(const char* szDirPath);
+	virtual IO_RESULT OpenDirectory(const char* szDirPath, DeviceIoDirectory& dir);
 	virtual IO_RESULT GetNrOfFreeSectors(const char* szPath, unsigned long& n);
 	virtual IO_RESULT GetNrOfSectors(const char* szPath, unsigned long& n);
 	virtual IO_RESULT Flush();
 	virtual IO_RESULT CloseFile(IO_HANDLE /*pDriverData*/) { return IO_ERROR; }
+	virtual IO_RESULT OpenDirectoryAt(unsigned long /*lDir*/, const char* /*szDirPath*/, DeviceIoDirectory& /*dir*/) { return IO_ERROR; }
+	virtual IO_RESULT OpenFileAt(unsigned long /*lDir*/, const char* /*szFilePath*/, DeviceIoFile& /*ioFile*/, unsigned long /*lFlags*/) { return IO_ERROR; }
+	virtual IO_RESULT FileExistAt(unsigned long /*lDir*/, const char* /*szFilename*/) { return IO_ERROR; }
+	virtual IO_RESULT GetFileInfoAt(unsigned long /*lDir*/, const char* /*szFilePath*/, DeviceIoFileInfo& /*info*/) { return IO_ERROR; }
+	virtual IO_RESULT CreateDirectoryAt(unsigned long /*lDir*/, const char* /*szFilePath*/) { return IO_ERROR; }
+	virtual IO_RESULT DeleteFileAt(unsigned long /*lDir*/, const char* /*szFilename*/, unsigned long /*lFlags*/=0) { return IO_ERROR; }
 	virtual IO_RESULT ReadFile(IO_HANDLE /*pDriverData*/, char* /*pBuf*/, unsigned int& /*n*/) { return IO_ERROR; }
 	virtual IO_RESULT WriteFile(IO_HANDLE /*pDriverData*/, const char* /*pBuf*/, unsigned int& /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT ReadFileV(IO_HANDLE /*pDriverData*/, const DeviceIoVector* /*pVec*/, int /*nVec*/, unsigned long& /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT WriteFileV(IO_HANDLE /*pDriverData*/, const DeviceIoVector* /*pVec*/, int /*nVec*/, unsigned long& /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT ReadFileAt(IO_HANDLE /*pDriverData*/, unsigned long /*pos*/, char* /*pBuf*/, unsigned int& /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT WriteFileAt(IO_HANDLE /*pDriverData*/, unsigned long /*pos*/, const char* /*pBuf*/, unsigned int& /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT MapFile(IO_HANDLE /*pDriverData*/, const char*& /*p*/, unsigned int& /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT ReleaseFile(IO_HANDLE /*pDriverData*/) { return IO_ERROR; }
+	virtual IO_RESULT ReserveFile(IO_HANDLE /*pDriverData*/, char*& /*p*/, unsigned int& /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT CommitFile(IO_HANDLE /*pDriverData*/, unsigned int /*nUsed*/) { return IO_ERROR; }
 	virtual IO_RESULT Seek(IO_HANDLE /*pDriverData*/, seekMode /*mode*/, long /*pos*/) { return IO_ERROR; }
 	virtual IO_RESULT Tell(IO_HANDLE /*pDriverData*/, unsigned long& /*pos*/) { return IO_ERROR; }
 	virtual IO_RESULT Flush(IO_HANDLE /*pDriverData*/) { return IO_ERROR; }
 	virtual IO_RESULT GetFileSize(IO_HANDLE /*pDriverData*/, unsigned long& /*s*/) { return IO_ERROR; }
+	virtual IO_RESULT PreallocateFile(IO_HANDLE /*pDriverData*/, unsigned long /*n*/) { return IO_ERROR; }
+	virtual IO_RESULT SetUpdatePolicy(IO_HANDLE /*pDriverData*/, updatePolicy /*policy*/, unsigned long /*lInterval*/) { return IO_ERROR; }
+	virtual IO_RESULT ReadFileAsync(IO_HANDLE /*pDriverData*/, char* /*pBuf*/, unsigned int /*n*/, BlockDeviceRequest& /*r*/, AsyncBlockDeviceInterface*& /*pDevice*/) { return IO_ERROR; }
 
 protected:
 	DeviceIoDriver* m_pVolumes[MAX_ATA_VOLUMES]; // partition references
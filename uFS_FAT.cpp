@@ -24,83 +24,15 @@
 class FatManager;
 class DeviceIoDriver_FAT;
 
-///////////////////////////////////////////////////////////////////////////////
-// FileState_FAT
-//
-// FileState_FAT structures are used to store the state of open files
-// handled by the FAT device driver. A fixed-size (static) table
-// is used for a predefined maximum number of open files.
-//
-// One important note about the current file position ('pos'):
-// The file position is a zero-based index, which holds
-// the (byte) position of the next read or write operation.
-// A value of zero indicates the start of the file.
-// An end-of-file situation occurs when a file read operation
-// occurs beyond the last byte. The file pointer can be set to
-// EOF by setting the value to the file length (in bytes).
-// The FatAddress (fa) is always synchronized with the
-// current file pointer to improve sector read/write operations.
-// A special situation occurs when the file position is set
-// to end of file while the file size is exactly a multiple of the
-// cluster size (512, 1024, ...). In this case it is not possible
-// to synchronize the FatAddress because this cluster does not
-// (yet) exist. When this happens we set the FatAddress to
-// the last cluster in the FAT chain. This is useful because
-// we might want to add new files at the end of the chain during
-// a write operation at EOF.
-
-class FileState_FAT
-{
-public:
-	FileState_FAT()
-	{
-#ifdef _DEBUG
-		// put all members in a magic sandwitch  to
-		// trap out-of-bound modifications
-		magic0 = magic1 = 0xaa55aa55;
-#endif
-		pos = -1;
-		lFileSize = 0;
-		lStartCluster = 0;
-		pData = NULL;
-		lFlags = IO_FILE_UNUSED;	// error flags, or entry unused if -1
-	}
-
-	bool IsWritable() const 
-		{ return (lFlags&IO_FILE_WRITABLE)!=0; }
-
-#ifdef _DEBUG
-	// check state values in debug mode
-	void AssertValid()
-	{
-		ASSERT(magic0==0xaa55aa55); 
-		ASSERT(magic1==0xaa55aa55); 
-		if (pos==0)
-		{
-			ASSERT(fa.m_lCluster==lStartCluster);
-			ASSERT(fa.m_iSectorOffset==0);
-		}
-	}
-#endif
-
-#ifdef _DEBUG
-	unsigned long magic0;
-#endif
-	char* pData;					// pointer to cache page, or NULL
-	unsigned long pos;				// current file position
-	unsigned long lFileSize;		// file size in bytes
-	unsigned long lStartCluster;	// start of cluster chain (same as value in directory entry, 0 for empty files)
-	unsigned long lFlags;			// see IO_FILE_XXX, 0xffffffff for unused entries
-	DirEntryAddress dea;			// location of directory entry (not the entry contents)
-	FatAddress fa;					// location of current sector (according to 'pos'), NULL_CLUSTER for empty files
-#ifdef _DEBUG
-	unsigned long magic1;
+// FAT drivers that are alive; used to find an idle file sector when the cache is full
+DeviceIoDriver_FAT* DeviceIoDriver_FAT::m_pFirstFat = NULL;
+
+#if DIR_SCAN_SECTORS>1
+// Directory sectors are read in runs by ScanDirectory(), around the cache.
+// The cache writes sectors through when they are unloaded, so only locked
+// sectors can be newer than the disk; ReadDirSectors() merges those.
+static char _dirScanBuf[DIR_SCAN_SECTORS*SECTOR_SIZE];
 #endif
-}; 
-
-// Pointers to _fsFAT entries are used as file handles.
-// (An alternative is to use the table index as a file handle.)
-static FileState_FAT _fsFAT[MAX_OPEN_FAT_FILES];
 
 
 //////////////////////////
@@ -138,6 +70,19 @@ static void SetStamp(DirEntry* p, const DeviceIoStamp& s, bool bCreationTime)
 	}
 }
 
+static void GetStamp(const DirEntry* p, DeviceIoStamp& s, bool bCreationTime)
+{
+	// reverse of SetStamp()
+	const DosStamp& d = bCreationTime ? p->fileCreation : p->lastAccess;
+	s.day = d.date.Day>0 ? d.date.Day-1 : 0;
+	s.month = d.date.Month>0 ? d.date.Month-1 : 0;
+	s.year = 1980 + d.date.Year;
+	s.sec = d.time.Sec<<1; // dos seconds are half the real seconds
+	s.min = d.time.Min;
+	s.hour = d.time.Hour;
+	s.msec = bCreationTime ? (p->cDeciSecsCreationTime%10)*100 : 0;
+}
+
 
 IO_RESULT DeviceIoDriver_FAT::LoadFatSector(const FatAddress& fa, char** ppData, bool bWritable, bool bPreLoad)
 {
@@ -179,7 +124,15 @@ IO_RESULT DeviceIoDriver_FAT::Update(DirEntryAddress& dea, unsigned long lStartC
 IO_RESULT DeviceIoDriver_FAT::Update(DirEntryAddress& dea, DirEntryX* dir)
 {
 	GenericFatSector sector(this);
-	IO_RESULT res = sector.Load(dea, true, true);
+	IO_RESULT res = IO_OK;
+	if (dea.m_szLongName!=NULL)
+	{
+		// new entry with a long filename: write its LFN entries first
+		res = UpdateLfnEntries(sector, dea, &dir->dirEntry);
+		dea.m_szLongName = NULL; // written
+	}
+	if (res>=IO_OK)
+		res = sector.Load(dea, true, true); // no-op if the LFN entries ended in the same sector
 	if (res<IO_OK)
 		return res;
 	DirEntryX* d = sector.GetDirEntryPtr() + dea.m_iTableIndex;
@@ -187,6 +140,42 @@ IO_RESULT DeviceIoDriver_FAT::Update(DirEntryAddress& dea, DirEntryX* dir)
 	return sector.Unload(/*true*/); // TODO: optimize this: only write when size changed? (does that happen?)
 }
 
+IO_RESULT DeviceIoDriver_FAT::UpdateLfnEntries(GenericFatSector& sector, const DirEntryAddress& dea, const DirEntry* pAlias)
+{
+	// Write the long filename entries in front of dea (pAlias!=NULL), or mark them 
+	// as removed (pAlias==NULL). The last touched sector is left loaded, so the caller
+	// can update the entry itself without writing that sector twice.
+#if SECTOR_SIZE==512
+	const unsigned nEntriesPerSector = 16;
+#else
+	const unsigned nEntriesPerSector = SECTOR_SIZE/sizeof(DirEntry);
+#endif
+	IO_RESULT res = IO_OK;
+	FatAddress csa(dea.m_lfnStart);
+	unsigned i = dea.m_iLfnTableIndex;
+	const unsigned char cCheckSum = pAlias ? GetDosChecksum(pAlias) : 0;
+	for (int n=dea.m_nLfnEntries; n>0 && res>=IO_OK; n--, i++)
+	{
+		if (i==nEntriesPerSector)
+		{
+			res = NextDirSector(csa);
+			if (res!=IO_OK)
+				return res<IO_OK ? res : IO_CORRUPT_FAT;
+			i = 0;
+		}
+		res = sector.Load(csa, true, true);
+		if (res>=IO_OK)
+		{
+			DirEntryX* d = sector.GetDirEntryPtr() + i;
+			if (pAlias)
+				SetLfnEntry(&d->lfnEntry, dea.m_szLongName, dea.m_iLongNameLen, n, cCheckSum); // stored in reverse order
+			else
+				d->lfnEntry.cSequenceNr = FAT_FILE_REMOVED;
+		}
+	}
+	return res;
+}
+
 
 
 
@@ -1064,6 +1053,108 @@ DeviceIoDriver_FAT::DeviceIoDriver_FAT()
 	m_iSectorToClusterShift = 0; // use BIT_SHIFT_TO_N(m_iSectorToClusterShift) to get # sectors per cluster
 	m_lFirstDataSector = 0;
 	m_lRootDirCluster = NULL_CLUSTER;
+	m_pFiles = NULL;
+	m_nFiles = 0;
+	m_pFreeFiles = NULL;
+	SetFileTable(NULL, 0);
+
+	// register in the list of FAT drivers
+	m_pNextFat = m_pFirstFat;
+	m_pFirstFat = this;
+}
+
+DeviceIoDriver_FAT::~DeviceIoDriver_FAT()
+{
+	DeviceIoDriver_FAT** pp = &m_pFirstFat;
+	while (*pp!=this && *pp!=NULL)
+		pp = &(*pp)->m_pNextFat;
+	if (*pp==this)
+		*pp = m_pNextFat;
+}
+
+IO_RESULT DeviceIoDriver_FAT::SetFileTable(FileState_FAT* pTable, unsigned int nEntries)
+{
+	// Use the caller's table for the states of open files, instead of the 
+	// built-in table of MAX_OPEN_FAT_FILES entries (pTable==NULL). The table
+	// must remain valid while the driver exists. Handles contain a 16 bit index.
+	if (pTable==NULL)
+	{
+		pTable = m_defaultFiles;
+		nEntries = sizeof(m_defaultFiles)/sizeof(m_defaultFiles[0]);
+	}
+	if (nEntries==0 || nEntries>0xFFFF)
+		return IO_ERROR;
+	unsigned int i;
+	for (i=0; i<m_nFiles; i++)
+		if (m_pFiles[i].lFlags!=IO_FILE_UNUSED)
+			return IO_FILE_OPEN;
+
+	// link all entries in the free list
+	m_pFiles = pTable;
+	m_nFiles = nEntries;
+	m_pFreeFiles = NULL;
+	for (i=nEntries; i-->0; )
+	{
+		const unsigned short iGeneration = m_pFiles[i].iGeneration;
+		m_pFiles[i] = FileState_FAT();
+		m_pFiles[i].iGeneration = iGeneration+1; // don't accept handles of a previous table
+		m_pFiles[i].pNextFree = m_pFreeFiles;
+		m_pFreeFiles = &m_pFiles[i];
+	}
+	return IO_OK;
+}
+
+IO_HANDLE DeviceIoDriver_FAT::GetFileHandle(const FileState_FAT* pFS) const
+{
+	// a handle holds the generation of the entry and its (1 based) index
+	const unsigned long i = (unsigned long)(pFS-m_pFiles) + 1;
+	return (IO_HANDLE)(size_t)(((unsigned long)pFS->iGeneration<<16) | i);
+}
+
+FileState_FAT* DeviceIoDriver_FAT::GetFileState(IO_HANDLE hFile) const
+{
+	// returns NULL for closed and stale handles
+	const unsigned long h = (unsigned long)(size_t)hFile;
+	const unsigned long i = h & 0xFFFF;
+	if (i==0 || i>m_nFiles)
+		return NULL;
+	FileState_FAT* pFS = &m_pFiles[i-1];
+	if (pFS->lFlags==IO_FILE_UNUSED || pFS->iGeneration!=(unsigned short)(h>>16))
+		return NULL;
+	return pFS;
+}
+
+IO_RESULT DeviceIoDriver_FAT::LoadSector(unsigned long lba, char** ppData, bool bWritable, bool bPreLoad)
+{
+	// Open files keep their current sector locked in the cache. Take one
+	// of them away when no cache page is left, and try again (other errors,
+	// e.g. a failing read, are returned at once).
+	IO_RESULT res = DeviceIoDriver::LoadSector(lba, ppData, bWritable, bPreLoad);
+	while (res==IO_CACHE_FULL && ReleaseIdleSector())
+		res = DeviceIoDriver::LoadSector(lba, ppData, bWritable, bPreLoad);
+	return res;
+}
+
+bool DeviceIoDriver_FAT::ReleaseIdleSector()
+{
+	// Unlock the current sector of an open file (of any FAT volume, since the cache
+	// is shared). The file loads it again on its next access. Sectors that were
+	// handed out to the user (MapFile(), ReserveFile()) are left alone.
+	for (DeviceIoDriver_FAT* pDriver=m_pFirstFat; pDriver!=NULL; pDriver=pDriver->m_pNextFat)
+	{
+		for (unsigned int i=0; i<pDriver->m_nFiles; i++)
+		{
+			FileState_FAT* pFS = &pDriver->m_pFiles[i];
+			if (pFS->lFlags!=IO_FILE_UNUSED && pFS->pData!=NULL && !pFS->bPinned && pFS->nReserved==0)
+			{
+				TRACEUFS0("release idle file sector\n");
+				const IO_RESULT res = pDriver->UnloadFatSector(pFS->pData);
+				pFS->pData = NULL;
+				return res>=IO_OK;
+			}
+		}
+	}
+	return false;
 }
 
 int DeviceIoDriver_FAT::GetNrOfVolumes() const 
@@ -1244,29 +1335,137 @@ IO_RESULT DeviceIoDriver_FAT::UnmountSW()
 #endif
 	m_fat.BackupFat();
 	IO_RESULT t = m_fat.DisconnectDriver();//JDH
+	// the medium may change before the next mount; forget the sectors of this volume (at least the boot sector)
+	if (m_pHal!=NULL)
+		DiscardSectors(0, m_nSectors>0 ? m_nSectors : 1);
 	m_pHal = NULL;//JDH
 	return t;//JDH
 }
 
-IO_RESULT DeviceIoDriver_FAT::LookupEntry(const char* szDosName, DirEntryAddress* pMatchingEntry, DirEntry* pEntry, DirEntryAddress* pEmptyEntry/*optional*/)
+FatAddress DeviceIoDriver_FAT::GetDirStart(unsigned long lDirCluster) const
+{
+	// Note that FAT12/16 have a fixed root directory (cluster nr -1==FIXED_ROOT), 
+	// which can be found between last FAT and first cluster.
+	// If this is the case, we only use the absolute sector in the second field.
+	if (lDirCluster==FIXED_ROOT)
+		return FatAddress(FIXED_ROOT, GetRootDirSubSector());
+	return FatAddress(lDirCluster, 0);
+}
+
+IO_RESULT DeviceIoDriver_FAT::NextDirSector(FatAddress& csa)
+{
+	// Forward csa to the next sector of a directory table.
+	//
+	// return	IO_OK				csa holds the address of the next sector
+	//			IO_EOF				csa was the last sector; for clustered directories csa.m_lCluster
+	//								still holds the last cluster of the chain (i.e. ready for AddDirCluster)
+	//			<IO_OK				when an error occured
+
+	if (csa.m_lCluster==FIXED_ROOT)
+	{
+		// i.e. fixed root of FAT12\16
+		if (++csa.m_iSectorOffset>=GetFirstDataSector())
+		{
+			--csa.m_iSectorOffset;
+			return IO_EOF; // this was the last root sector, can't continue
+		}
+		return IO_OK;
+	}
+
+	// ordinary dir that resides in one or more clusters
+	// continue with next sector within cluster, or jump to first sector of next cluster
+	if (++csa.m_iSectorOffset<GetNrOfSectorsPerCluster())
+		return IO_OK;
+
+	csa.m_iSectorOffset = 0;
+	unsigned long nextCluster = NULL_CLUSTER;
+	IO_RESULT res = m_fat.GetEntry(csa.m_lCluster, nextCluster);
+	if (res<IO_OK || nextCluster==NULL_CLUSTER)
+	{
+		// corrupt FAT or premature EOF
+		ASSERT(0);
+		return IO_CORRUPT_FAT;
+	}
+	if (!m_fat.ValidClusterIndex(nextCluster)) // should be EOF
+		return IO_EOF;
+	csa.m_lCluster = nextCluster; // continue with next
+	return IO_OK;
+}
+
+#if DIR_SCAN_SECTORS>1
+IO_RESULT DeviceIoDriver_FAT::ReadDirSectors(const FatAddress& csa, char* pBuf, unsigned& nSectors)
+{
+	// Read the directory sectors that directly follow csa on disk, i.e. the remainder
+	// of the cluster plus any adjacent clusters of the chain, with a single command.
+	// No more than DIR_SCAN_SECTORS sectors are read; nSectors returns the actual number.
+	// Sectors that are locked for writing in the cache may hold changes that are not
+	// written yet; those cached copies replace the ones read from disk.
+
+	unsigned n = 0;
+	if (csa.m_lCluster==FIXED_ROOT)
+		n = GetFirstDataSector() - csa.m_iSectorOffset;
+	else
+	{
+		const unsigned nPerCluster = GetNrOfSectorsPerCluster();
+		n = nPerCluster - csa.m_iSectorOffset;
+		unsigned long lCluster = csa.m_lCluster;
+		while (n<DIR_SCAN_SECTORS)
+		{
+			unsigned long lNext = NULL_CLUSTER;
+			IO_RESULT res = m_fat.GetEntry(lCluster, lNext);
+			if (res<IO_OK)
+				return res;
+			if (lNext!=lCluster+1)
+				break; // end of chain or fragmented
+			lCluster = lNext;
+			n += nPerCluster;
+		}
+	}
+	if (n>DIR_SCAN_SECTORS)
+		n = DIR_SCAN_SECTORS;
+	nSectors = n;
+	const unsigned long lba = GetSectorIndex(csa);
+	IO_RESULT res = m_pHal->ReadSectors(lba, n, pBuf);
+	if (res>=IO_OK)
+		res = MergeLockedSectors(lba, n, pBuf);
+	return res;
+}
+#endif
+
+IO_RESULT DeviceIoDriver_FAT::ScanDirectory(unsigned long lDirCluster, const char* szDosName, int len, DirEntryAddress* pMatchingEntry, DirEntry* pEntry, DirEntryAddress* pEmptyEntry/*optional*/)
 {
-	// szDosName        Must be a plain DOS 8.3 nul terminated string, optionally leaded with a directory path.
+	// Scan a single directory table (no path walking, see LookupEntry).
+	//
+	// lDirCluster      First cluster of the directory table, or FIXED_ROOT for the root of FAT12\16.
+	// szDosName        8.3 name or long filename, compared up to len characters (whole string if len<0).
 	//                  Use NULL to find an empty entry (if pEmptyEntry!=NULL).
-	// pMatchingEntry   Will be filled with the exact location of the first matching entry.
-	// pEntry 			Used to return info on the found (matching or empty) entry
+	// pMatchingEntry   Will be filled with the exact location of the first matching entry
+	//                  (including the location of its long filename entries, if any).
+	// pEntry 			Used to return info on the found (matching or empty) entry. For an empty
+	//                  entry, this receives the 8.3 name, or a unique alias for a long filename.
 	// pEmptyEntry      Is an optional reference that will be filled with the exact address 
-	//                  of the first empty entry (which may be de EOD entry!!!)
+	//                  of the first empty entry (which may be de EOD entry!!!). A long filename 
+	//                  requires a run of free entries; pEmptyEntry then refers to the last one, 
+	//                  and Update() also writes the LFN entries in front of it. The directory
+	//                  table is extended with another cluster if it has no empty entries left.
+	//
+	// Long filenames are matched in the same forward pass as the 8.3 names: each LFN entry
+	// is compared with its part of the name when it is read, and the run only matches 
+	// if the checksum of the 8.3 entry that follows it is correct.
 	//
 	// return	IO_MATCH_ENTRY		when file is found
 	//			IO_EMPTY_ENTRY		when file was not found but an empty entry is available (and requested)
 	//			IO_FILE_NOT_FOUND	when file was not found and no empty entry was available or requested
 	//			<IO_OK				when an error occured
 
-	// NB. This function is not called recursively for subdirectory scans to minimize heap size requirements.
-	//     As a result the code might be a bit more complex.
-
 	ASSERT(szDosName!=NULL || pEmptyEntry!=NULL); // must at least look for new empty entry or an existing item
+#if DIR_SCAN_SECTORS>1
+	const char* pBuffered = NULL;	// next sector in _dirScanBuf
+	unsigned nBuffered = 0;			// nr of sectors left in _dirScanBuf
+	char* pCached = NULL;			// current sector, if it was found in the cache
+#else
 	GenericFatSector sector(this);
+#endif
 
 	IO_RESULT ret = IO_FILE_NOT_FOUND; // this is returned when no error occured
 	IO_RESULT res = IO_ERROR; // this is returned in case of an error
@@ -1275,286 +1474,757 @@ IO_RESULT DeviceIoDriver_FAT::LookupEntry(const char* szDosName, DirEntryAddress
 #else
 	const unsigned nEntriesPerSector = SECTOR_SIZE/sizeof(DirEntry);
 #endif
-	const unsigned short nSectorsPerCluster = GetNrOfSectorsPerCluster();
 	const DirEntryX* d = NULL;
 	bool bEmptyEntryFound = false;
-
-//	if (pMatchingEntry==NULL)
-//		szDosName = NULL; // i.e., only interested in finding first empty entry
-
-	// Initialize cluster/sector address of this directory.
-	// Note that FAT12/16 have a fixed root directory (cluster nr -1==FIXED_ROOT), 
-	// which can be found between last FAT and first cluster.
-	// If this is the case, we only use the absolute sector in the second field.
-	unsigned long lDirStartCluster = GetRootDirCluster();	// first cluster of directory chain or FIXED_ROOT if root of FAT12\16
-//	if (lDirStartCluster==NULL_CLUSTER)
-//		lDirStartCluster = GetRootDirCluster();
-	FatAddress csa(lDirStartCluster, GetRootDirSubSector() );
-
-	// check if we are looking for (nested) directory names
-	int len = -1;
-	const char* szNextDir = NULL;
+	FatAddress csa = GetDirStart(lDirCluster);
+
+	// classify the name
+	char szShort[8+1+3+1];		// nul terminated copy of an 8.3 name
+	int nNameLen = 0;
+	int nLfn = 0;				// nr of LFN entries for this name (0 if not a valid long filename)
+	bool bLongName = false;		// true if the name cannot be stored as 8.3 name
+	DirEntry alias;				// alias basis (without ~N) for a new long filename
+	DirEntry aliasHash;			// same, with a hash of the long filename (see SetDosAliasHash())
+	unsigned long lTailsInUse = 0;	// bit N-1 is set if alias~N already exists
+	unsigned long lHashTailsInUse = 0;	// same for aliasHash~N
 	if (szDosName)
 	{
-		if (*szDosName=='\\') szDosName++; // skip optional directory separator
-		szNextDir = strchr(szDosName,'\\');
-		len = szNextDir ? (int)szNextDir-(int)szDosName : -1;
-		if (szNextDir && *++szNextDir=='\0')  // skip backslash separator
-			szNextDir = NULL; // set pointer to NULL if there is no next part after backslash
+		nNameLen = len>=0 ? len : strlen(szDosName);
+		nLfn = GetLfnEntryCount(szDosName, nNameLen);
+		bLongName = true;
+		if (nNameLen<(int)sizeof(szShort))
+		{
+			memcpy(szShort, szDosName, nNameLen);
+			szShort[nNameLen] = '\0';
+			bLongName = SetDosFilename(&alias, szShort)<=0;
+		}
+		if (bLongName && nLfn>0)
+		{
+			SetDosAlias(&alias, szDosName, nNameLen, 0);
+			aliasHash = alias;
+			SetDosAliasHash(&aliasHash, szDosName, nNameLen);
+		}
 	}
+	// nr of consecutive free entries that a new entry requires
+	const int nNeeded = (pEmptyEntry && pEntry && bLongName && nLfn>0) ? nLfn+1 : 1;
+
+	// state of the current run of LFN entries
+	int iLfnSeq = 0;			// sequence nr of the previous LFN entry (0 if none)
+	int nLfnRun = 0;			// nr of entries in the run
+	unsigned char cLfnCheckSum = 0;
+	bool bLfnMatch = false;		// all LFN entries of the run matched so far
+	DirEntryAddress lfnStart;
+
+	// state of the current run of free entries
+	int nFree = 0;
+	DirEntryAddress freeStart;
+	bool bEOD = false;			// all entries beyond the EOD entry are free
 
-	// walk directory (tree) until match (bStop==true)
 	bool bStop = false;
 	do
 	{
-		bool bRestart = false; // restart search for matching subdirectory if true
-
 		// loop through directory until we find a matching entry, sector by sector
+#if DIR_SCAN_SECTORS>1
+		if (nBuffered==0)
+		{
+			// no need to access the device if the cache already holds this sector
+			res = LoadCachedSector(GetSectorIndex(csa), &pCached);
+			if (res==IO_NOMATCH_ENTRY)
+			{
+				res = ReadDirSectors(csa, _dirScanBuf, nBuffered);
+				pBuffered = _dirScanBuf;
+			}
+			if (res<IO_OK)
+				break;
+		}
+		if (pCached)
+			d = (const DirEntryX*)pCached;
+		else
+		{
+			d = (const DirEntryX*)pBuffered;
+			pBuffered += SECTOR_SIZE;
+			nBuffered--;
+		}
+#else
 		res = sector.Load(csa, false, true);
 		if (res<IO_OK)
 			break;
 		// get type casted directory table pointer
 		d = sector.GetConstDirEntryPtr();
+#endif
 		ASSERT(d!=NULL);
 
 		// loop through all entries in this sector
-		unsigned iMatchEntry = -1;
-		for (int i=0; i<nEntriesPerSector && !bRestart && !bStop; i++, d++)
+		for (unsigned i=0; i<nEntriesPerSector && !bStop; i++, d++)
 		{
-			// only check for plain dos 8.3 filenames (incl. directories)
+			const char c = d->dirEntry.sName[0];
 			const unsigned char cAttr = d->dirEntry.cAttributes;
-			if (cAttr!=FAT_ATTR_LFN && (cAttr&FAT_ATTR_VOLUMEID)==0)
+			if (bEOD || c==FAT_FILE_EOD || c==FAT_FILE_REMOVED)
 			{
-				switch (d->dirEntry.sName[0])
+				// unused entry
+				iLfnSeq = 0;
+				if (c==FAT_FILE_EOD)
+					bEOD = true;
+				if (pEmptyEntry && !bEmptyEntryFound)
 				{
-				case FAT_FILE_EOD:
-					bStop = true;
-					// fall through: accept first unused entry as empty entry
-				case FAT_FILE_REMOVED:
-					if (!bEmptyEntryFound && szNextDir==NULL) // only track empty entry if we are in lowest directory level
+					if (nFree++==0)
 					{
-						if (pEmptyEntry && !bEmptyEntryFound) // store address of this empty entry
-						{	
-							pEmptyEntry->operator=(csa);
-							pEmptyEntry->m_iTableIndex = i;
-	//						pEmptyEntry = NULL; // only update on first match
-							ret = IO_EMPTY_ENTRY;	// let user know we found an empty entry
-														// (useful in case we fail to find the file)
-						}
-	//					if (szNextDir==NULL) // only track empty entry if we are in lowest directory level
-	//					{	
-							if (szDosName==NULL)
-							{
-								// can stop since caller is only interested in empty entry
-								bStop = true;
-							}
-							else if (pEntry) 
-							{
-								if (SetDosFilename(pEntry,szDosName)<=0) // copy leafname back to user buffer when empty entry was found
-									res = IO_ILLEGAL_FILENAME;
-							}
-	//					}
+						freeStart = csa;
+						freeStart.m_iTableIndex = i;
+					}
+					if (nFree>=nNeeded) // store address of the last entry of the run
+					{	
+						pEmptyEntry->operator=(csa);
+						pEmptyEntry->m_iTableIndex = i;
+						ret = IO_EMPTY_ENTRY;	// let user know we found an empty entry
+												// (useful in case we fail to find the file)
 						bEmptyEntryFound = true;
+						if (szDosName==NULL)
+							bStop = true; // can stop since caller is only interested in empty entry
 					}
-					break;
+				}
+				if (bEOD && (pEmptyEntry==NULL || bEmptyEntryFound))
+					bStop = true;
+				continue;
+			}
+			nFree = 0;
 
-				case '.': // "." or ".."
-					break;
+			if (cAttr==FAT_ATTR_LFN)
+			{
+				// long filename entries precede their 8.3 entry in reverse order
+				const DirLfnEntry* e = &d->lfnEntry;
+				const int iSeq = e->cSequenceNr & FAT_LFN_SEQUENCE_MASK;
+				if (e->cSequenceNr & FAT_LFN_LAST_ENTRY)
+				{
+					iLfnSeq = nLfnRun = iSeq;
+					cLfnCheckSum = e->cCheckSum;
+					lfnStart = csa;
+					lfnStart.m_iTableIndex = i;
+					bLfnMatch = nLfn>0 && iSeq==nLfn; // i.e. same name length
+				}
+				else if (iLfnSeq>1 && iSeq==iLfnSeq-1 && e->cCheckSum==cLfnCheckSum)
+					iLfnSeq = iSeq;
+				else
+					iLfnSeq = 0; // orphaned entry
+				if (iLfnSeq==0)
+					bLfnMatch = false;
+				else if (bLfnMatch)
+					bLfnMatch = CompareLfnEntry(e, szDosName, nNameLen)==0;
+				continue;
+			}
+			if (cAttr&FAT_ATTR_VOLUMEID)
+			{
+				iLfnSeq = 0;
+				continue;
+			}
 
-				default:
-					if (szDosName && CompareDosFilename(&d->dirEntry, szDosName, len)==0)
+			// plain dos 8.3 entry (file or directory), possibly with a long filename
+			const bool bHasLfn = iLfnSeq==1 && GetDosChecksum(&d->dirEntry)==cLfnCheckSum;
+			iLfnSeq = 0;
+			if (c=='.') // "." or ".."
+				continue;
+			if (nNeeded>1)
+			{
+				int iTail = GetDosAliasTail(&d->dirEntry, &alias);
+				if (iTail>0 && iTail<=32)
+					lTailsInUse |= 1UL<<(iTail-1);
+				iTail = GetDosAliasTail(&d->dirEntry, &aliasHash);
+				if (iTail>0 && iTail<=32)
+					lHashTailsInUse |= 1UL<<(iTail-1);
+			}
+			if (szDosName && ((bHasLfn && bLfnMatch) || (!bLongName && CompareDosFilename(&d->dirEntry, szShort, -1)==0)))
+			{
+				// final match!!! (file, or directory)
+				TRACEUFS1("lookup directory entry match: %s\n",szDosName);
+				if (pMatchingEntry)
+				{
+					// copy directory entry address (cluster,sector,index) back to caller
+					pMatchingEntry->operator=(csa);
+					pMatchingEntry->m_iTableIndex = i;
+					if (bHasLfn)
 					{
-						if (szNextDir) // continue with next part?
-						{
-							// first check if this is indeed a directory
-							if ((d->dirEntry.cAttributes&FAT_ATTR_DIRECTORY)==0)
-							{
-								res = IO_NOT_A_DIRECTORY;
-								bStop = true;
-							}
-							else
-							{
-								// matched a directory level, continue with subdir or file,
-								// or stop if this was the last part
-								ASSERT(d->dirEntry.lSize==0); // should be zero for directories
-								szDosName = szNextDir;
-								szNextDir = strchr(szDosName,'\\');
-								len = szNextDir ? (int)szNextDir-(int)szDosName : -1;
-								if (szNextDir && *++szNextDir=='\0')  // skip backslash separator
-									szNextDir = NULL; // no next part
-								// set cluster address of subdirectory
-								csa.m_lCluster = GetStartCluster(&d->dirEntry);
-								csa.m_iSectorOffset = 0;
-								if (csa.m_lCluster==NULL_CLUSTER) // empty directory?
-								{
-// PG								res = IO_FILE_NOT_FOUND;
-									bStop = true;
-								}
-								else
-								{
-									// found next subdirectory
-									bRestart = true;
-								}
-							}
-						}
-						else
-						{
-							// final match!!! (file, or directory if not trailed with backslash)
-							iMatchEntry=i;
-							bStop = true;
-							if (pEntry) // copy directory entry back to optional (by ref) argument
-								*pEntry = d->dirEntry;
-						}
-
+						pMatchingEntry->m_lfnStart = lfnStart;
+						pMatchingEntry->m_iLfnTableIndex = lfnStart.m_iTableIndex;
+						pMatchingEntry->m_nLfnEntries = nLfnRun;
 					}
-					break;
-				} // switch first dosname char
-			} // if file or directory entry
+				}
+				if (pEntry) // copy directory entry back to optional (by ref) argument
+					*pEntry = d->dirEntry;
+				ret = IO_MATCH_ENTRY;
+				bStop = true;
+			}
 		} // next entry
-		if (iMatchEntry!=-1)
+#if DIR_SCAN_SECTORS>1
+		if (pCached)
 		{
-			TRACEUFS1("lookup directory entry match: %s\n",szDosName);
-			if (pMatchingEntry)
-			{
-				// copy directory entry address (cluster,sector,index) back to caller
-				pMatchingEntry->operator=(csa);
-				pMatchingEntry->m_iTableIndex = iMatchEntry;
-			}
-			ret = IO_MATCH_ENTRY;
-			bStop = true;
+			res = UnloadSector(pCached);
+			pCached = NULL;
 		}
-		else if (!bStop && !bRestart)
+#else
+		res = sector.Unload(/*false*/);
+#endif
+		if (res<IO_OK || bStop)
+			break;
+
+		res = NextDirSector(csa);
+		if (res==IO_EOF)
 		{
-			// continue with next sector
-			if (csa.m_lCluster==FIXED_ROOT)
+			// End of directory, and file or directory not found.
+			// Extend the directory table with another cluster if
+			// user requested an empty entry, and we still haven't 
+			// found one. (A fixed root cannot be extended though!)
+			while (pEmptyEntry!=NULL && !bEmptyEntryFound && csa.m_lCluster!=FIXED_ROOT)
 			{
-				// i.e. fixed root of FAT12\16
-				if (++csa.m_iSectorOffset>=GetFirstDataSector())
+				res = m_fat.AddDirCluster(csa.m_lCluster/*will be updated with new cluster nr*/, NULL_CLUSTER);
+				if (res<IO_OK)
+					break;
+				ASSERT(csa.m_iSectorOffset==0);
+				if (nFree==0)
 				{
-					// this was the last root sector, can't continue
-// PG				res = IO_FILE_NOT_FOUND;
-					bStop = true;
+					freeStart = csa;
+					freeStart.m_iTableIndex = 0;
+				}
+				// a run of free entries may continue in the new cluster
+				const int nNew = nEntriesPerSector*GetNrOfSectorsPerCluster();
+				if (nFree+nNew>=nNeeded)
+				{
+					const int k = nNeeded-nFree-1;
+					pEmptyEntry->operator=(FatAddress(csa.m_lCluster, k/nEntriesPerSector));
+					pEmptyEntry->m_iTableIndex = k%nEntriesPerSector;
+					ret = IO_EMPTY_ENTRY;		// let user know we have an empty entry
+					bEmptyEntryFound = true;
 				}
+				else
+					nFree += nNew;
 			}
+			bStop = true;
+		}
+	} while (res>=IO_OK && !bStop);
+
+	if (res>=IO_OK && ret==IO_EMPTY_ENTRY && nNeeded>1)
+	{
+		// Update() writes the LFN entries in front of the new entry
+		pEmptyEntry->m_lfnStart = freeStart;
+		pEmptyEntry->m_iLfnTableIndex = freeStart.m_iTableIndex;
+		pEmptyEntry->m_nLfnEntries = nNeeded-1;
+		pEmptyEntry->m_szLongName = szDosName;
+		pEmptyEntry->m_iLongNameLen = nNameLen;
+	}
+	if (res>=IO_OK && ret==IO_EMPTY_ENTRY && pEntry && szDosName)
+	{
+		// copy leafname back to user buffer when empty entry was found
+		if (nNeeded>1)
+		{
+			// alias with the first free numeric tail: NAME~1..NAME~4 (like Windows),
+			// then NAhhhh~1..NAhhhh~32, where hhhh is a hash of the long filename
+			const int nPlainTails = 4;
+			int iTail = 1;
+			while (iTail<=nPlainTails && (lTailsInUse&(1UL<<(iTail-1)))!=0)
+				iTail++;
+			if (iTail<=nPlainTails)
+				SetDosAlias(pEntry, szDosName, nNameLen, iTail);
 			else
 			{
-				// ordinary dir that resides in one or more clusters
-				// continue with next sector within cluster, or jump to first sector of next cluster
-				if (++csa.m_iSectorOffset>=nSectorsPerCluster)
+				iTail = 1;
+				while (iTail<=32 && (lHashTailsInUse&(1UL<<(iTail-1)))!=0)
+					iTail++;
+				if (iTail>32)
+					res = IO_ILLEGAL_FILENAME; // too many similar names, no unique alias left
+				else
 				{
-					csa.m_iSectorOffset = 0;
-					unsigned long nextCluster = NULL_CLUSTER;
-					res = m_fat.GetEntry(csa.m_lCluster, nextCluster);
-
-					if (res<IO_OK || nextCluster==NULL_CLUSTER)
-					{
-						// corrupt FAT or premature EOF
-						ASSERT(0);
-						res = IO_CORRUPT_FAT;
-						bStop = true;
-					}
-					else
-					{
-						if (!m_fat.ValidClusterIndex(nextCluster)) // should be EOF
-						{
-							// End of directory, and file or directory not found.
-							// Extend the directory table with another cluster if
-							// user requested an empty entry, and we still haven't 
-							// found one. (Only if we reached the lowest directory
-							// level though!)
-							if (pEmptyEntry!=NULL && !bEmptyEntryFound && szNextDir==NULL)
-							{
-								res = m_fat.AddDirCluster(csa.m_lCluster/*will be updated with new cluster nr*/, NULL_CLUSTER);
-								if (res>=IO_OK)
-								{
-									ASSERT(csa.m_iSectorOffset==0);
-									pEmptyEntry->operator=(csa);
-									pEmptyEntry->m_iTableIndex = 0; // just return the first entry
-									pEmptyEntry = NULL;			// not required, but consequent
-									ret = IO_EMPTY_ENTRY;		// let user know we have an empty entry
-								}
-							}
-							else
-							{
-// PG								res = IO_FILE_NOT_FOUND;
-							}
-							bStop = true; // just created an empty entry
-						}
-						else
-							csa.m_lCluster = nextCluster; // continue with next
-					}
+					memcpy(pEntry->sName, aliasHash.sName, sizeof(pEntry->sName));
+					memcpy(pEntry->sExt, aliasHash.sExt, sizeof(pEntry->sExt));
+					SetDosAliasTail(pEntry, iTail);
 				}
 			}
 		}
-		res = sector.Unload(/*false*/);
-		if (res<IO_OK)
-			break;
-	} while (!bStop);
+		else if (bLongName || SetDosFilename(pEntry,szShort)<=0) 
+			res = IO_ILLEGAL_FILENAME;
+	}
 	return res>=IO_OK ? ret : res; // only return res in case of errors
 }
 
-IO_RESULT DeviceIoDriver_FAT::FileExist(const char* szFilename)
-{	DirEntryAddress MatchingEntry; DirEntry Entry;	// Needed for LookupEntry, but discarded when done.
-	return LookupEntry(szFilename, &MatchingEntry, &Entry, NULL);
-}
-
-/*
-IO_RESULT DeviceIoDriver_FAT::UnlinkChain(unsigned long lStartCluster)
+IO_RESULT DeviceIoDriver_FAT::LookupEntry(const char* szDosName, DirEntryAddress* pMatchingEntry, DirEntry* pEntry, DirEntryAddress* pEmptyEntry/*optional*/, unsigned long* pDirCluster/*optional*/, unsigned long lStartDir)
 {
-//	IO_RESULT res = IO_ERROR;
-//	FatManager FatManager(this);
-//	res = FatManager.UnlinkChain(lStartCluster);
-	return m_fat.UnlinkChain(lStartCluster);
-}
-*/
+	// szDosName        Must be a nul terminated 8.3 name or long filename, optionally leaded with a directory path.
+	//                  Use NULL to find an empty entry (if pEmptyEntry!=NULL).
+	// pMatchingEntry   Will be filled with the exact location of the first matching entry.
+	// pEntry 			Used to return info on the found (matching or empty) entry
+	// pEmptyEntry      Is an optional reference that will be filled with the exact address 
+	//                  of the first empty entry (which may be de EOD entry!!!)
+	// pDirCluster      Optional; receives the first cluster of the directory table that holds
+	//                  the entry (FIXED_ROOT for the root of FAT12\16)
+	// lStartDir        First cluster of the directory that relative paths start from (i.e. paths 
+	//                  without a leading backslash). NULL_CLUSTER refers to the root directory.
+	//
+	// return	IO_MATCH_ENTRY		when file is found
+	//			IO_EMPTY_ENTRY		when file was not found but an empty entry is available (and requested)
+	//			IO_FILE_NOT_FOUND	when file was not found and no empty entry was available or requested
+	//			<IO_OK				when an error occured
 
+	// NB. This function is not called recursively for subdirectory scans to minimize heap size requirements.
+	//     Each directory level is scanned by ScanDirectory().
 
-IO_RESULT DeviceIoDriver_FAT::CreateDirectory(const char* szFilePath/*full path without trailing slash*/)
-{
-	IO_RESULT res = IO_ERROR;
-	DirEntryAddress dea;
-	DirEntryX de;
+	ASSERT(szDosName!=NULL || pEmptyEntry!=NULL); // must at least look for new empty entry or an existing item
 
-//	TRACEUFS1("create directory %s\n",szFilePath);
+	// Start in the root directory: first cluster of directory chain or FIXED_ROOT if root of FAT12\16,
+	// unless the path is relative to another directory
+	unsigned long lDirCluster = GetRootDirCluster();
+	if (lStartDir!=NULL_CLUSTER && (szDosName==NULL || *szDosName!='\\'))
+		lDirCluster = lStartDir;
+	if (pDirCluster)
+		*pDirCluster = lDirCluster;
+	if (szDosName==NULL)
+		return ScanDirectory(lDirCluster, NULL, -1, pMatchingEntry, pEntry, pEmptyEntry);
 
-	res = LookupEntry(szFilePath, NULL/*not interested in opening an existing*/, &de.dirEntry, &dea);
-	switch (res)
-	{
-	case IO_MATCH_ENTRY: // file found
-		res = IO_FILE_OR_DIR_EXISTS;
-		break;
+	if (*szDosName=='\\') szDosName++; // skip optional directory separator
 
-	case IO_EMPTY_ENTRY: // file not found, but an empty entry exists
+	// walk directory (tree) until the last part of the path
+	do
+	{
+		// check if we are looking for (nested) directory names
+		const char* szNextDir = strchr(szDosName,'\\');
+		const int len = szNextDir ? (int)(szNextDir-szDosName) : -1;
+		if (szNextDir && *++szNextDir=='\0')  // skip backslash separator
+			szNextDir = NULL; // set pointer to NULL if there is no next part after backslash
+
+		if (szNextDir==NULL)
 		{
-			DeviceIoStamp t;
-			m_pManager->GetClock()->GetDosStamp(t);
+			// final part (file, or directory if not trailed with backslash); 
+			// only track empty entry if we are in lowest directory level
+			if (pDirCluster)
+				*pDirCluster = lDirCluster;
+			return ScanDirectory(lDirCluster, szDosName, len, pMatchingEntry, pEntry, pEmptyEntry);
+		}
+
+		// continue with next part
+		DirEntry de;
+		IO_RESULT res = ScanDirectory(lDirCluster, szDosName, len, NULL, &de, NULL);
+		if (res!=IO_MATCH_ENTRY)
+			return res;
+
+		// first check if this is indeed a directory
+		if ((de.cAttributes&FAT_ATTR_DIRECTORY)==0)
+			return IO_NOT_A_DIRECTORY;
+
+		// matched a directory level, continue with subdir or file
+		ASSERT(de.lSize==0); // should be zero for directories
+		lDirCluster = GetStartCluster(&de);
+		if (lDirCluster==NULL_CLUSTER) // empty directory?
+			return IO_FILE_NOT_FOUND;
+		szDosName = szNextDir;
+	} while (true);
+}
+
+IO_RESULT DeviceIoDriver_FAT::ResolveDirectory(const char* szDirPath, unsigned long& lDirCluster, unsigned long lStartDir)
+{
+	// Find the first cluster of a directory table (FIXED_ROOT for the root of FAT12\16).
+	// A single backslash refers to the root directory, an empty path to lStartDir
+	// (or the root directory if lStartDir is NULL_CLUSTER).
+
+	if (szDirPath==NULL || szDirPath[0]=='\0' || (szDirPath[0]=='\\' && szDirPath[1]=='\0'))
+	{
+		const bool bRoot = lStartDir==NULL_CLUSTER || (szDirPath!=NULL && szDirPath[0]=='\\');
+		lDirCluster = bRoot ? GetRootDirCluster() : lStartDir;
+		return IO_OK;
+	}
+
+	DirEntry de;
+	IO_RESULT res = LookupEntry(szDirPath, NULL, &de, NULL, NULL, lStartDir);
+	if (res!=IO_MATCH_ENTRY)
+		return res>=IO_OK ? IO_FILE_NOT_FOUND : res;
+	if ((de.cAttributes&FAT_ATTR_DIRECTORY)==0)
+		return IO_NOT_A_DIRECTORY;
+	lDirCluster = GetStartCluster(&de);
+	if (lDirCluster==NULL_CLUSTER) // '..' style reference to root
+		lDirCluster = GetRootDirCluster();
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoDriver_FAT::FileExistAt(unsigned long lDir, const char* szFilename)
+{	DirEntryAddress MatchingEntry; DirEntry Entry;	// Needed for LookupEntry, but discarded when done.
+	return LookupEntry(szFilename, &MatchingEntry, &Entry, NULL, NULL, lDir);
+}
+
+IO_RESULT DeviceIoDriver_FAT::GetFileInfoAt(unsigned long lDir, const char* szFilePath, DeviceIoFileInfo& info)
+{
+	// return properties straight from the directory entry (no file handle required)
+	DirEntry de;
+	DirEntryAddress dea;
+	IO_RESULT res = LookupEntry(szFilePath, &dea, &de, NULL, NULL, lDir);
+	if (res!=IO_MATCH_ENTRY)
+		return res>=IO_OK ? IO_FILE_NOT_FOUND : res;
+	info.lSize = de.lSize;
+	info.lStartCluster = GetStartCluster(&de);
+	const SharedFileState_FAT* pShared = FindOpenEntry(dea, dea.m_iTableIndex);
+	if (pShared!=NULL)
+	{
+		// the entry of an open file may be behind (see SetUpdatePolicy())
+		info.lSize = pShared->pWriter!=NULL ? pShared->pWriter->GetCommittedSize() : pShared->lFileSize;
+		info.lStartCluster = info.lSize>0 ? pShared->lStartCluster : NULL_CLUSTER;
+	}
+	info.cAttributes = de.cAttributes;
+	::GetStamp(&de, info.created, true);
+	::GetStamp(&de, info.modified, false);
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoDriver_FAT::OpenDirectoryAt(unsigned long lDir, const char* szDirPath, DeviceIoDirectory& dir)
+{
+	// a directory handle simply holds the first cluster of the directory table
+	dir.Close();
+	unsigned long lDirCluster = NULL_CLUSTER;
+	IO_RESULT res = ResolveDirectory(szDirPath, lDirCluster, lDir);
+	if (res>=IO_OK)
+		dir.Connect(this, lDirCluster);
+	return res;
+}
+
+/*
+IO_RESULT DeviceIoDriver_FAT::UnlinkChain(unsigned long lStartCluster)
+{
+//	IO_RESULT res = IO_ERROR;
+//	FatManager FatManager(this);
+//	res = FatManager.UnlinkChain(lStartCluster);
+	return m_fat.UnlinkChain(lStartCluster);
+}
+*/
+
+
+IO_RESULT DeviceIoDriver_FAT::CreateDirectoryAt(unsigned long lDir, const char* szFilePath/*full path without trailing slash*/)
+{
+	IO_RESULT res = IO_ERROR;
+	DirEntryAddress dea;
+	DirEntryX de;
+	unsigned long lParentDir = NULL_CLUSTER;
+
+//	TRACEUFS1("create directory %s\n",szFilePath);
+
+	res = LookupEntry(szFilePath, NULL/*not interested in opening an existing*/, &de.dirEntry, &dea, &lParentDir, lDir);
+	switch (res)
+	{
+	case IO_MATCH_ENTRY: // file found
+		res = IO_FILE_OR_DIR_EXISTS;
+		break;
 
+	case IO_EMPTY_ENTRY: // file not found, but an empty entry exists
+		{
 //			const char* szNextDir;
 //			while (szNextDir = strchr(szFilePath,'\\'), szNextDir!=NULL)
 //				szFilePath = szNextDir+1;
 
 			unsigned long lNewCluster = NULL_CLUSTER;
-			res = m_fat.AddDirCluster(lNewCluster/*will be updated with new cluster nr*/, dea.m_lCluster);
-			if (res>=IO_OK)
+			res = MakeDirectory(dea, de, lParentDir, lNewCluster);
+		}
+		break;
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::MakeDirectory(DirEntryAddress& dea, DirEntryX& de, unsigned long lParentDir, unsigned long& lNewCluster)
+{
+	// Allocate and initialize a new directory table and store its entry at dea.
+	// de must already hold the name of the new directory.
+	DeviceIoStamp t;
+	m_pManager->GetClock()->GetDosStamp(t);
+
+	// '..' must refer to the start of the parent table (NULL for the root)
+	if (lParentDir==GetRootDirCluster())
+		lParentDir = NULL_CLUSTER;
+	lNewCluster = NULL_CLUSTER;
+	IO_RESULT res = m_fat.AddDirCluster(lNewCluster/*will be updated with new cluster nr*/, lParentDir);
+	if (res>=IO_OK)
+	{
+		::SetStamp(&de.dirEntry, t, true);
+		de.dirEntry.cAttributes = FAT_ATTR_DIRECTORY; // FAT_ATTR_ARCHIVE normally not set
+		SetStartCluster(&de.dirEntry, lNewCluster);
+		de.dirEntry.lSize = 0; // always, even if table size > 0
+		de.dirEntry.cReservedNT = 0;
+		res = Update(dea, &de);
+		if (res<IO_OK)
+			m_fat.UnlinkChain(lNewCluster); // don't leave a lost cluster behind
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::CreateDirectories(const char* szFilePath/*full path without trailing slash*/)
+{
+	// Create a directory including all missing parent directories (i.e. 'mkdir -p').
+	// The existing part of the path is scanned once. Once a level had to be created,
+	// the next level is put directly in the first free entry of the new (empty) table.
+	//
+	// return	IO_OK					when at least one directory was created
+	//			IO_FILE_OR_DIR_EXISTS	when the complete path already exists
+	//			<IO_OK					when an error occured (e.g. IO_NOT_A_DIRECTORY)
+
+	IO_RESULT res = IO_FILE_OR_DIR_EXISTS;
+	DirEntryAddress dea;
+	DirEntryX de;
+	unsigned long lDirCluster = GetRootDirCluster();
+	bool bCreated = false;
+
+	if (*szFilePath=='\\') szFilePath++; // skip optional directory separator
+	while (*szFilePath!='\0')
+	{
+		// isolate next part of the path
+		const char* szNextDir = strchr(szFilePath,'\\');
+		const int len = szNextDir ? (int)(szNextDir-szFilePath) : strlen(szFilePath);
+		char szName[FAT_LFN_MAX_LEN+1];
+		if (len<=0 || len>=(int)sizeof(szName))
+			return IO_ILLEGAL_FILENAME;
+		memcpy(szName, szFilePath, len);
+		szName[len] = '\0';
+		szFilePath = szNextDir ? szNextDir+1 : szFilePath+len;
+
+		if (!bCreated)
+		{
+			// still walking existing directories
+			res = ScanDirectory(lDirCluster, szName, -1, NULL, &de.dirEntry, &dea);
+			if (res==IO_MATCH_ENTRY)
 			{
-				::SetStamp(&de.dirEntry, t, true);
-				de.dirEntry.cAttributes = FAT_ATTR_DIRECTORY; // FAT_ATTR_ARCHIVE normally not set
-				SetStartCluster(&de.dirEntry, lNewCluster);
-				de.dirEntry.lSize = 0; // always, even if table size > 0
-				de.dirEntry.cReservedNT = 0;
-//				if (SetDosFilename(&de.dirEntry, szFilePath)==0)
-//					res = IO_ILLEGAL_FILENAME;
-//				else
-					res = Update(dea, &de);
+				if ((de.dirEntry.cAttributes&FAT_ATTR_DIRECTORY)==0)
+					return IO_NOT_A_DIRECTORY;
+				lDirCluster = GetStartCluster(&de.dirEntry);
+				if (lDirCluster==NULL_CLUSTER) // i.e. '..' of root
+					lDirCluster = GetRootDirCluster();
+				res = IO_FILE_OR_DIR_EXISTS;
+				continue;
 			}
-
+			if (res!=IO_EMPTY_ENTRY)
+				return res>=IO_OK ? IO_DISK_FULL : res; // e.g. fixed root full
 		}
-		break;
+		else if (SetDosFilename(&de.dirEntry, szName)>0)
+		{
+			// new table: first two entries are '.' and '..'
+			dea = FatAddress(lDirCluster, 0);
+			dea.m_iTableIndex = 2;
+		}
+		else
+		{
+			// long filename: let ScanDirectory() find room for its LFN entries
+			res = ScanDirectory(lDirCluster, szName, -1, NULL, &de.dirEntry, &dea);
+			if (res!=IO_EMPTY_ENTRY)
+				return res>=IO_OK ? IO_DISK_FULL : res;
+		}
+
+		unsigned long lNewCluster = NULL_CLUSTER;
+		res = MakeDirectory(dea, de, lDirCluster, lNewCluster);
+		if (res<IO_OK)
+			return res;
+		lDirCluster = lNewCluster; // becomes the parent of the next level
+		bCreated = true;
 	}
 	return res;
 }
 
-IO_RESULT DeviceIoDriver_FAT::DeleteFile(const char* szFilePath, unsigned long lFlags)
+IO_RESULT DeviceIoDriver_FAT::CreateFiles(const char* szDirPath, const char* const* pszNames, const unsigned char* pAttributes/*optional*/, int nFiles, IO_RESULT* pResults)
+{
+	// Create a batch of new (empty) files in a single directory.
+	//
+	// szDirPath        Directory that receives the files (empty or "\\" for the root directory)
+	// pszNames         Array of nFiles plain DOS 8.3 leaf names
+	// pAttributes      Optional array of nFiles FAT_ATTR_xxx values (FAT_ATTR_ARCHIVE is always added)
+	// pResults         Array of nFiles results: IO_OK if the file was created, or the reason why not
+	//                  (IO_FILE_OR_DIR_EXISTS, IO_ILLEGAL_FILENAME, IO_WRONG_ATTRIBUTES, IO_DISK_FULL, ...)
+	//
+	// return	number of created files, or an error (<IO_OK) if the directory could not be accessed
+	//
+	// The directory is scanned only once for existing names (read only). After that, all free slots 
+	// are claimed from the first free entry on, and each touched directory sector is written exactly once.
+	// New directory clusters are cleared when they are appended, so their sectors aren't read back
+	// while they are being filled.
+
+	ASSERT(pszNames!=NULL && pResults!=NULL);
+	if (nFiles<=0)
+		return 0;
+
+	// pResults[i]==IO_EMPTY_ENTRY marks a name that is still waiting for an entry
+	const IO_RESULT PENDING = IO_EMPTY_ENTRY;
+	int nPending = 0;
+	int i, k;
+	for (i=0; i<nFiles; i++)
+	{
+		DirEntry e;
+		pResults[i] = PENDING;
+		if (pAttributes && (pAttributes[i]&(FAT_ATTR_DIRECTORY|FAT_ATTR_VOLUMEID)))
+			pResults[i] = IO_WRONG_ATTRIBUTES;
+		else if (pszNames[i]==NULL || SetDosFilename(&e, pszNames[i])<=0)
+			pResults[i] = IO_ILLEGAL_FILENAME;
+		else
+		{
+			// don't create the same file twice
+			for (k=0; k<i; k++)
+			{
+				DirEntry e2;
+				if (pResults[k]==PENDING && SetDosFilename(&e2, pszNames[k])>0 &&
+					memcmp(e.sName, e2.sName, 8)==0 && memcmp(e.sExt, e2.sExt, 3)==0)
+				{
+					pResults[i] = IO_FILE_OR_DIR_EXISTS;
+					break;
+				}
+			}
+		}
+		if (pResults[i]==PENDING)
+			nPending++;
+	}
+
+	unsigned long lDirCluster = NULL_CLUSTER;
+	IO_RESULT res = ResolveDirectory(szDirPath, lDirCluster);
+	if (res<IO_OK)
+		return res;
+
+	GenericFatSector sector(this);
+#if SECTOR_SIZE==512
+	const unsigned nEntriesPerSector = 16;
+#else
+	const unsigned nEntriesPerSector = SECTOR_SIZE/sizeof(DirEntry);
+#endif
+
+	/////////////////////////////////////////////
+	// pass 1: find existing names and first free entry
+	FatAddress csa = GetDirStart(lDirCluster);
+	FatAddress faFree;
+	unsigned iFree = nEntriesPerSector; // i.e. no free entry found (yet)
+	bool bStop = false;
+	while (nPending>0 && !bStop)
+	{
+		res = sector.Load(csa, false, true);
+		if (res<IO_OK)
+			break;
+		const DirEntryX* d = sector.GetConstDirEntryPtr();
+		ASSERT(d!=NULL);
+		for (unsigned j=0; j<nEntriesPerSector && !bStop; j++, d++)
+		{
+			// only check for plain dos 8.3 filenames (incl. directories)
+			const unsigned char cAttr = d->dirEntry.cAttributes;
+			if (cAttr==FAT_ATTR_LFN || (cAttr&FAT_ATTR_VOLUMEID)!=0)
+				continue;
+			switch (d->dirEntry.sName[0])
+			{
+			case FAT_FILE_EOD:
+				bStop = true;
+				// fall through - accept first unused entry as empty entry
+			case FAT_FILE_REMOVED:
+				if (iFree==nEntriesPerSector)
+				{
+					faFree = csa;
+					iFree = j;
+				}
+				break;
+
+			case '.': // "." or ".."
+				break;
+
+			default:
+				for (k=0; k<nFiles; k++)
+				{
+					if (pResults[k]==PENDING && CompareDosFilename(&d->dirEntry, pszNames[k], -1)==0)
+					{
+						pResults[k] = IO_FILE_OR_DIR_EXISTS;
+						nPending--;
+						break;
+					}
+				}
+				break;
+			}
+		}
+		res = sector.Unload(/*false*/);
+		if (res<IO_OK || bStop)
+			break;
+		const FatAddress csaLast = csa;
+		res = NextDirSector(csa);
+		if (res==IO_EOF)
+		{
+			csa = csaLast; // pass 2 extends the table after the last sector
+			break;
+		}
+	}
+
+	/////////////////////////////////////////////
+	// pass 2: claim free entries
+	int nCreated = 0;
+	if (res>=IO_OK && nPending>0)
+	{
+		DeviceIoStamp t;
+		m_pManager->GetClock()->GetDosStamp(t);
+
+		unsigned j = nEntriesPerSector; // forces table extension if no free entry was found
+		if (iFree!=nEntriesPerSector)
+		{
+			csa = faFree;
+			j = iFree;
+		}
+		bool bNewCluster = false;
+		k = 0;
+		while (nPending>0)
+		{
+			if (j>=nEntriesPerSector)
+			{
+				// continue with next sector, or extend the directory table
+				j = 0;
+				res = NextDirSector(csa);
+				if (res==IO_EOF)
+				{
+					if (csa.m_lCluster==FIXED_ROOT)
+						res = IO_DISK_FULL; // fixed root of FAT12\16 cannot be extended
+					else
+					{
+						// the cluster is cleared before the entries are added, so an interrupted
+						// batch never leaves uninitialized sectors in the directory table
+						res = m_fat.AddDirCluster(csa.m_lCluster/*will be updated with new cluster nr*/, NULL_CLUSTER);
+						csa.m_iSectorOffset = 0;
+						bNewCluster = true;
+					}
+				}
+				if (res<IO_OK)
+					break;
+			}
+
+			// sectors of a new cluster are known to be clear, so they aren't read
+			res = sector.Load(csa, true, !bNewCluster);
+			if (res<IO_OK)
+				break;
+			DirEntryX* d = sector.GetDirEntryPtr();
+			if (bNewCluster)
+				memset((void*)d, 0, SECTOR_SIZE);
+			for (d+=j; j<nEntriesPerSector && nPending>0; j++, d++)
+			{
+				const unsigned char cAttr = d->dirEntry.cAttributes;
+				const char c = d->dirEntry.sName[0];
+				if (cAttr==FAT_ATTR_LFN || (c!=FAT_FILE_EOD && c!=FAT_FILE_REMOVED))
+					continue; // entry is in use
+
+				while (pResults[k]!=PENDING)
+					k++;
+				ASSERT(k<nFiles);
+				SetDosFilename(&d->dirEntry, pszNames[k]); // already validated
+				::SetStamp(&d->dirEntry, t, true);
+				d->dirEntry.cAttributes = (unsigned char)(FAT_ATTR_ARCHIVE | (pAttributes ? pAttributes[k] : 0));
+				SetStartCluster(&d->dirEntry, NULL_CLUSTER);
+				d->dirEntry.lSize = 0;
+				d->dirEntry.cReservedNT = 0;
+				pResults[k] = IO_OK;
+				nPending--;
+				nCreated++;
+			}
+			res = sector.Unload(/*true*/);	// save sector
+			if (res<IO_OK)
+				break;
+		}
+	}
+
+	// report reason for files that could not be created
+	if (nPending>0)
+		for (k=0; k<nFiles; k++)
+			if (pResults[k]==PENDING)
+				pResults[k] = res<IO_OK ? res : IO_ERROR;
+
+	if (res<IO_OK && res!=IO_DISK_FULL && nCreated==0)
+		return res;
+	return nCreated;
+}
+
+IO_RESULT DeviceIoDriver_FAT::DeleteFileAt(unsigned long lDir, const char* szFilePath, unsigned long lFlags)
 {
 	IO_RESULT res = IO_ERROR;
 	DirEntryAddress dea;
@@ -1565,7 +2235,7 @@ IO_RESULT DeviceIoDriver_FAT::DeleteFile(const char* szFilePath, unsigned long l
 //	TRACEUFS1("delete file %s\n",szFilePath);
 
 	// first find the directory
-	res = LookupEntry(szFilePath, &dea, &de.dirEntry, NULL);
+	res = LookupEntry(szFilePath, &dea, &de.dirEntry, NULL, NULL, lDir);
 	if (res!=IO_MATCH_ENTRY)
 		return res;
 
@@ -1662,13 +2332,21 @@ IO_RESULT DeviceIoDriver_FAT::DeleteFile(const char* szFilePath, unsigned long l
 			return IO_DIRECTORY_NOT_EMPTY;
 	}
 
+	return RemoveEntry(dea, lStartCluster);
+}
+
+IO_RESULT DeviceIoDriver_FAT::RemoveEntry(const DirEntryAddress& dea, unsigned long lStartCluster)
+{
 	/////////////////////////////////////////////
-	// remove file/directory from directory table
-	res = sector.Load(dea, true, true);
+	// remove file/directory (and its long filename) from directory table
+	GenericFatSector sector(this);
+	IO_RESULT res = UpdateLfnEntries(sector, dea, NULL);
+	if (res>=IO_OK)
+		res = sector.Load(dea, true, true);
 	if (res<IO_OK)
 		return res;
 	// get type casted directory table pointer
-	pDirEntry = sector.GetDirEntryPtr() + dea.m_iTableIndex;
+	DirEntryX* pDirEntry = sector.GetDirEntryPtr() + dea.m_iTableIndex;
 	SetStartCluster(&pDirEntry->dirEntry, NULL_CLUSTER);
 	pDirEntry->dirEntry.sName[0] = FAT_FILE_REMOVED;
 	pDirEntry->dirEntry.lSize = 0;
@@ -1685,55 +2363,620 @@ IO_RESULT DeviceIoDriver_FAT::DeleteFile(const char* szFilePath, unsigned long l
 	return res;
 }
 
-IO_RESULT DeviceIoDriver_FAT::OpenFile(const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags)
+SharedFileState_FAT* DeviceIoDriver_FAT::FindOpenEntry(const FatAddress& csa, unsigned iTableIndex) const
 {
-	// TODO: in a multithreaded env. we should lock common resources (i.e. _fsFAT)
+	// check if the directory entry at csa/iTableIndex belongs to an open file
+	const DirEntryAddress dea(csa.m_lCluster, csa.m_iSectorOffset, iTableIndex);
+	for (SharedFileState_FAT* p=GetOpenBucket(dea); p!=NULL; p=p->pNextOpen)
+	{
+		if (p->dea.m_iTableIndex==iTableIndex &&
+			p->dea.m_lCluster==csa.m_lCluster && p->dea.m_iSectorOffset==csa.m_iSectorOffset)
+			return p;
+	}
+	return NULL;
+}
 
-//	TRACEUFS1("open or create file %s\n",szFilePath);
+SharedFileState_FAT*& DeviceIoDriver_FAT::GetOpenBucket(const DirEntryAddress& dea) const
+{
+	// open files are hashed on the location of their directory entry;
+	// the chain heads are spread over the entries of the file table
+	const unsigned long h = (dea.m_lCluster*31 + dea.m_iSectorOffset)*17 + dea.m_iTableIndex;
+	return m_pFiles[h%m_nFiles].pOpenBucket;
+}
+
+void DeviceIoDriver_FAT::ReplaceOpenEntry(SharedFileState_FAT* pOld, SharedFileState_FAT* pNew)
+{
+	// unlink pOld from its hash chain, and link pNew (a copy of pOld) at its place
+	SharedFileState_FAT** pp = &GetOpenBucket(pOld->dea);
+	while (*pp!=NULL && *pp!=pOld)
+		pp = &(*pp)->pNextOpen;
+	ASSERT(*pp==pOld);
+	if (*pp!=NULL)
+		*pp = pNew!=NULL ? pNew : pOld->pNextOpen;
+}
+
+IO_RESULT DeviceIoDriver_FAT::ReleaseChains(unsigned long* pChains, int& nChains)
+{
+	// Release a batch of cluster chains, in order of their start cluster
+	// to keep the FAT sector that is locked by m_fat in use as long as possible.
+	int i, k;
+	for (i=1; i<nChains; i++)
+	{
+		const unsigned long t = pChains[i];
+		for (k=i; k>0 && pChains[k-1]>t; k--)
+			pChains[k] = pChains[k-1];
+		pChains[k] = t;
+	}
+	IO_RESULT res = IO_OK;
+	for (i=0; i<nChains && res>=IO_OK; i++)
+		res = m_fat.UnlinkChain(pChains[i]);
+	nChains = 0;
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::DeleteTree(const char* szFilePath, unsigned long lFlags)
+{
+	// Delete a directory including all its files and subdirectories (or a single file).
+	// lFlags only applies to the given entry (see DeleteFile); 
+	// everything below it is removed regardless of its attributes.
+	//
+	// The tree is walked depth first. Each directory sector is first scanned for 
+	// subdirectories, which are emptied before the sector itself is cleared with a 
+	// single write. Cluster chains are released in batches, but only after the entries 
+	// that refer to them are written. Only MAX_DELETE_TREE_DEPTH directory levels 
+	// are remembered; the position in a parent of a deeper level is found back 
+	// through the '..' entry of the child.
+	//
+	// return	IO_OK, or IO_FILE_OPEN if a file in the tree is open, in which case
+	//			the tree is only partially removed (the table remains consistent)
 
 	IO_RESULT res = IO_ERROR;
+	DirEntryAddress dea;
 	DirEntryX de;
-	FileState_FAT* pFS = NULL;
-//	DirManager dm(this);
-	DirEntryAddress deaEmpty;
 
-	res = ioFile.Close();
-	if (res<IO_OK)
+	res = LookupEntry(szFilePath, &dea, &de.dirEntry, NULL);
+	if (res!=IO_MATCH_ENTRY)
 		return res;
 
-	// file must be writable if we must reset or create it
-	if ((lFlags&IO_FILE_WRITABLE)==0 && ((lFlags&IO_FILE_RESET) || (lFlags&IO_FILE_CREATE)) )
-		return IO_CANNOT_WRITE_FILE;
+	// can only delete files and directories when correct attributes are specified (read only, hidden, directory, ...)
+	if (de.dirEntry.cAttributes&~lFlags)
+		return IO_WRONG_ATTRIBUTES;
+	if (IsOpenEntry(dea, dea.m_iTableIndex))
+		return IO_FILE_OPEN;
 
-	// find an unused file handle
-	for (int i=0; i<sizeof(_fsFAT)/sizeof(_fsFAT[0]); i++)
+	const unsigned long lTopCluster = GetStartCluster(&de.dirEntry);
+	if ((de.dirEntry.cAttributes&FAT_ATTR_DIRECTORY)==0 || lTopCluster==NULL_CLUSTER)
+		return RemoveEntry(dea, lTopCluster);
+
+#if SECTOR_SIZE==512
+	const unsigned nEntriesPerSector = 16;
+#else
+	const unsigned nEntriesPerSector = SECTOR_SIZE/sizeof(DirEntry);
+#endif
+#if DELETE_TREE_BATCH<SECTOR_SIZE/32
+#error "DELETE_TREE_BATCH must be able to hold the chains of one directory sector"
+#endif
+	struct
 	{
-		if (_fsFAT[i].lFlags==IO_FILE_UNUSED)
-		{
-			pFS = &_fsFAT[i];
-			// clear IO_FILE_UNUSED status at the end if we can continue without errors
-			break;
-		}
-	}
-	if (pFS==NULL)
-		return IO_OUT_OF_FILE_HANDLES;
+		unsigned long lDir;		// start cluster of this (parent) directory
+		FatAddress csa;			// sector that holds the subdirectory entry
+		unsigned short iNext;	// index that follows the subdirectory entry
+	} stack[MAX_DELETE_TREE_DEPTH];
+	unsigned long chains[DELETE_TREE_BATCH];
+	int nChains = 0;
+	int iDepth = 0; // nr of levels below lTopCluster
 
-//	if (*szFilePath=='\\') szFilePath++;
-	res = LookupEntry(szFilePath, &pFS->dea, &de.dirEntry, &deaEmpty);
-	switch (res)
+	GenericFatSector sector(this);
+	unsigned long lDir = lTopCluster;
+	FatAddress csa(lDir, 0);
+	unsigned j = 0;
+	while (res>=IO_OK)
 	{
-	case IO_MATCH_ENTRY: // file found
-		break;
-	case IO_EMPTY_ENTRY: // file not found, but an empty entry exists
-		// check if we have to create a new empty file
-		if (lFlags&IO_FILE_CREATE)
+		/////////////////////////////////////////////
+		// look for a subdirectory in the remainder of this sector
+		res = sector.Load(csa, false, true);
+		if (res<IO_OK)
+			break;
+		const DirEntryX* d = sector.GetConstDirEntryPtr() + j;
+		bool bEOD = false;
+		bool bDescend = false;
+		for (; j<nEntriesPerSector; j++, d++)
 		{
-			DeviceIoStamp t;
-			m_pManager->GetClock()->GetDosStamp(t);
-
-			::SetStamp(&de.dirEntry, t, true);
-			de.dirEntry.cAttributes = (unsigned char)(FAT_ATTR_ARCHIVE | (lFlags&IO_FILE_STATE_MASK));
-			SetStartCluster(&de.dirEntry, NULL_CLUSTER);
+			const char c = d->dirEntry.sName[0];
+			if (c==FAT_FILE_EOD)
+			{
+				bEOD = true;
+				break;
+			}
+			if (c==FAT_FILE_REMOVED || c=='.' || d->dirEntry.cAttributes==FAT_ATTR_LFN)
+				continue;
+			if (IsOpenEntry(csa, j))
+			{
+				res = IO_FILE_OPEN;
+				break;
+			}
+			if ((d->dirEntry.cAttributes&FAT_ATTR_DIRECTORY) && GetStartCluster(&d->dirEntry)!=NULL_CLUSTER)
+			{
+				bDescend = true;
+				break;
+			}
+		}
+		if (res<IO_OK)
+			break;
+
+		if (bDescend)
+		{
+			// remember where to continue in this directory and go one level deeper
+			if (iDepth<MAX_DELETE_TREE_DEPTH)
+			{
+				stack[iDepth].lDir = lDir;
+				stack[iDepth].csa = csa;
+				stack[iDepth].iNext = j+1;
+			}
+			iDepth++;
+			lDir = GetStartCluster(&d->dirEntry);
+			csa = FatAddress(lDir, 0);
+			j = 0;
+			continue;
+		}
+
+		/////////////////////////////////////////////
+		// no (more) subdirectories: clear all entries of this sector with a single write
+		if (nChains+nEntriesPerSector>DELETE_TREE_BATCH)
+		{
+			res = ReleaseChains(chains, nChains);
+			if (res<IO_OK)
+				break;
+		}
+		DirEntryX* w = NULL;
+		d = sector.GetConstDirEntryPtr();
+		for (j=0; j<nEntriesPerSector && d->dirEntry.sName[0]!=FAT_FILE_EOD; j++, d++)
+		{
+			const char c = d->dirEntry.sName[0];
+			if (c==FAT_FILE_REMOVED || (c=='.' && d->dirEntry.cAttributes!=FAT_ATTR_LFN))
+				continue;
+			if (w==NULL)
+			{
+				res = sector.Load(csa, true, true); // switch to writable
+				if (res<IO_OK)
+					break;
+				w = sector.GetDirEntryPtr();
+			}
+			if (d->dirEntry.cAttributes!=FAT_ATTR_LFN)
+			{
+				const unsigned long lStartCluster = GetStartCluster(&d->dirEntry);
+				if (lStartCluster!=NULL_CLUSTER)
+					chains[nChains++] = lStartCluster;
+				SetStartCluster(&w[j].dirEntry, NULL_CLUSTER);
+				w[j].dirEntry.lSize = 0;
+			}
+			w[j].dirEntry.sName[0] = FAT_FILE_REMOVED;
+		}
+		if (res>=IO_OK)
+			res = sector.Unload(/*true if modified*/);
+		if (res<IO_OK)
+			break;
+
+		// continue with next sector of this directory
+		if (!bEOD)
+		{
+			res = NextDirSector(csa);
+			if (res==IO_OK)
+			{
+				j = 0;
+				continue;
+			}
+			if (res<IO_OK)
+				break;
+		}
+
+		/////////////////////////////////////////////
+		// this directory is empty now: return to parent
+		if (iDepth==0)
+		{
+			res = IO_OK;
+			break;
+		}
+		const unsigned long lChild = lDir;
+		if (--iDepth<MAX_DELETE_TREE_DEPTH)
+		{
+			lDir = stack[iDepth].lDir;
+			csa = stack[iDepth].csa;
+			j = stack[iDepth].iNext;
+		}
+		else
+		{
+			// find parent through '..' and look for the entry that refers to the child
+			res = sector.Load(FatAddress(lChild, 0), false, true);
+			if (res<IO_OK)
+				break;
+			lDir = GetStartCluster(&sector.GetConstDirEntryPtr()[1].dirEntry);
+			res = sector.Unload();
+			if (res<IO_OK)
+				break;
+			bool bFound = false;
+			csa = FatAddress(lDir, 0);
+			while (!bFound && res>=IO_OK)
+			{
+				res = sector.Load(csa, false, true);
+				if (res<IO_OK)
+					break;
+				d = sector.GetConstDirEntryPtr();
+				for (j=0; j<nEntriesPerSector && !bFound; j++, d++)
+				{
+					bFound = d->dirEntry.sName[0]!=FAT_FILE_REMOVED && d->dirEntry.sName[0]!='.' &&
+						d->dirEntry.cAttributes!=FAT_ATTR_LFN && (d->dirEntry.cAttributes&FAT_ATTR_DIRECTORY) &&
+						GetStartCluster(&d->dirEntry)==lChild;
+				}
+				if (!bFound)
+				{
+					res = NextDirSector(csa);
+					if (res==IO_EOF)
+						res = IO_CORRUPT_FAT; // child not in its parent
+				}
+			}
+			// j already points to the entry that follows the child
+		}
+	}
+	sector.Unload();
+
+	// always release the chains of entries that were removed
+	IO_RESULT res2 = ReleaseChains(chains, nChains);
+	if (res>=IO_OK)
+		res = res2;
+
+	// finally remove the (now empty) directory itself
+	if (res>=IO_OK)
+		res = RemoveEntry(dea, lTopCluster);
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::Rename(const char* szFromPath, const char* szToPath)
+{
+	// Rename or move a file or directory within this volume.
+	// Only the directory entry is moved; file data is left untouched.
+
+	IO_RESULT res = IO_ERROR;
+	DirEntryAddress deaFrom, deaTo;
+	DirEntryX deFrom, deTo;
+	unsigned long lFromDir = NULL_CLUSTER;
+	unsigned long lToDir = NULL_CLUSTER;
+
+	res = LookupEntry(szFromPath, &deaFrom, &deFrom.dirEntry, NULL, &lFromDir);
+	if (res!=IO_MATCH_ENTRY)
+		return res;
+	if (IsOpenEntry(deaFrom, deaFrom.m_iTableIndex))
+		return IO_FILE_OPEN;
+
+	const bool bDirectory = (deFrom.dirEntry.cAttributes&FAT_ATTR_DIRECTORY)!=0;
+
+	res = LookupEntry(szToPath, NULL, &deTo.dirEntry, &deaTo, &lToDir);
+	switch (res)
+	{
+	case IO_MATCH_ENTRY: // target exists
+		return IO_FILE_OR_DIR_EXISTS;
+
+	case IO_EMPTY_ENTRY: // slot in target directory (LookupEntry filled in the new name)
+		break;
+
+	default:
+		return res;
+	}
+
+	// a directory cannot be moved into its own subtree
+	const unsigned long lStartCluster = GetStartCluster(&deFrom.dirEntry);
+	if (bDirectory && lStartCluster!=NULL_CLUSTER)
+	{
+		bool bInside = false;
+		res = IsInDirectory(lToDir, lStartCluster, bInside);
+		if (res<IO_OK)
+			return res;
+		if (bInside)
+			return IO_ILLEGAL_FILENAME;
+	}
+
+	// first store the entry under its new name, then remove the old one
+	// (an interrupted rename leaves two entries instead of none)
+	memcpy(deFrom.dirEntry.sName, deTo.dirEntry.sName, sizeof(deTo.dirEntry.sName));
+	memcpy(deFrom.dirEntry.sExt, deTo.dirEntry.sExt, sizeof(deTo.dirEntry.sExt));
+	res = Update(deaTo, &deFrom);
+	if (res<IO_OK)
+		return res;
+	res = RemoveEntry(deaFrom, NULL_CLUSTER/*chain is still in use*/);
+	if (res<IO_OK)
+		return res;
+
+	// a moved directory must refer to its new parent
+	if (bDirectory && lFromDir!=lToDir && lStartCluster!=NULL_CLUSTER)
+	{
+		GenericFatSector sector(this);
+		res = sector.Load(FatAddress(lStartCluster, 0), true, true);
+		if (res<IO_OK)
+			return res;
+		DirEntryX* d = sector.GetDirEntryPtr() + 1;
+		if (d->dirEntry.sName[0]=='.' && d->dirEntry.sName[1]=='.')
+			SetStartCluster(&d->dirEntry, lToDir!=GetRootDirCluster() ? lToDir : NULL_CLUSTER);
+		res = sector.Unload(/*true*/);
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::IsInDirectory(unsigned long lDir, unsigned long lAncestor, bool& bInside)
+{
+	// Walk the '..' entries from directory lDir up to the root; bInside becomes
+	// true when lAncestor is lDir itself or one of its parent directories.
+
+	bInside = false;
+	GenericFatSector sector(this);
+	for (unsigned int nDepth=0; lDir!=GetRootDirCluster() && lDir!=NULL_CLUSTER; nDepth++)
+	{
+		if (lDir==lAncestor)
+		{
+			bInside = true;
+			return IO_OK;
+		}
+		if (nDepth>=0x10000 || !m_fat.ValidClusterIndex(lDir))
+			return IO_ERROR; // corrupt volume (e.g. a loop of '..' entries)
+		IO_RESULT res = sector.Load(FatAddress(lDir, 0), false, true);
+		if (res<IO_OK)
+			return res;
+		const DirEntryX* d = sector.GetConstDirEntryPtr() + 1;
+		if (d->dirEntry.sName[0]!='.' || d->dirEntry.sName[1]!='.')
+			return IO_ERROR;
+		lDir = GetStartCluster(&d->dirEntry);
+		res = sector.Unload();
+		if (res<IO_OK)
+			return res;
+	}
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoDriver_FAT::CompactDirectory(const char* szDirPath)
+{
+	// Pack all live entries of a directory table towards its start, so removed
+	// entries disappear, and release the clusters that are no longer needed.
+	// Long filename entries keep their order, so they stay in front of their alias.
+	// No entry of the directory may be in use by an open file (IO_FILE_OPEN).
+	// Note that an interrupted compaction can leave entries that appear twice.
+
+	unsigned long lDir = NULL_CLUSTER;
+	IO_RESULT res = ResolveDirectory(szDirPath, lDir);
+	if (res<IO_OK)
+		return res;
+
+	// open files refer to their entry by address, so these must not move
+	unsigned long lCluster = lDir;
+	do
+	{
+		for (unsigned int i=0; i<m_nFiles; i++)
+			if (m_pFiles[i].lFlags!=IO_FILE_UNUSED && m_pFiles[i].pShared->dea.m_lCluster==lCluster)
+				return IO_FILE_OPEN;
+		if (lCluster==FIXED_ROOT)
+			break;
+		res = m_fat.GetEntry(lCluster, lCluster);
+		if (res<IO_OK)
+			return res;
+	} while (m_fat.ValidClusterIndex(lCluster));
+
+#if SECTOR_SIZE==512
+	const unsigned nEntriesPerSector = 16;
+#else
+	const unsigned nEntriesPerSector = SECTOR_SIZE/sizeof(DirEntry);
+#endif
+	GenericFatSector rsec(this);	// reader
+	GenericFatSector wsec(this);	// writer (is also used for reading when both refer to the same sector)
+	FatAddress rcsa = GetDirStart(lDir);
+	FatAddress wcsa;
+	FatAddress rLast;
+	unsigned long lReaderPrev = NULL_CLUSTER;	// cluster before rcsa.m_lCluster
+	unsigned long lWriterPrev = NULL_CLUSTER;	// cluster before wcsa.m_lCluster
+	unsigned wi = 0;
+	unsigned ri = 0;
+	bool bWriting = false;	// true once the first removed entry was found
+	bool bEOD = false;
+	DirEntryX* w = NULL;
+
+	while (res>=IO_OK)
+	{
+		const bool bShared = bWriting && wcsa.m_lCluster==rcsa.m_lCluster && wcsa.m_iSectorOffset==rcsa.m_iSectorOffset;
+		const DirEntryX* r = NULL;
+		if (bShared)
+			r = w;
+		else
+		{
+			res = rsec.Load(rcsa, false, true);
+			if (res<IO_OK)
+				break;
+			r = rsec.GetConstDirEntryPtr();
+		}
+
+		for (ri=0; ri<nEntriesPerSector; ri++)
+		{
+			const char c = r[ri].dirEntry.sName[0];
+			if (c==FAT_FILE_EOD)
+			{
+				bEOD = true;
+				break;
+			}
+			if (c==FAT_FILE_REMOVED)
+			{
+				if (!bWriting)
+				{
+					// first hole: start writing here
+					res = rsec.Unload();
+					if (res>=IO_OK)
+						res = wsec.Load(rcsa, true, true);
+					if (res<IO_OK)
+						break;
+					bWriting = true;
+					wcsa = rcsa;
+					lWriterPrev = lReaderPrev;
+					wi = ri;
+					r = w = wsec.GetDirEntryPtr();
+				}
+				continue;
+			}
+			if (!bWriting)
+				continue; // no need to move entries in front of the first hole
+
+			if (wi==nEntriesPerSector)
+			{
+				// writer continues with next sector, which cannot be beyond the reader
+				res = wsec.Unload(/*true*/);
+				if (res<IO_OK)
+					break;
+				const unsigned long lPrev = wcsa.m_lCluster;
+				res = NextDirSector(wcsa);
+				if (res!=IO_OK)
+				{
+					ASSERT(0);
+					res = IO_CORRUPT_FAT;
+					break;
+				}
+				if (wcsa.m_lCluster!=lPrev)
+					lWriterPrev = lPrev;
+				wi = 0;
+				if (wcsa.m_lCluster==rcsa.m_lCluster && wcsa.m_iSectorOffset==rcsa.m_iSectorOffset)
+				{
+					// caught up with the reader: continue with a single buffer
+					res = rsec.Unload();
+					if (res>=IO_OK)
+						res = wsec.Load(wcsa, true, true);
+					if (res<IO_OK)
+						break;
+					r = w = wsec.GetDirEntryPtr();
+				}
+				else
+				{
+					res = wsec.Load(wcsa, true, true);
+					if (res<IO_OK)
+						break;
+					w = wsec.GetDirEntryPtr();
+				}
+			}
+			if (w+wi!=r+ri)
+				w[wi] = r[ri];
+			wi++;
+		}
+		if (res<IO_OK || bEOD)
+			break;
+
+		// continue with next sector
+		res = rsec.Unload(); // nothing to do if the writer's buffer was used
+		if (res<IO_OK)
+			break;
+		rLast = rcsa;
+		const unsigned long lPrev = rcsa.m_lCluster;
+		res = NextDirSector(rcsa);
+		if (res==IO_EOF)
+		{
+			rcsa = rLast;
+			res = IO_OK;
+			break;
+		}
+		if (rcsa.m_lCluster!=lPrev)
+			lReaderPrev = lPrev;
+	}
+	rsec.Unload();
+	if (res<IO_OK)
+	{
+		wsec.Unload();
+		return res;
+	}
+
+	// the table ends at the writer position, or at the EOD entry if there were no holes
+	if (!bWriting)
+	{
+		if (!bEOD)
+			return IO_OK; // nothing to compact
+		wcsa = rcsa;
+		lWriterPrev = lReaderPrev;
+		wi = ri;
+	}
+	else
+	{
+		// clear the remainder of the writer's sector and the sectors up to the old end 
+		// of the table within the same cluster (later clusters are released below)
+		memset((void*)(w+wi), 0, (nEntriesPerSector-wi)*sizeof(DirEntryX));
+		res = wsec.Unload(/*true*/);
+		FatAddress z(wcsa);
+		while (res>=IO_OK && !(z.m_lCluster==rcsa.m_lCluster && z.m_iSectorOffset==rcsa.m_iSectorOffset))
+		{
+			if (z.m_lCluster!=FIXED_ROOT && z.m_iSectorOffset+1>=GetNrOfSectorsPerCluster())
+				break;
+			z.m_iSectorOffset++;
+			res = wsec.Load(z, true, false);
+			if (res>=IO_OK)
+			{
+				memset((void*)wsec.GetDirEntryPtr(), 0, SECTOR_SIZE);
+				res = wsec.Unload(/*true*/);
+			}
+		}
+		if (res<IO_OK)
+			return res;
+	}
+
+	/////////////////////////////////////////////
+	// release unused clusters at the end of the chain
+	if (wcsa.m_lCluster==FIXED_ROOT)
+		return IO_OK;
+	unsigned long lLast = wcsa.m_lCluster;
+	if (wi==0 && wcsa.m_iSectorOffset==0 && lWriterPrev!=NULL_CLUSTER)
+		lLast = lWriterPrev; // the writer's cluster isn't used at all
+	unsigned long lNext = NULL_CLUSTER;
+	res = m_fat.GetEntry(lLast, lNext);
+	if (res>=IO_OK && m_fat.ValidClusterIndex(lNext))
+	{
+		res = m_fat.SetEntry(lLast, m_fat.LastClusterValue(), false);
+		if (res>=IO_OK)
+			res = m_fat.UnlinkChain(lNext);
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::OpenFileAt(unsigned long lDir, const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags)
+{
+	// TODO: in a multithreaded env. we should lock common resources (i.e. m_pFreeFiles)
+
+//	TRACEUFS1("open or create file %s\n",szFilePath);
+
+	IO_RESULT res = IO_ERROR;
+	DirEntryX de;
+	FileState_FAT* pFS = NULL;
+//	DirManager dm(this);
+	DirEntryAddress deaEmpty;
+
+	res = ioFile.Close();
+	if (res<IO_OK)
+		return res;
+
+	// file must be writable if we must reset or create it
+	if ((lFlags&IO_FILE_WRITABLE)==0 && ((lFlags&IO_FILE_RESET) || (lFlags&IO_FILE_CREATE)) )
+		return IO_CANNOT_WRITE_FILE;
+
+	// take an unused file state from the free list 
+	// (it is only removed at the end if we can continue without errors)
+	pFS = m_pFreeFiles;
+	if (pFS==NULL)
+		return IO_OUT_OF_FILE_HANDLES;
+	ASSERT(pFS->lFlags==IO_FILE_UNUSED);
+
+//	if (*szFilePath=='\\') szFilePath++;
+	// only look for an empty entry if we may have to create a new file
+	res = LookupEntry(szFilePath, &pFS->shared.dea, &de.dirEntry, (lFlags&IO_FILE_CREATE) ? &deaEmpty : NULL, NULL, lDir);
+	switch (res)
+	{
+	case IO_MATCH_ENTRY: // file found
+		break;
+	case IO_EMPTY_ENTRY: // file not found, but an empty entry exists
+		// create a new empty file
+		{
+			DeviceIoStamp t;
+			m_pManager->GetClock()->GetDosStamp(t);
+
+			::SetStamp(&de.dirEntry, t, true);
+			de.dirEntry.cAttributes = (unsigned char)(FAT_ATTR_ARCHIVE | (lFlags&IO_FILE_STATE_MASK));
+			SetStartCluster(&de.dirEntry, NULL_CLUSTER);
 			de.dirEntry.lSize = 0;
 			de.dirEntry.cReservedNT = 0;
 //			if (SetDosFilename(&de.dirEntry, szFilePath)==0) LookupEntry filles this item
@@ -1742,7 +2985,7 @@ IO_RESULT DeviceIoDriver_FAT::OpenFile(const char* szFilePath, DeviceIoFile& ioF
 			if (res<IO_OK)
 				return res;
 
-			pFS->dea = deaEmpty; // copy new directory entry to file state structure
+			pFS->shared.dea = deaEmpty; // copy new directory entry to file state structure
 
 			lFlags &= ~IO_FILE_RESET; // clear rest flag because we're sure the file is empty
 		}
@@ -1755,275 +2998,1205 @@ IO_RESULT DeviceIoDriver_FAT::OpenFile(const char* szFilePath, DeviceIoFile& ioF
 	if ((lFlags&(IO_FILE_WRITABLE)) && (de.dirEntry.cAttributes&(FAT_ATTR_READONLY|FAT_ATTR_VOLUMEID|FAT_ATTR_DIRECTORY)))
 		return IO_CANNOT_OPEN;
 
-	if (lFlags&(IO_FILE_RESET))
+	// the file may be open already; share its state (the directory entry may be out of date)
+	SharedFileState_FAT* pShared = FindOpenEntry(pFS->shared.dea, pFS->shared.dea.m_iTableIndex);
+	if (pShared!=NULL)
 	{
-		res = m_fat.UnlinkChain(GetStartCluster(&de.dirEntry));
-		if (res<IO_OK)
-			return res;
-		SetStartCluster(&de.dirEntry, NULL_CLUSTER/*EOF*/);
-		de.dirEntry.lSize = 0;
+		// only one handle can write, and the file can't be reset under the other handles
+		if (((lFlags&IO_FILE_WRITABLE) && pShared->pWriter!=NULL) || (lFlags&IO_FILE_RESET))
+			return IO_FILE_OPEN;
+	}
+	else
+	{
+		pShared = &pFS->shared;
+		pShared->lDirSize = de.dirEntry.lSize;
+		pShared->lDirStartCluster = GetStartCluster(&de.dirEntry);
+		if (lFlags&(IO_FILE_RESET))
+		{
+			res = m_fat.UnlinkChain(GetStartCluster(&de.dirEntry));
+			if (res<IO_OK)
+				return res;
+			SetStartCluster(&de.dirEntry, NULL_CLUSTER/*EOF*/);
+			de.dirEntry.lSize = 0;
+		}
+		pShared->lFileSize = de.dirEntry.lSize;
+		pShared->lStartCluster = GetStartCluster(&de.dirEntry);
+		pShared->lReservedSize = 0;
+		pShared->nClusters = pShared->lFileSize>0 ? ((pShared->lFileSize-1)>>GetByteToClusterShift())+1 : 0;
+		pShared->lDirTime = 0;
+		pShared->lUpdateInterval = 0;
+		pShared->policy = updateOnFlush;
+		pShared->nHandles = 0;
+		pShared->pWriter = NULL;
+		pShared->pHandles = NULL;
+
+		SharedFileState_FAT*& pBucket = GetOpenBucket(pShared->dea);
+		pShared->pNextOpen = pBucket;
+		pBucket = pShared;
 	}
-	pFS->lFileSize = de.dirEntry.lSize;
-	pFS->fa.m_lCluster = pFS->lStartCluster = GetStartCluster(&de.dirEntry);
+	pShared->nHandles++;
+	if (lFlags&IO_FILE_WRITABLE)
+		pShared->pWriter = pFS;
+	pFS->pNextHandle = pShared->pHandles;
+	pShared->pHandles = pFS;
+	pFS->pShared = pShared;
+	pFS->fa.m_lCluster = pShared->lStartCluster;
 	pFS->fa.m_iSectorOffset = 0;
 	pFS->pos = 0;
 	ASSERT(pFS->pData==NULL);
+	ASSERT(pFS->pMapped==NULL);
 	pFS->pData = NULL;
+	pFS->pMapped = NULL;
+	pFS->nReserved = 0;
+	pFS->bPinned = false;
 	pFS->lFlags = lFlags;
+	m_pFreeFiles = pFS->pNextFree;
+	pFS->pNextFree = NULL;
+
+	return ioFile.Connect(this,GetFileHandle(pFS));
+//	*pDriverData = (IO_HANDLE)pFS; // its now save to return a file handle to the caller
+}
+
+IO_RESULT DeviceIoDriver_FAT::CloseFile(IO_HANDLE pDriverData)
+{
+	TRACEUFS0("close file\n");
+
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+
+	// release the clusters that were preallocated but not used
+	IO_RESULT res = IO_OK;
+	if (pFS->IsWriter())
+		res = TrimFile(pFS);
+	const IO_RESULT r = FlushFile(pFS, true/*regardless of the update policy*/);
+	if (res>=IO_OK)
+		res = r;
+
+	// detach from the shared state of the file
+	SharedFileState_FAT* pShared = pFS->pShared;
+	if (pShared->pWriter==pFS)
+		pShared->pWriter = NULL;
+	FileState_FAT** ppHandle = &pShared->pHandles;
+	while (*ppHandle!=pFS)
+		ppHandle = &(*ppHandle)->pNextHandle;
+	*ppHandle = pFS->pNextHandle;
+	pFS->pNextHandle = NULL;
+	if (--pShared->nHandles==0)
+	{
+		// the file is no longer open
+		ReplaceOpenEntry(pShared, NULL);
+	}
+	else if (pShared==&pFS->shared)
+	{
+		// other handles still refer to the state kept by this entry; move it to the first of them
+		SharedFileState_FAT* pNew = &pShared->pHandles->shared;
+		*pNew = *pShared;
+		for (FileState_FAT* p=pNew->pHandles; p!=NULL; p=p->pNextHandle)
+			p->pShared = pNew;
+		ReplaceOpenEntry(pShared, pNew);
+	}
+	pFS->pShared = NULL;
+
+	// release the file handle; the new generation invalidates copies of it
+	pFS->lFlags = IO_FILE_UNUSED;
+	pFS->iGeneration++;
+	pFS->pNextFree = m_pFreeFiles;
+	m_pFreeFiles = pFS;
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::Flush(IO_HANDLE pDriverData)
+{
+	TRACEUFS0("flush file\n");
+
+	// Write (open) buffer to cache and update directory entry.
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+	return FlushFile(pFS, false);
+}
+
+IO_RESULT DeviceIoDriver_FAT::FlushFile(FileState_FAT* pFS, bool bForceUpdate)
+{
+	IO_RESULT res = IO_ERROR;
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+
+	// release the sector that was handed out by MapFile()
+	res = ReleaseMapping(pFS);
+	ASSERT(res>=IO_OK);
+
+	// there is data in the buffer; save it
+	if (pFS->pData)
+	{
+		res = UnloadFatSector(pFS->pData/*, pFS->IsWritable()*/);
+		ASSERT(res>=IO_OK);
+		pFS->pData = NULL;
+	}
+
+	// Update directory entry (when the update policy says so).
+	// If you skip this, you will loose clusters and the OS will report a short file
+	// (a chain that was preallocated for an empty file isn't recorded)
+	// Readers leave the entry (and a read-only medium) alone.
+	if (pFS->IsWriter())
+		res = UpdateEntry(pFS->pShared, bForceUpdate);
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+
+	return res;
+}
+
+static unsigned long GetSeconds(DeviceIoClock* pClock)
+{
+	// seconds since the start of the month; enough to measure update intervals
+	DeviceIoStamp t;
+	pClock->GetDosStamp(t);
+	return ((t.day*24UL+t.hour)*60+t.min)*60+t.sec;
+}
+
+IO_RESULT DeviceIoDriver_FAT::UpdateEntry(SharedFileState_FAT* pShared, bool bForce)
+{
+	// Write the size and start cluster of an open file to its directory entry,
+	// unless the update policy allows to defer it. An update can only be 
+	// deferred while the entry describes the start of the current chain; 
+	// otherwise it could refer to clusters that were released.
+	const unsigned long lStartCluster = pShared->lFileSize>0 ? pShared->lStartCluster : NULL_CLUSTER;
+	unsigned long lNow = 0;
+	if (pShared->policy==updateTimer)
+		lNow = GetSeconds(m_pManager->GetClock());
+	if (!bForce && pShared->lDirStartCluster==lStartCluster && pShared->lDirSize<=pShared->lFileSize)
+	{
+		bool bDue = true;
+		switch (pShared->policy)
+		{
+		case updateOnFlush:
+			break;
+		case updateBytes:
+			bDue = pShared->lFileSize-pShared->lDirSize>=pShared->lUpdateInterval;
+			break;
+		case updateClusters:
+			{
+				const unsigned long nClusters = pShared->lFileSize>0 ? ((pShared->lFileSize-1)>>GetByteToClusterShift())+1 : 0;
+				const unsigned long nDirClusters = pShared->lDirSize>0 ? ((pShared->lDirSize-1)>>GetByteToClusterShift())+1 : 0;
+				bDue = nClusters-nDirClusters>=pShared->lUpdateInterval;
+			}
+			break;
+		case updateOnClose:
+			bDue = false;
+			break;
+		case updateTimer:
+			// a clock that went back (or a new month) also triggers an update
+			bDue = lNow<pShared->lDirTime || lNow-pShared->lDirTime>=pShared->lUpdateInterval;
+			break;
+		}
+		if (!bDue)
+			return IO_OK;
+	}
+
+	const IO_RESULT res = Update(pShared->dea, lStartCluster, pShared->lFileSize);
+	if (res>=IO_OK)
+	{
+		pShared->lDirSize = pShared->lFileSize;
+		pShared->lDirStartCluster = lStartCluster;
+		pShared->lDirTime = lNow;
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::SetUpdatePolicy(IO_HANDLE pDriverData, updatePolicy policy, unsigned long lInterval)
+{
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+
+	SharedFileState_FAT* pShared = pFS->pShared;
+	pShared->policy = policy;
+	pShared->lUpdateInterval = lInterval;
+	if (policy==updateTimer)
+		pShared->lDirTime = GetSeconds(m_pManager->GetClock()); // the interval starts now
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoDriver_FAT::GetFileSize(IO_HANDLE pDriverData, unsigned long& s)
+{
+	TRACEUFS0("get file size\n");
+
+	const FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+	s = pFS->GetCommittedSize(); // don't count uncommitted bytes
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoDriver_FAT::GetNrOfFreeSectors(const char* /*szPath*/, unsigned long& n)
+{
+	unsigned long t;
+	const IO_RESULT res = m_fat.NumberOfFreeEntries(t);
+	if (res>=IO_OK) n = t<<m_iSectorToClusterShift;
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::Flush()
+{
+	// write the directory entries of the files that are being written
+	IO_RESULT res = IO_OK;
+	for (unsigned int i=0; i<m_nFiles; i++)
+	{
+		FileState_FAT& fs = m_pFiles[i];
+		if (fs.lFlags!=IO_FILE_UNUSED && fs.IsWriter())
+		{
+			const IO_RESULT r = UpdateEntry(fs.pShared, true);
+			if (res>=IO_OK)
+				res = r;
+		}
+	}
+	const IO_RESULT r = m_fat.Flush();
+	return res>=IO_OK ? r : res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::ReadFile(IO_HANDLE pDriverData, char* pBuf, unsigned int& n)
+{
+	TRACEUFS1_DET("read from file: %i bytes\n",n);
+
+	DeviceIoVector vec;
+	vec.pBuf = pBuf;
+	vec.n = n;
+	unsigned long nRead = 0;
+	const IO_RESULT res = ReadFileV(pDriverData, &vec, 1, nRead);
+	n = (unsigned int)nRead; // inform user about how many bytes are actually read
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::WriteFile(IO_HANDLE pDriverData, const char* pBuf, unsigned int& n)
+{
+	TRACEUFS1_DET("write to file: %i bytes\n",n);
+
+	DeviceIoVector vec;
+	vec.pBuf = (char*)pBuf;
+	vec.n = n;
+	unsigned long nWritten = 0;
+	const IO_RESULT res = WriteFileV(pDriverData, &vec, 1, nWritten);
+	n = (unsigned int)nWritten; // inform user about how many bytes are actually written
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::ReadFileV(IO_HANDLE pDriverData, const DeviceIoVector* pVec, int nVec, unsigned long& n)
+{
+	n = 0;
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+
+	IO_RESULT res = ReleaseMapping(pFS);
+	if (res<IO_OK)
+		return res;
+
+	for (int i=0; i<nVec; i++)
+	{
+		n += pVec[i].n;
+		if (n<pVec[i].n)
+			n = 0xFFFFFFFF; // overflow; the file can't be that large anyway
+	}
+	// don't read what the writing handle of the file has reserved but not yet written
+	const unsigned long lSize = pFS->GetCommittedSize();
+	bool bEOF = false;
+	if (n>lSize-pFS->pos)
+	{
+		bEOF = true;
+		n = lSize - pFS->pos;
+	}
+	res = TransferFile(pFS, pVec, n, false, lSize);
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+	return res>=IO_OK && bEOF ? IO_EOF : res; // TODO: put EOF in separate bit
+}
+
+IO_RESULT DeviceIoDriver_FAT::WriteFileV(IO_HANDLE pDriverData, const DeviceIoVector* pVec, int nVec, unsigned long& n)
+{
+	n = 0;
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+
+	if (!pFS->IsWritable())
+		return IO_CANNOT_WRITE_FILE; // read only file
+
+	if (pFS->pos>pFS->pShared->lFileSize)
+		return IO_INVALID_FILE_POS;
+
+	IO_RESULT res = ReleaseMapping(pFS);
+	if (res<IO_OK)
+		return res;
+
+	for (int i=0; i<nVec; i++)
+	{
+		n += pVec[i].n;
+		if (n<pVec[i].n)
+			n = 0xFFFFFFFF;
+	}
+	//check addition for overflow
+	if (n>0xFFFFFFFF-pFS->pos)
+	{
+		ASSERT(0);
+		n = 0xFFFFFFFF - pFS->pos; // limit to 4G
+	}
+	const unsigned long oldFileSize = pFS->pShared->lFileSize;
+	// grow the file once for all segments
+	if (pFS->pos+n>pFS->pShared->lFileSize) 
+	{
+		res = GrowFile(pFS, pFS->pos+n);
+		if (res<IO_OK)
+		{
+			n = 0;
+			return res;
+		}
+	}
+	res = TransferFile(pFS, pVec, n, true, oldFileSize);
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::TransferFile(FileState_FAT* pFS, const DeviceIoVector* pVec, unsigned long& n, bool bWrite, unsigned long lOldSize)
+{
+	// Copy n bytes between the segments and the file at the file position 
+	// and move the file position on. Sectors are filled from (or copied to) 
+	// as many segments as it takes. The range must lie within the file, 
+	// so a write must have grown it already; lOldSize is the file size 
+	// before that, sectors beyond it need not be preloaded.
+	ASSERT(pFS->pos+n<=pFS->pShared->lFileSize);
+
+	IO_RESULT res = n>0 ? SyncFileAddress(pFS) : IO_OK;
+	unsigned long nDone = 0;
+	unsigned int iOffset = 0; // within the current segment
+	// determine how many bytes we can transfer from current sector
+	unsigned int posWithinSector = pFS->pos & (SECTOR_SIZE-1);
+	while (nDone<n)
+	{
+		while (iOffset>=pVec->n)
+		{
+			pVec++; // skip empty or completed segments
+			iOffset = 0;
+		}
+		unsigned long nSegment = pVec->n - iOffset;
+		if (nSegment>n-nDone)
+			nSegment = n-nDone;
+		if ((pFS->lFlags&IO_FILE_DIRECT) && posWithinSector==0 && nSegment>=SECTOR_SIZE)
+		{
+			// transfer whole sectors straight from/to the user buffer
+			unsigned int nDirect = (unsigned int)nSegment & ~(SECTOR_SIZE-1);
+			res = TransferDirect(pFS, pFS->fa, pVec->pBuf+iOffset, nDirect, bWrite);
+			if (res>=IO_OK)
+				res = SeekFile(pFS, seekCurrent, nDirect); // forward file position
+			if (res<IO_OK)
+				break;
+			iOffset += nDirect;
+			nDone += nDirect;
+			continue;
+		}
+		unsigned int nSector = SECTOR_SIZE-posWithinSector;
+		if (nSector>n-nDone)
+			nSector = (unsigned int)(n-nDone);
+		if (pFS->pData==NULL)
+		{
+			// preserve content of partially written sectors
+			const bool bPreLoad = !bWrite || (nSector!=SECTOR_SIZE && pFS->pos-posWithinSector<lOldSize);
+			res = LoadFatSector(pFS->fa, &pFS->pData, bWrite || pFS->IsWritable(), bPreLoad);
+			if (res<IO_OK)
+			{
+				pFS->pData = NULL;
+				break;
+			}
+		}
+		for (unsigned int nCopied=0; nCopied<nSector; )
+		{
+			while (iOffset>=pVec->n)
+			{
+				pVec++;
+				iOffset = 0;
+			}
+			unsigned int nChunk = pVec->n - iOffset;
+			if (nChunk>nSector-nCopied)
+				nChunk = nSector-nCopied;
+			if (bWrite)
+				memcpy(pFS->pData+posWithinSector+nCopied, pVec->pBuf+iOffset, nChunk);
+			else
+				memcpy(pVec->pBuf+iOffset, pFS->pData+posWithinSector+nCopied, nChunk);
+			iOffset += nChunk;
+			nCopied += nChunk;
+		}
+		// forward file position
+		res = SeekFile(pFS, seekCurrent, nSector); // will release sector
+		if (res<IO_OK)
+			break;
+		nDone += nSector;
+		posWithinSector = 0; // can transfer complete sectors from now on
+	}
+	n = nDone; // inform user about how many bytes are actually transferred
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::GrowFile(FileState_FAT* pFS, unsigned long newSize)
+{
+	// Lengthen the cluster chain of a file to hold newSize bytes and keep
+	// the FatAddress in sync with the file position.
+	ASSERT(newSize>pFS->pShared->lFileSize);
+
+	// check if we must append more clusters to the chain (it may have been preallocated)
+	IO_RESULT res = IO_OK;
+	const unsigned long nRequiredClusters = ((newSize-1)>>GetByteToClusterShift()) + 1;
+	if (nRequiredClusters>pFS->pShared->nClusters)
+	{
+		res = m_fat.AddClusters(pFS->pShared->lStartCluster, nRequiredClusters-pFS->pShared->nClusters, pFS->fa.m_lCluster/*last cluster hint*/);
+		if (res<IO_OK)
+			return res;
+		pFS->pShared->nClusters = nRequiredClusters;
+	}
+	ASSERT(m_fat.ValidFatValue(pFS->pShared->lStartCluster));
+	// check if this is an empty file that is being expanded
+	if (pFS->pShared->lFileSize==0)
+	{
+		// (fa may already refer to a preallocated chain)
+		ASSERT(pFS->fa.m_lCluster==NULL_CLUSTER || pFS->fa.m_lCluster==pFS->pShared->lStartCluster);
+		ASSERT(pFS->pos==0);
+		pFS->fa.m_lCluster = pFS->pShared->lStartCluster;
+		ASSERT(pFS->fa.m_iSectorOffset==0);
+	}
+	// special case: when pos was at EOF and on a sector boundary
+	else if (pFS->pShared->lFileSize==pFS->pos && (pFS->pShared->lFileSize&(SECTOR_SIZE-1))==0) 
+	{
+		// In this case 'pos' pointed beyond the last valid sector,
+		// but since the cluster chain has grown it is now save to move on when
+		// m_iSectorOffset was set to #sectors_per_cluster in Seek
+		ASSERT(m_fat.ValidClusterIndex(pFS->fa.m_lCluster));
+		if (pFS->fa.m_iSectorOffset>=GetNrOfSectorsPerCluster())
+		{
+			pFS->fa.m_iSectorOffset = 0;
+			res = m_fat.GetEntry(pFS->fa.m_lCluster, pFS->fa.m_lCluster);
+			ASSERT(m_fat.ValidClusterIndex(pFS->fa.m_lCluster));
+			if (res<IO_OK)
+			{
+				ASSERT(0);
+				return res;
+			}
+		}
+	}
+	pFS->pShared->lFileSize = newSize;
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::PreallocateFile(IO_HANDLE pDriverData, unsigned long n)
+{
+	TRACEUFS1_DET("preallocate file: %lu bytes\n",n);
+
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+
+	if (!pFS->IsWritable())
+		return IO_CANNOT_WRITE_FILE; // read only file
+
+	IO_RESULT res = ReleaseMapping(pFS); // also cancels a reservation
+	if (res<IO_OK)
+		return res;
+
+	SharedFileState_FAT* pShared = pFS->pShared;
+	if (n>0xFFFFFFFF-pShared->lFileSize)
+		return IO_DISK_FULL; // file would exceed 4GB
+	const unsigned long lTotal = pShared->lFileSize+n;
+	const unsigned long nRequiredClusters = lTotal>0 ? ((lTotal-1)>>GetByteToClusterShift())+1 : 0;
+	if (nRequiredClusters<=pShared->nClusters)
+		return IO_OK; // already there
+	// a single call adds contiguous clusters if the disk allows it
+	res = m_fat.AddClusters(pShared->lStartCluster, nRequiredClusters-pShared->nClusters, pFS->fa.m_lCluster/*last cluster hint*/);
+	if (res>=IO_OK)
+		pShared->nClusters = nRequiredClusters;
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::TrimFile(FileState_FAT* pFS)
+{
+	// Release the clusters beyond the end of the file that were 
+	// preallocated, but weren't used.
+	SharedFileState_FAT* pShared = pFS->pShared;
+	const unsigned long nKeep = pShared->lFileSize>0 ? ((pShared->lFileSize-1)>>GetByteToClusterShift())+1 : 0;
+	if (nKeep>=pShared->nClusters)
+		return IO_OK;
+
+	IO_RESULT res = IO_OK;
+	if (nKeep==0)
+	{
+		ASSERT(pFS->pData==NULL && pFS->pos==0);
+		res = m_fat.UnlinkChain(pShared->lStartCluster);
+		pShared->lStartCluster = NULL_CLUSTER;
+		pFS->fa.m_lCluster = NULL_CLUSTER;
+		pFS->fa.m_iSectorOffset = 0;
+	}
+	else
+	{
+		// find the last cluster in use (near the file position, typically)
+		FatAddress fa;
+		res = LocateFilePos(pFS, pShared->lFileSize-1, fa);
+		unsigned long lNext = NULL_CLUSTER;
+		if (res>=IO_OK)
+			res = m_fat.GetEntry(fa.m_lCluster, lNext);
+		if (res>=IO_OK)
+			res = m_fat.SetEntry(fa.m_lCluster, m_fat.LastClusterValue(), false);
+		if (res>=IO_OK && m_fat.ValidClusterIndex(lNext))
+			res = m_fat.UnlinkChain(lNext);
+	}
+	if (res>=IO_OK)
+		pShared->nClusters = nKeep;
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::TransferDirect(FileState_FAT* pFS, const FatAddress& fa, char* pBuf, unsigned int& n, bool bWrite)
+{
+	// Transfer whole sectors of a file between the user buffer and the device,
+	// starting at sector 'fa', without going through the cache. 
+	// Only the sectors that are contiguous on disk are transferred with one
+	// command; n returns the number of bytes actually transferred.
+	// The file position is not changed.
+	ASSERT(n>=SECTOR_SIZE && m_fat.ValidClusterIndex(fa.m_lCluster));
+
+	IO_RESULT res = IO_OK;
+	if (pFS->pData)
+	{
+		// the disk must be up to date before it is accessed directly
+		res = UnloadFatSector(pFS->pData);
+		pFS->pData = NULL;
+		if (res<IO_OK)
+			return res;
+	}
+
+	// find the run of adjacent clusters
+	const unsigned char nShift = GetByteToSectorShift();
+	unsigned long nRun = 0;
+	res = GetSectorRun(fa, n>>nShift, nRun);
+	if (res<IO_OK)
+		return res;
+
+	const unsigned long lba = GetSectorIndex(fa);
+	if (bWrite)
+	{
+		// cached copies are out of date now; the sectors of this handle were
+		// released above, and other handles only read, so none is dirty
+		res = m_pHal->WriteSectors(lba, nRun, pBuf);
+		if (res>=IO_OK)
+			res = DiscardSectors(lba, nRun, pBuf);
+	}
+	else
+	{
+		res = m_pHal->ReadSectors(lba, nRun, pBuf);
+		if (res>=IO_OK)
+			res = MergeLockedSectors(lba, nRun, pBuf); // other handles may not have written their changes yet
+	}
+	if (res<IO_OK)
+		return res;
+
+	n = nRun<<nShift;
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::GetSectorRun(const FatAddress& fa, unsigned long nMax, unsigned long& nRun)
+{
+	// nr of sectors from 'fa' on (at most nMax) that are adjacent on disk
+	const unsigned nPerCluster = GetNrOfSectorsPerCluster();
+	unsigned long lCluster = fa.m_lCluster;
+	nRun = nPerCluster - fa.m_iSectorOffset;
+	while (nRun<nMax)
+	{
+		unsigned long lNext = NULL_CLUSTER;
+		const IO_RESULT res = m_fat.GetEntry(lCluster, lNext);
+		if (res<IO_OK)
+			return res;
+		if (lNext!=lCluster+1)
+			break; // end of chain or fragmented
+		lCluster = lNext;
+		nRun += nPerCluster;
+	}
+	if (nRun>nMax)
+		nRun = nMax;
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoDriver_FAT::ReadFileAsync(IO_HANDLE pDriverData, char* pBuf, unsigned int n, BlockDeviceRequest& r, AsyncBlockDeviceInterface*& pDevice)
+{
+	// Submit a read of the whole sectors at the file position that are adjacent
+	// on disk (see DeviceIoFile::ReadAsync()). Nothing is changed when this
+	// returns IO_ERROR, so the caller can still read through the cache.
+	pDevice = NULL;
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+	const unsigned long lSize = pFS->GetCommittedSize();
+	if ((pFS->pos&(SECTOR_SIZE-1))!=0 || pFS->pos>=lSize || pFS->pMapped!=NULL || pFS->nReserved!=0)
+		return IO_ERROR;
+	const unsigned char nShift = GetByteToSectorShift();
+	unsigned long nSectors = (lSize-pFS->pos)>>nShift;
+	if (nSectors>(n>>nShift))
+		nSectors = n>>nShift;
+	if (nSectors==0)
+		return IO_ERROR;
+	// only the writer changes sectors, but it writes them when they are unloaded
+	const FileState_FAT* pWriter = pFS->pShared->pWriter;
+	if (pWriter!=NULL && pWriter!=pFS && (pWriter->pData!=NULL || pWriter->pMapped!=NULL))
+		return IO_ERROR;
+
+	IO_RESULT res = SyncFileAddress(pFS);
+	unsigned long nRun = 0;
+	if (res>=IO_OK)
+		res = GetSectorRun(pFS->fa, nSectors, nRun);
+	if (res<IO_OK)
+		return res;
+	unsigned long lba = GetSectorIndex(pFS->fa);
+	AsyncBlockDeviceInterface* pAsync = m_pHal->GetAsyncDevice(lba);
+	if (pAsync==NULL)
+		return IO_ERROR;
+	if (pFS->pData)
+	{
+		// the disk must be up to date before it is accessed directly
+		res = UnloadFatSector(pFS->pData);
+		pFS->pData = NULL;
+		if (res<IO_OK)
+			return res;
+	}
 
-	return ioFile.Connect(this,(IO_HANDLE)pFS);
-//	*pDriverData = (IO_HANDLE)pFS; // its now save to return a file handle to the caller
+	const unsigned long pos = pFS->pos;
+	res = SeekFile(pFS, seekCurrent, nRun<<nShift); // as if the sectors were read
+	if (res<IO_OK)
+		return res;
+	r.lba = lba;
+	r.n = (unsigned int)nRun;
+	r.pData = pBuf;
+	r.bWrite = false;
+	r.pfnDone = NULL;
+	res = pAsync->Submit(&r);
+	if (res<IO_OK)
+	{
+		SeekFile(pFS, seekBegin, pos);
+		return res;
+	}
+	pDevice = pAsync;
+	return IO_PENDING;
 }
 
-IO_RESULT DeviceIoDriver_FAT::CloseFile(IO_HANDLE pDriverData)
+IO_RESULT DeviceIoDriver_FAT::ReadFileAt(IO_HANDLE pDriverData, unsigned long pos, char* pBuf, unsigned int& n)
 {
-	TRACEUFS0("close file\n");
+	// Read at an absolute file offset; the file position is left alone.
+	TRACEUFS2_DET("read from file at %lu: %i bytes\n",pos,n);
 
-	if (pDriverData==NULL)
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
 		return IO_INVALID_HANDLE;
 
 #ifdef _DEBUG
-	((FileState_FAT*)pDriverData)->AssertValid();
+	pFS->AssertValid();
 #endif
 
-	IO_RESULT res = Flush(pDriverData);
-	((FileState_FAT*)pDriverData)->lFlags = IO_FILE_UNUSED; // and release the file handle
+	IO_RESULT res = ReleaseMapping(pFS);
+	if (res<IO_OK)
+	{
+		n = 0;
+		return res;
+	}
+
+	const unsigned long lSize = pFS->GetCommittedSize();
+	bool bEOF = false;
+	if (pos>=lSize || n>lSize-pos)
+	{
+		bEOF = true;
+		n = pos<lSize ? lSize-pos : 0;
+	}
+	if (n>0)
+		res = TransferAt(pFS, pos, pBuf, n, false, lSize);
 
 #ifdef _DEBUG
-	((FileState_FAT*)pDriverData)->AssertValid();
+	pFS->AssertValid();
 #endif
-	return res;
+	return res>=IO_OK && bEOF ? IO_EOF : res;
 }
 
-IO_RESULT DeviceIoDriver_FAT::Flush(IO_HANDLE pDriverData)
+IO_RESULT DeviceIoDriver_FAT::WriteFileAt(IO_HANDLE pDriverData, unsigned long pos, const char* pBuf, unsigned int& n)
 {
-	TRACEUFS0("flush file\n");
+	// Write at an absolute file offset; the file position is left alone.
+	TRACEUFS2_DET("write to file at %lu: %i bytes\n",pos,n);
 
-	// Write (open) buffer to cache and update directory entry.
-	if (pDriverData==NULL)
-		return IO_ERROR;
-	IO_RESULT res = IO_ERROR;
-	FileState_FAT* pFS = (FileState_FAT*)pDriverData;
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
 
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
 
-	// there is data in the buffer; save it
-	if (pFS->pData)
+	if (!pFS->IsWritable())
 	{
-		res = UnloadFatSector(pFS->pData/*, pFS->IsWritable()*/);
-		ASSERT(res>=IO_OK);
-		pFS->pData = NULL;
+		n = 0;
+		return IO_CANNOT_WRITE_FILE; // read only file
 	}
 
-	// Update directory entry.
-	// If you skip this, you will loose clusters and the OS will report a short file
-	res = Update(pFS->dea, pFS->lStartCluster, pFS->lFileSize);
+	IO_RESULT res = ReleaseMapping(pFS);
+	if (res>=IO_OK && pos>pFS->pShared->lFileSize)
+		res = IO_INVALID_FILE_POS;
+	if (res<IO_OK)
+	{
+		n = 0;
+		return res;
+	}
+
+	const unsigned long oldFileSize = pFS->pShared->lFileSize;
+	if (n>0xFFFFFFFF-pos)
+	{
+		ASSERT(0);
+		n = 0xFFFFFFFF-pos; // limit to 4G
+	}
+	if (pos+n>pFS->pShared->lFileSize)
+	{
+		res = GrowFile(pFS, pos+n);
+		if (res<IO_OK)
+		{
+			n = 0;
+			return res;
+		}
+	}
+	if (n>0)
+		res = TransferAt(pFS, pos, (char*)pBuf, n, true, oldFileSize);
 
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
-
 	return res;
 }
 
-IO_RESULT DeviceIoDriver_FAT::GetFileSize(IO_HANDLE pDriverData, unsigned long& s)
+IO_RESULT DeviceIoDriver_FAT::SyncFileAddress(FileState_FAT* pFS)
 {
-	TRACEUFS0("get file size\n");
-
-	// Write (open) buffer to cache and update directory entry.
-	if (pDriverData==NULL)
-		return IO_ERROR;
-	s = ((FileState_FAT*)pDriverData)->lFileSize;
+	// The writing handle of a file may have grown the cluster chain after this
+	// handle reached the end of the file. Step onto the new cluster before the
+	// sector at the file position is accessed.
+	if (pFS->pos>=pFS->GetCommittedSize())
+		return IO_OK; // no data to access
+	if (pFS->fa.m_lCluster==NULL_CLUSTER)
+	{
+		// the file was empty
+		ASSERT(pFS->pos==0);
+		pFS->fa.m_lCluster = pFS->pShared->lStartCluster;
+		pFS->fa.m_iSectorOffset = 0;
+	}
+	else if (pFS->fa.m_iSectorOffset>=GetNrOfSectorsPerCluster())
+	{
+		// EOF was on a cluster boundary (see SeekFile())
+		unsigned long next = 0;
+		const IO_RESULT res = m_fat.GetEntry(pFS->fa.m_lCluster, next);
+		if (res<IO_OK)
+			return res;
+		if (!m_fat.ValidClusterIndex(next))
+		{
+			ASSERT(0);
+			return IO_CORRUPT_FAT;
+		}
+		pFS->fa.m_lCluster = next;
+		pFS->fa.m_iSectorOffset = 0;
+	}
 	return IO_OK;
 }
 
-IO_RESULT DeviceIoDriver_FAT::GetNrOfFreeSectors(const char* /*szPath*/, unsigned long& n)
+IO_RESULT DeviceIoDriver_FAT::LocateFilePos(const FileState_FAT* pFS, unsigned long pos, FatAddress& fa)
 {
-	unsigned long t;
-	const IO_RESULT res = m_fat.NumberOfFreeEntries(t);
-	if (res>=IO_OK) n = t<<m_iSectorToClusterShift;
-	return res;
+	// Find the sector that holds byte 'pos' of the file (pos<file size).
+	// The chain is walked from the cluster of the current file position when
+	// pos lies at or after it, otherwise from the start of the file.
+	ASSERT(pos<pFS->pShared->lFileSize);
+
+	const unsigned char nClusterShift = GetByteToClusterShift();
+	const unsigned long lTarget = pos>>nClusterShift;
+	unsigned long lLogical = pFS->pos>>nClusterShift;
+	fa = pFS->fa;
+	if (fa.m_iSectorOffset>=GetNrOfSectorsPerCluster())
+		lLogical--; // at EOF on a cluster boundary; fa refers to the last cluster (see SeekFile)
+	if (!m_fat.ValidClusterIndex(fa.m_lCluster) || lLogical>lTarget)
+	{
+		lLogical = 0;
+		fa.m_lCluster = pFS->pShared->lStartCluster;
+	}
+	while (lLogical!=lTarget)
+	{
+		unsigned long next = 0;
+		const IO_RESULT res = m_fat.GetEntry(fa.m_lCluster, next);
+		if (res<IO_OK)
+			return res;
+		if (!m_fat.ValidClusterIndex(next))
+		{
+			ASSERT(0);
+			return IO_CORRUPT_FAT;
+		}
+		fa.m_lCluster = next;
+		lLogical++;
+	}
+	fa.m_iSectorOffset = (unsigned short)((pos>>GetByteToSectorShift()) & (GetNrOfSectorsPerCluster()-1));
+	return IO_OK;
 }
 
-IO_RESULT DeviceIoDriver_FAT::Flush()
+IO_RESULT DeviceIoDriver_FAT::TransferAt(FileState_FAT* pFS, unsigned long pos, char* pBuf, unsigned int& n, bool bWrite, unsigned long lOldSize)
 {
-	return m_fat.Flush();
+	// Copy n bytes between the user buffer and the file, starting at byte 'pos', 
+	// through a private FatAddress. The range must lie within the file.
+	// lOldSize is the file size before it was grown for writing; sectors 
+	// beyond it need not be preloaded.
+	ASSERT(pos+n<=pFS->pShared->lFileSize);
+
+	FatAddress fa;
+	IO_RESULT res = LocateFilePos(pFS, pos, fa);
+	const unsigned short nPerCluster = GetNrOfSectorsPerCluster();
+	unsigned int posWithinSector = pos & (SECTOR_SIZE-1);
+	unsigned int nDone = 0;
+	while (res>=IO_OK && nDone<n)
+	{
+		unsigned int nBytes = n-nDone;
+		if ((pFS->lFlags&IO_FILE_DIRECT) && posWithinSector==0 && nBytes>=SECTOR_SIZE)
+		{
+			nBytes &= ~(SECTOR_SIZE-1);
+			res = TransferDirect(pFS, fa, pBuf+nDone, nBytes, bWrite);
+		}
+		else
+		{
+			if (nBytes>SECTOR_SIZE-posWithinSector)
+				nBytes = SECTOR_SIZE-posWithinSector;
+			// the sector at the file position may be locked already
+			const bool bOwn = pFS->pData!=NULL && pFS->fa.m_lCluster==fa.m_lCluster && pFS->fa.m_iSectorOffset==fa.m_iSectorOffset;
+			char* pData = bOwn ? pFS->pData : NULL;
+			if (!bOwn)
+			{
+				const bool bPreLoad = !bWrite || (nBytes!=SECTOR_SIZE && pos-posWithinSector<lOldSize);
+				res = LoadFatSector(fa, &pData, bWrite || pFS->IsWritable(), bPreLoad);
+				if (res<IO_OK)
+					break;
+			}
+			if (bWrite)
+				memcpy(pData+posWithinSector, pBuf+nDone, nBytes);
+			else
+				memcpy(pBuf+nDone, pData+posWithinSector, nBytes);
+			if (!bOwn)
+				res = UnloadFatSector(pData);
+		}
+		if (res<IO_OK)
+			break;
+		nDone += nBytes;
+		pos += nBytes;
+		if (nDone<n)
+		{
+			// move fa on to the sector holding the new position
+			unsigned long nSectors = (posWithinSector+nBytes)>>GetByteToSectorShift();
+			while (res>=IO_OK && fa.m_iSectorOffset+nSectors>=nPerCluster)
+			{
+				nSectors -= nPerCluster-fa.m_iSectorOffset;
+				fa.m_iSectorOffset = 0;
+				unsigned long next = 0;
+				res = m_fat.GetEntry(fa.m_lCluster, next);
+				if (res>=IO_OK && !m_fat.ValidClusterIndex(next))
+				{
+					ASSERT(0);
+					res = IO_CORRUPT_FAT;
+				}
+				fa.m_lCluster = next;
+			}
+			fa.m_iSectorOffset += (unsigned short)nSectors;
+		}
+		posWithinSector = 0;
+	}
+	n = nDone;
+	return res;
 }
 
-IO_RESULT DeviceIoDriver_FAT::ReadFile(IO_HANDLE pDriverData, char* pBuf, unsigned int& n)
+IO_RESULT DeviceIoDriver_FAT::MapFile(IO_HANDLE pDriverData, const char*& p, unsigned int& n)
 {
-	TRACEUFS1_DET("read from file: %i bytes\n",n);
+	// Hand out a pointer into the cache sector at the current file position,
+	// instead of copying its content like ReadFile() does. The sector stays 
+	// locked until the next call, ReleaseFile() or Flush(), even if the file
+	// position moves on to the next sector.
+	TRACEUFS1_DET("map file: %i bytes\n",n);
 
-	if (pDriverData==NULL)
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
 		return IO_INVALID_HANDLE;
 
-	IO_RESULT res = IO_OK;
-	FileState_FAT* pFS = (FileState_FAT*)pDriverData;
-
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
 
-	unsigned int nBytesRead = 0;
+	p = NULL;
+	IO_RESULT res = ReleaseMapping(pFS);
+	if (res<IO_OK)
+	{
+		n = 0;
+		return res;
+	}
+
+	const unsigned long lSize = pFS->GetCommittedSize();
 	bool bEOF = false;
-	if (pFS->pos+n>pFS->lFileSize)
+	if (n>lSize-pFS->pos) // (n may be huge; don't overflow pos+n)
 	{
 		bEOF = true;
-		n = pFS->lFileSize - pFS->pos;
+		n = lSize - pFS->pos;
 	}
-	// determine how many bytes we can read from current sector
-	unsigned int posWithinSector = pFS->pos & (SECTOR_SIZE-1);
-//	unsigned int posWithinSector = pFS->pos % SECTOR_SIZE;
-	unsigned int maxReadWithinSector = SECTOR_SIZE-posWithinSector;
-	while (n>0)
+	if (n==0)
+		return bEOF ? IO_EOF : IO_OK;
+
+	// never map beyond the end of the current sector
+	const unsigned int posWithinSector = pFS->pos & (SECTOR_SIZE-1);
+	if (n>SECTOR_SIZE-posWithinSector)
 	{
-		const unsigned int nBytesToRead = n>=maxReadWithinSector ? maxReadWithinSector : n;
-		if (pFS->pData==NULL)
-		{
+		n = SECTOR_SIZE-posWithinSector;
+		bEOF = false;
+	}
+	if (pFS->pData==NULL)
+	{
+		res = SyncFileAddress(pFS);
+		if (res>=IO_OK)
 			res = LoadFatSector(pFS->fa, &pFS->pData, pFS->IsWritable(), true);
-			if (res<IO_OK)
-			{
-				pFS->pData = NULL;
-				goto _exit;
-			}
-		}
-		memcpy(pBuf,pFS->pData+posWithinSector, nBytesToRead);
-		// forward file position
-		res = Seek(pFS, seekCurrent, nBytesToRead); // will release sector
 		if (res<IO_OK)
 		{
-			goto _exit;
+			pFS->pData = NULL;
+			n = 0;
+			return res;
 		}
-		pBuf+=nBytesToRead;
-		n-=nBytesToRead;
-		nBytesRead+=nBytesToRead;
-		maxReadWithinSector = SECTOR_SIZE; // can read complete sectors from now on
-		posWithinSector = 0;
 	}
-_exit:
+	p = pFS->pData+posWithinSector;
+	if (posWithinSector+n==SECTOR_SIZE)
+	{
+		// Seek() would release the sector when the position moves to the next 
+		// one, so hand it over to pMapped first
+		pFS->pMapped = pFS->pData;
+		pFS->pData = NULL;
+	}
+	else
+		pFS->bPinned = true; // the sector may not be taken away by ReleaseIdleSector()
+	// forward file position
+	res = SeekFile(pFS, seekCurrent, n);
+	if (res<IO_OK)
+	{
+		p = NULL;
+		n = 0;
+		return res;
+	}
+
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
-	n = nBytesRead; // inform user about how many bytes are actually read
-	return res>=IO_OK && bEOF ? IO_EOF : res; // TODO: put EOF in separate bit
+	return bEOF ? IO_EOF : IO_OK;
 }
 
-IO_RESULT DeviceIoDriver_FAT::WriteFile(IO_HANDLE pDriverData, const char* pBuf, unsigned int& n)
+IO_RESULT DeviceIoDriver_FAT::ReleaseFile(IO_HANDLE pDriverData)
 {
-	TRACEUFS1_DET("write to file: %i bytes\n",n);
-
-	unsigned int posWithinSector;
-	unsigned int maxWriteWithinSector;
-	bool bPreLoad = true;
-
-	if (pDriverData==NULL)
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
 		return IO_INVALID_HANDLE;
+	return ReleaseMapping(pFS);
+}
 
+IO_RESULT DeviceIoDriver_FAT::ReleaseMapping(FileState_FAT* pFS)
+{
+	// release the sectors that were handed out to the user
 	IO_RESULT res = IO_OK;
-	FileState_FAT* pFS = (FileState_FAT*)pDriverData;
+	pFS->bPinned = false;
+	if (pFS->pMapped)
+	{
+		res = UnloadFatSector(pFS->pMapped);
+		ASSERT(res>=IO_OK);
+		pFS->pMapped = NULL;
+	}
+	if (pFS->nReserved!=0)
+	{
+		// cancel the reservation of ReserveFile()
+		const IO_RESULT r = CommitReservation(pFS, 0);
+		if (res>=IO_OK)
+			res = r;
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoDriver_FAT::ReserveFile(IO_HANDLE pDriverData, char*& p, unsigned int& n)
+{
+	// Hand out a pointer into the (writable) cache sector at the current file 
+	// position, instead of copying user data into it like WriteFile() does.
+	// The file grows immediately, but CommitFile() decides how many bytes 
+	// are actually kept.
+	TRACEUFS1_DET("reserve file: %i bytes\n",n);
+
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
 
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
 
+	p = NULL;
 	if (!pFS->IsWritable())
 	{
 		n = 0;
 		return IO_CANNOT_WRITE_FILE; // read only file
 	}
-
-	if (pFS->pos>pFS->lFileSize)
+	if (pFS->pos>pFS->pShared->lFileSize)
 	{
 		n = 0;
 		return IO_INVALID_FILE_POS;
 	}
-	unsigned int nBytesWritten = 0;
-	const unsigned long oldFileSize = pFS->lFileSize;
-	// check if we must increase file size
-//	unsigned long lNewSize = pFS->pos+n;
-	bool bGrow = false;
-	unsigned long newSize = pFS->pos+n;
-	//check addition for overflow
-	if (newSize<pFS->pos)
+	IO_RESULT res = ReleaseMapping(pFS); // also cancels a previous reservation
+	if (res<IO_OK)
 	{
-		ASSERT(0);
-		newSize = 0xFFFFFFFF - pFS->pos; // limit to 4G
+		n = 0;
+		return res;
 	}
-	if (newSize>pFS->lFileSize) 
+
+	// never reserve beyond the end of the current sector
+	const unsigned int posWithinSector = pFS->pos & (SECTOR_SIZE-1);
+	if (n>SECTOR_SIZE-posWithinSector)
+		n = SECTOR_SIZE-posWithinSector;
+	if (n==0)
+		return IO_OK;
+
+	// the sector must only be preloaded when it already holds file data
+	const bool bPreLoad = pFS->pos-posWithinSector < pFS->pShared->lFileSize;
+	pFS->pShared->lReservedSize = pFS->pShared->lFileSize;
+	if (pFS->pos+n>pFS->pShared->lFileSize)
 	{
-		res = m_fat.Grow(pFS->lStartCluster, pFS->lFileSize, newSize-pFS->lFileSize, pFS->fa.m_lCluster/*last cluster hint*/);
+		res = GrowFile(pFS, pFS->pos+n);
 		if (res<IO_OK)
-			goto _exit;
-		ASSERT(m_fat.ValidFatValue(pFS->lStartCluster));
-		bGrow = true;
-		// check if this is an empty file that is being expanded
-		if (pFS->lFileSize==0)
-		{
-			ASSERT(pFS->fa.m_lCluster==NULL_CLUSTER);
-			ASSERT(pFS->pos==0);
-			pFS->fa.m_lCluster = pFS->lStartCluster;
-			ASSERT(pFS->fa.m_iSectorOffset==0);
-			bPreLoad = false;
-		}
-		// special case: when pos was at EOF and on a sector boundary
-		else if (pFS->lFileSize==pFS->pos && (pFS->lFileSize&(SECTOR_SIZE-1))==0) 
-		{
-			// In this case 'pos' pointed beyond the last valid sector,
-			// but since the cluster chain has grown it is now save to move on when
-			// m_iSectorOffset was set to #sectors_per_cluster in Seek
-			ASSERT(m_fat.ValidClusterIndex(pFS->fa.m_lCluster));
-			if (pFS->fa.m_iSectorOffset>=GetNrOfSectorsPerCluster())
-			{
-				pFS->fa.m_iSectorOffset = 0;
-				res = m_fat.GetEntry(pFS->fa.m_lCluster, pFS->fa.m_lCluster);
-				ASSERT(m_fat.ValidClusterIndex(pFS->fa.m_lCluster));
-				if (res<IO_OK)
-				{
-					ASSERT(0);
-					goto _exit;
-				}
-			}
-			bPreLoad = false;
+		{
+			n = 0;
+			return res;
+		}
+	}
+	pFS->nReserved = n;
+	if (pFS->pData==NULL)
+	{
+		res = LoadFatSector(pFS->fa, &pFS->pData, true, bPreLoad);
+		if (res<IO_OK)
+		{
+			pFS->pData = NULL;
+			CommitReservation(pFS, 0); // undo growth
+			n = 0;
+			return res;
 		}
-//		ASSERT(pFS->fa.m_lCluster==pFS->lStartCluster);
-		pFS->lFileSize = newSize;
 	}
+	p = pFS->pData+posWithinSector;
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoDriver_FAT::CommitFile(IO_HANDLE pDriverData, unsigned int nUsed)
+{
+	TRACEUFS1_DET("commit file: %i bytes\n",nUsed);
+
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+	return CommitReservation(pFS, nUsed);
+}
+
+IO_RESULT DeviceIoDriver_FAT::CommitReservation(FileState_FAT* pFS, unsigned int nUsed)
+{
+	// Keep the first nUsed bytes of the area that was handed out by
+	// ReserveFile() and advance the file position. The remainder is given
+	// back, including the cluster that may have been added for it.
+	IO_RESULT res = IO_OK;
+
+#ifdef _DEBUG
+	pFS->AssertValid();
+#endif
+
+	if (nUsed>pFS->nReserved)
+	{
+		// nothing (or less) reserved; keep the file as it was
+		nUsed = 0;
+		res = IO_INVALID_FILE_POS;
+	}
+	if (pFS->nReserved==0)
+		return res;
 
-	// determine how many bytes we can read from current sector
-	posWithinSector = pFS->pos & (SECTOR_SIZE-1);
-//	posWithinSector = pFS->pos % SECTOR_SIZE;
-	maxWriteWithinSector = SECTOR_SIZE-posWithinSector;
-	while (n>0)
+	const unsigned long newSize = pFS->pos+nUsed>pFS->pShared->lReservedSize ? pFS->pos+nUsed : pFS->pShared->lReservedSize;
+	pFS->nReserved = 0;
+	if (nUsed>0)
 	{
-		const unsigned int nBytesToWrite = n>=maxWriteWithinSector ? maxWriteWithinSector : n;
-		if (pFS->pData==NULL)
+		// forward file position
+		const IO_RESULT r = SeekFile(pFS, seekCurrent, nUsed); // will release the sector when it is full
+		if (r<IO_OK)
+			return r;
+	}
+
+	if (newSize<pFS->pShared->lFileSize)
+	{
+		// release the cluster that was added but isn't used after all
+		// (the file position is at its start in that case)
+		const unsigned char nShift = GetByteToClusterShift();
+		const unsigned long nKeep = newSize>0 ? ((newSize-1)>>nShift)+1 : 0;
+		const unsigned long nHave = ((pFS->pShared->lFileSize-1)>>nShift)+1;
+		if (nKeep<nHave)
 		{
-			res = LoadFatSector(pFS->fa, &pFS->pData, true, (bPreLoad && nBytesToWrite!=SECTOR_SIZE) ); // preserve content of partially written sectors
-			if (res<IO_OK)
+			ASSERT(nKeep+1==nHave && pFS->pos==newSize);
+			IO_RESULT r = IO_OK;
+			if (pFS->pData)
 			{
+				r = UnloadFatSector(pFS->pData);
 				pFS->pData = NULL;
-				goto _exit;
 			}
+			if (nKeep==0)
+			{
+				if (r>=IO_OK)
+					r = m_fat.UnlinkChain(pFS->pShared->lStartCluster);
+				pFS->pShared->lStartCluster = NULL_CLUSTER;
+				pFS->fa.m_lCluster = NULL_CLUSTER;
+				pFS->fa.m_iSectorOffset = 0;
+			}
+			else
+			{
+				// walk to the new last cluster of the chain
+				unsigned long lLast = pFS->pShared->lStartCluster;
+				for (unsigned long i=1; i<nKeep && r>=IO_OK; i++)
+					r = m_fat.GetEntry(lLast, lLast);
+				if (r>=IO_OK)
+					r = m_fat.SetEntry(lLast, m_fat.LastClusterValue(), false);
+				if (r>=IO_OK)
+					r = m_fat.UnlinkChain(pFS->fa.m_lCluster);
+				pFS->fa.m_lCluster = lLast;
+				pFS->fa.m_iSectorOffset = GetNrOfSectorsPerCluster(); // see Seek()
+			}
+			if (r<IO_OK)
+				return r;
+			pFS->pShared->nClusters = nKeep;
 		}
-		memcpy(pFS->pData+posWithinSector, pBuf, nBytesToWrite);
-		// forward file position
-		res = Seek(pFS, seekCurrent, nBytesToWrite); // will release sector
-		if (res<IO_OK)
-		{
-			goto _exit;
-		}
-		pBuf+=nBytesToWrite;
-		n-=nBytesToWrite;
-		nBytesWritten+=nBytesToWrite;
-		maxWriteWithinSector = SECTOR_SIZE; // can read complete sectors from now on
-		posWithinSector = 0;
-		if (pFS->pos>=oldFileSize)
-			bPreLoad = false; // no need to load next sector when writing beyond EOF
+		pFS->pShared->lFileSize = newSize;
 	}
-_exit:
-	n = nBytesWritten; // inform user about how many bytes are actually written
+
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
@@ -2032,36 +4205,49 @@ _exit:
 
 IO_RESULT DeviceIoDriver_FAT::Tell(IO_HANDLE pDriverData, unsigned long& pos)
 {
-	if (pDriverData==NULL)
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
 		return IO_INVALID_HANDLE;
-
-	FileState_FAT* pFS = (FileState_FAT*)pDriverData;
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
 	pos = pFS->pos;
-	ASSERT(pos<=pFS->lFileSize);
+	ASSERT(pos<=pFS->pShared->lFileSize);
 	TRACEUFS1_DET("tell %lu\n",pos);
 	return IO_OK;
 }
 
 IO_RESULT DeviceIoDriver_FAT::Seek(IO_HANDLE pDriverData, seekMode mode, long offset)
+{
+	FileState_FAT* pFS = GetFileState(pDriverData);
+	if (pFS==NULL)
+		return IO_INVALID_HANDLE;
+	return SeekFile(pFS, mode, offset);
+}
+
+IO_RESULT DeviceIoDriver_FAT::SeekFile(FileState_FAT* pFS, seekMode mode, long offset)
 {
 	// Seek a file postion (byte offset) in existing cluster chain!
 	// Note the seek to EOF means that the file position becomes equal to file size in bytes.
 
 	// This function should be optimal for forward seeks (sequential access) and rewinds.
 
-	if (pDriverData==NULL)
-		return IO_INVALID_HANDLE;
-
 	IO_RESULT res = IO_ERROR;
-	FileState_FAT* pFS = (FileState_FAT*)pDriverData;
 
 #ifdef _DEBUG
 	pFS->AssertValid();
 #endif
 
+	// moving the file position cancels the reservation of ReserveFile()
+	if (pFS->nReserved!=0)
+	{
+		res = CommitReservation(pFS, 0);
+		if (res<IO_OK)
+			return res;
+	}
+
+	// other handles don't look beyond the bytes that the writer has committed
+	const unsigned long lSize = pFS->GetCommittedSize();
 	unsigned long seekPos;
 	switch (mode)
 	{
@@ -2074,13 +4260,13 @@ IO_RESULT DeviceIoDriver_FAT::Seek(IO_HANDLE pDriverData, seekMode mode, long of
 		break;
 
 	case seekEnd: // NB pos should be zero or negative
-		seekPos = (offset>0 || ((unsigned long)-offset)>pFS->lFileSize) ? -1 : (pFS->lFileSize - (unsigned long)offset);
+		seekPos = (offset>0 || ((unsigned long)-offset)>lSize) ? -1 : (lSize - (unsigned long)offset);
 		break;
 	}
 
 	TRACEUFS1_DET("seek %lu\n",seekPos);
 
-	if (seekPos>pFS->lFileSize) 
+	if (seekPos>lSize) 
 		return IO_INVALID_FILE_POS;
 
 	if (seekPos==pFS->pos && pFS->pData!=NULL)
@@ -2094,7 +4280,7 @@ IO_RESULT DeviceIoDriver_FAT::Seek(IO_HANDLE pDriverData, seekMode mode, long of
 //	const unsigned long seekLogicalSector = seekPos/SECTOR_SIZE;
 
 	// do we need to explore new unknown space; where no one has gone before...?
-	if (seekLogicalSector!=currentLogicalSector)
+	if (seekLogicalSector!=currentLogicalSector || pFS->fa.m_lCluster==NULL_CLUSTER)
 	{
 		unsigned long currentLogicalCluster = currentLogicalSector>>m_iSectorToClusterShift;
 		const unsigned long seekLogicalCluster = seekLogicalSector>>m_iSectorToClusterShift;
@@ -2108,18 +4294,28 @@ IO_RESULT DeviceIoDriver_FAT::Seek(IO_HANDLE pDriverData, seekMode mode, long of
 			pFS->pData = NULL;
 		}
 
-		if (seekLogicalSector<currentLogicalSector)
+		if (seekLogicalSector<currentLogicalSector || pFS->fa.m_lCluster==NULL_CLUSTER)
 		{
 			// hmmm... rewind and walk upstream
+			// (also when the file was empty, but has been grown by another handle)
 			currentLogicalCluster = 0;
-			pFS->fa.m_lCluster = pFS->lStartCluster; // zero for empty files
+			pFS->fa.m_lCluster = pFS->pShared->lStartCluster; // zero for empty files
 			pFS->fa.m_iSectorOffset = 0;
 		}
+		else if (pFS->fa.m_iSectorOffset>=GetNrOfSectorsPerCluster())
+			currentLogicalCluster--; // still at the last cluster, see the EOF situation below
 		// walk the FAT upstream from here
 		while (currentLogicalCluster!=seekLogicalCluster)
 		{
 			// realize that we have logical cluster and sectors and REAL ones
 			ASSERT(pFS->fa.m_lCluster!=0); // file cannot be empty at this point
+			if (currentLogicalCluster+1==seekLogicalCluster && seekPos==lSize && (seekPos&((SECTOR_SIZE<<m_iSectorToClusterShift)-1))==0)
+			{
+				// Seek to EOF on a cluster boundary (see below). Don't step onto 
+				// a cluster that the writing handle has only reserved.
+				pFS->fa.m_iSectorOffset = GetNrOfSectorsPerCluster();
+				goto _done;
+			}
 			unsigned long next = 0;
 			res = m_fat.GetEntry(pFS->fa.m_lCluster, next);
 			if (!m_fat.ValidClusterIndex(next))
@@ -2135,7 +4331,7 @@ IO_RESULT DeviceIoDriver_FAT::Seek(IO_HANDLE pDriverData, seekMode mode, long of
 					// during chain extension (ie. FileWrite).
 					// File read operation are no problem in this situation since
 					// we are at EOF.
-					ASSERT((seekPos&((SECTOR_SIZE<<m_iSectorToClusterShift)-1))==0 && seekPos==pFS->lFileSize);
+					ASSERT((seekPos&((SECTOR_SIZE<<m_iSectorToClusterShift)-1))==0 && seekPos==pFS->pShared->lFileSize);
 					pFS->fa.m_iSectorOffset = GetNrOfSectorsPerCluster(); // one beyond valid number == #of sectors per cluster
 					goto _done;
 				}
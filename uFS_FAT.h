@@ -36,7 +36,7 @@
 /* - Still have to implement support for long filenames.                    */
 /* - Only devices with sectors of 512 bytes are supported.                  */
 /* - FAT32 format is not tested/debugged yet. DON'T USE IT AT HOME.         */
-/* - Don't open the same file twice at the same!                            */
+/* - Only one handle of a file can write to it at the same time.            */
 /* - The FAT backup is not updates at the moment.                           */
 /*                                                                          */
 /* Most interfaces return an error status (IO_ERROR), which is negative     */
@@ -54,16 +54,26 @@
 // configuration
 
 #define MAX_OPEN_FAT_FILES 3		// defines how many (FAT) files can be open
-									// simultaneously
-									// Note that you should have a cache size
-									// of at least MAX_OPEN_FAT_FILES+1
-									// because the FatManager also requires
-									// one cached page.
-
-#if CACHE_SIZE<MAX_OPEN_FAT_FILES+1
-#error "Increase cache the size"
+									// simultaneously, unless a larger file table
+									// is supplied with SetFileTable().
+									// Open files release their locked sector 
+									// when the cache runs out of free pages, so 
+									// this number is not limited by CACHE_SIZE.
+
+#if CACHE_SIZE<3
+#error "Increase cache the size" // FatManager, directory and file data each lock a page
 #endif
 
+#define MAX_DELETE_TREE_DEPTH 8		// nr of directory levels that DeleteTree() keeps
+									// track of; deeper levels are found back through
+									// their '..' entry (i.e. a bit slower)
+#define DELETE_TREE_BATCH 16		// nr of cluster chains that DeleteTree() collects
+									// before releasing them (at least 1 sector of entries)
+#define DIR_SCAN_SECTORS 2			// nr of directory sectors that are read with a single
+									// command when looking up entries; takes a static
+									// buffer of DIR_SCAN_SECTORS*SECTOR_SIZE bytes (1KB)
+									// (0 or 1 disables this, and uses the sector cache instead)
+
 // 'comment out' zero or more (but not all) of the following lines to disable 
 // the corresponding partition format.
 #define IMPLEMENT_FAT12				// i.e. floppy disk format
@@ -75,7 +85,7 @@
 
 #define FIRST_VALID_CLUSTER 2	// FAT indexes are base-2, i.e. 1st cluster is #2
 #define NULL_CLUSTER 0			// special (invalid) cluster value
-#define FIXED_ROOT -1			// FAT12/16 have a fixed (non clustered) root directory
+#define FIXED_ROOT ((unsigned long)-1)	// FAT12/16 have a fixed (non clustered) root directory
 
 #define BIT_SHIFT_TO_N(s) (1<<(s))     // i.e. 2^s
 
@@ -107,6 +117,12 @@ public:
 		m_iSectorOffset = iSectorOffset;
 	}
 
+	FatAddress(const FatAddress& rhs)
+	{
+		m_lCluster = rhs.m_lCluster;
+		m_iSectorOffset = rhs.m_iSectorOffset;
+	}
+
 	void operator=(const FatAddress& rhs)
 	{
 		m_lCluster = rhs.m_lCluster;
@@ -123,6 +139,9 @@ public:
 // Same as FatAddress, but extended with an directory table index.
 // Note that directory 'files' most often consist of more than one sector.
 // However, m_iTableIndex is always relative to the start of the current sector.
+// The address of the long filename entries in front of the entry (if any) is 
+// kept as well. For new entries, m_szLongName refers to the name that still has 
+// to be written (by DeviceIoDriver_FAT::Update()).
 
 class DirEntryAddress : public FatAddress
 {
@@ -132,14 +151,26 @@ public:
 		FatAddress(lCluster, iSectorOffset)
 	{
 		m_iTableIndex = iTableIndex;
+		m_iLfnTableIndex = 0;
+		m_nLfnEntries = 0;
+		m_szLongName = NULL;
+		m_iLongNameLen = 0;
 	}
 
 	void operator=(const FatAddress& rhs)
 	{
 		FatAddress::operator =(rhs);
+		m_nLfnEntries = 0; // refers to another entry now
+		m_szLongName = NULL;
 	}
 
 	unsigned short m_iTableIndex; // zero based directory entry index (per sector)
+
+	FatAddress m_lfnStart;			// sector of the first long filename entry
+	unsigned short m_iLfnTableIndex;// index of the first long filename entry
+	unsigned char m_nLfnEntries;	// nr of long filename entries (0 if none)
+	const char* m_szLongName;		// name of a new entry (not nul terminated), or NULL
+	unsigned short m_iLongNameLen;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -376,6 +407,154 @@ public:
 #endif
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// FileState_FAT
+//
+// FileState_FAT structures are used to store the state of open files
+// handled by the FAT device driver. Each driver takes its file states from
+// a fixed-size table: a built-in one of MAX_OPEN_FAT_FILES entries, or 
+// a table supplied by the caller (see DeviceIoDriver_FAT::SetFileTable()).
+// Unused entries are linked in a free list.
+//
+// One important note about the current file position ('pos'):
+// The file position is a zero-based index, which holds
+// the (byte) position of the next read or write operation.
+// A value of zero indicates the start of the file.
+// An end-of-file situation occurs when a file read operation
+// occurs beyond the last byte. The file pointer can be set to
+// EOF by setting the value to the file length (in bytes).
+// The FatAddress (fa) is always synchronized with the
+// current file pointer to improve sector read/write operations.
+// A special situation occurs when the file position is set
+// to end of file while the file size is exactly a multiple of the
+// cluster size (512, 1024, ...). In this case it is not possible
+// to synchronize the FatAddress because this cluster does not
+// (yet) exist. When this happens we set the FatAddress to
+// the last cluster in the FAT chain. This is useful because
+// we might want to add new files at the end of the chain during
+// a write operation at EOF.
+//
+// A file can be opened more than once (but only one handle can write to it).
+// The properties of the file itself (SharedFileState_FAT) are then kept by 
+// one of its handles and referenced by all of them, while each handle has 
+// its own position and locked sector. The cluster chain may grow through 
+// the writing handle, so other handles step onto new clusters when needed.
+//
+// Open files are found by the address of their directory entry: the shared
+// states are hashed into chains whose heads are kept in the file table
+// itself (pOpenBucket), one per entry, so a lookup only visits the files in
+// one chain instead of the whole table. The handles of a file are linked
+// from its shared state (pHandles), so closing one of them doesn't have to
+// scan the table either.
+
+class FileState_FAT;
+
+class SharedFileState_FAT
+{
+public:
+	SharedFileState_FAT()
+	{
+		lFileSize = 0;
+		lStartCluster = 0;
+		lReservedSize = 0;
+		nClusters = 0;
+		lDirSize = 0;
+		lDirStartCluster = 0;
+		lDirTime = 0;
+		lUpdateInterval = 0;
+		policy = updateOnFlush;
+		nHandles = 0;
+		pWriter = NULL;
+		pHandles = NULL;
+		pNextOpen = NULL;
+	}
+
+	unsigned long lFileSize;		// file size in bytes
+	unsigned long lStartCluster;	// start of cluster chain (same as value in directory entry, 0 for empty files)
+	unsigned long lReservedSize;	// file size before ReserveFile() of the writer grew the file
+	unsigned long nClusters;		// length of the cluster chain, may exceed the file size (see PreallocateFile())
+	unsigned long lDirSize;			// file size as recorded in the directory entry
+	unsigned long lDirStartCluster;	// start cluster as recorded in the directory entry
+	unsigned long lDirTime;			// time of the last entry update in seconds (updateTimer only)
+	unsigned long lUpdateInterval;	// see SetUpdatePolicy()
+	updatePolicy policy;			// when Flush() updates the directory entry
+	DirEntryAddress dea;			// location of directory entry (not the entry contents)
+	unsigned short nHandles;		// nr of open handles that refer to this state
+	FileState_FAT* pWriter;			// the handle that may write to the file, or NULL
+	FileState_FAT* pHandles;		// the open handles of the file, linked by pNextHandle
+	SharedFileState_FAT* pNextOpen;	// next open file in the same hash chain, or NULL
+};
+
+class FileState_FAT
+{
+public:
+	FileState_FAT()
+	{
+#ifdef _DEBUG
+		// put all members in a magic sandwitch  to
+		// trap out-of-bound modifications
+		magic0 = magic1 = 0xaa55aa55;
+#endif
+		pos = -1;
+		pShared = NULL;
+		pData = NULL;
+		pMapped = NULL;
+		nReserved = 0;
+		lFlags = IO_FILE_UNUSED;	// error flags, or entry unused if -1
+		pNextFree = NULL;
+		pNextHandle = NULL;
+		pOpenBucket = NULL;
+		iGeneration = 0;
+		bPinned = false;
+	}
+
+	bool IsWritable() const 
+		{ return (lFlags&IO_FILE_WRITABLE)!=0; }
+
+	// only the writer changes the file and its directory entry
+	bool IsWriter() const
+		{ return pShared!=NULL && pShared->pWriter==this; }
+
+	// the file size, without the bytes of a pending ReserveFile()
+	unsigned long GetCommittedSize() const
+		{ return pShared->pWriter!=NULL && pShared->pWriter->nReserved!=0 ? pShared->lReservedSize : pShared->lFileSize; }
+
+#ifdef _DEBUG
+	// check state values in debug mode
+	void AssertValid()
+	{
+		ASSERT(magic0==0xaa55aa55); 
+		ASSERT(magic1==0xaa55aa55); 
+		if (pos==0 && pShared!=NULL)
+		{
+			// NULL_CLUSTER when another handle has grown the empty file
+			ASSERT(fa.m_lCluster==pShared->lStartCluster || fa.m_lCluster==NULL_CLUSTER);
+			ASSERT(fa.m_iSectorOffset==0);
+		}
+	}
+#endif
+
+#ifdef _DEBUG
+	unsigned long magic0;
+#endif
+	char* pData;					// pointer to cache page, or NULL
+	char* pMapped;					// previous cache page, still locked for MapFile(), or NULL
+	unsigned int nReserved;			// nr of bytes reserved by ReserveFile(), 0 if none
+	unsigned long pos;				// current file position
+	unsigned long lFlags;			// see IO_FILE_XXX, 0xffffffff for unused entries
+	SharedFileState_FAT* pShared;	// properties of the file, shared by all its handles
+	SharedFileState_FAT shared;		// storage for pShared when this handle keeps them
+	FatAddress fa;					// location of current sector (according to 'pos'), NULL_CLUSTER for empty files
+	FileState_FAT* pNextFree;		// next unused entry in the free list of the driver
+	FileState_FAT* pNextHandle;		// next handle of the same file, or NULL
+	SharedFileState_FAT* pOpenBucket;	// head of the hash chain of open files for this table index
+	unsigned short iGeneration;		// incremented on close, to detect stale file handles
+	bool bPinned;					// pData is handed out to the user by MapFile()
+#ifdef _DEBUG
+	unsigned long magic1;
+#endif
+}; 
+
 ///////////////////////////////////////////////////////////////////////////////
 // Class DeviceIoDriver_FAT
 //
@@ -399,6 +578,12 @@ friend class FatManager;
 
 public:
 	DeviceIoDriver_FAT();
+	virtual ~DeviceIoDriver_FAT();
+
+	// Replace the built-in table of MAX_OPEN_FAT_FILES file states by a larger
+	// table (e.g. a static array), typically right after the driver is created 
+	// (see DeviceIoDriverFactory). Returns IO_FILE_OPEN if files are open.
+	IO_RESULT SetFileTable(FileState_FAT* pTable, unsigned int nEntries);
 
 	// DeviceIoDriver interface implementation 
 	virtual IO_RESULT MountSW(BlockDeviceInterface* pHal, void* custom=NULL, long hDevice=-1);
@@ -410,20 +595,48 @@ public:
 	virtual int GetNrOfVolumes() const;
 
 	// DeviceIoFile interface implementation (treat pDriverData as a file handle!)
-	virtual IO_RESULT CreateDirectory(const char* szFilePath);
-	virtual IO_RESULT OpenFile(const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags);
-	virtual IO_RESULT FileExist(const char* szFilename);
-	virtual IO_RESULT DeleteFile(const char* szFilename, unsigned long lFlags=0); // also for deleting directories
+	virtual IO_RESULT CreateDirectory(const char* szFilePath) { return CreateDirectoryAt(NULL_CLUSTER, szFilePath); }
+	virtual IO_RESULT CreateDirectories(const char* szFilePath); // including missing parents
+	virtual IO_RESULT CreateFiles(const char* szDirPath, const char* const* pszNames, const unsigned char* pAttributes, int nFiles, IO_RESULT* pResults);
+	virtual IO_RESULT OpenFile(const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags) { return OpenFileAt(NULL_CLUSTER, szFilePath, ioFile, lFlags); }
+	virtual IO_RESULT FileExist(const char* szFilename) { return FileExistAt(NULL_CLUSTER, szFilename); }
+	virtual IO_RESULT GetFileInfo(const char* szFilePath, DeviceIoFileInfo& info) { return GetFileInfoAt(NULL_CLUSTER, szFilePath, info); }
+	virtual IO_RESULT DeleteFile(const char* szFilename, unsigned long lFlags=0) { return DeleteFileAt(NULL_CLUSTER, szFilename, lFlags); } // also for deleting directories
+	virtual IO_RESULT DeleteTree(const char* szFilePath, unsigned long lFlags=0); // directory including its contents
+	virtual IO_RESULT Rename(const char* szFromPath, const char* szToPath); // also moves files or directories
+	virtual IO_RESULT CompactDirectory(const char* szDirPath); // removes deleted entries, releases unused clusters
+	virtual IO_RESULT OpenDirectory(const char* szDirPath, DeviceIoDirectory& dir) { return OpenDirectoryAt(NULL_CLUSTER, szDirPath, dir); }
+
+	// relative paths (lDir is the first cluster of a directory, see DeviceIoDirectory)
+	virtual IO_RESULT OpenDirectoryAt(unsigned long lDir, const char* szDirPath, DeviceIoDirectory& dir);
+	virtual IO_RESULT OpenFileAt(unsigned long lDir, const char* szFilePath, DeviceIoFile& ioFile, unsigned long lFlags);
+	virtual IO_RESULT FileExistAt(unsigned long lDir, const char* szFilename);
+	virtual IO_RESULT GetFileInfoAt(unsigned long lDir, const char* szFilePath, DeviceIoFileInfo& info);
+	virtual IO_RESULT CreateDirectoryAt(unsigned long lDir, const char* szFilePath);
+	virtual IO_RESULT DeleteFileAt(unsigned long lDir, const char* szFilename, unsigned long lFlags=0);
+
 	virtual IO_RESULT CloseFile(IO_HANDLE pDriverData);
 	virtual IO_RESULT ReadFile(IO_HANDLE pDriverData, char* pBuf, unsigned int& n);
 	virtual IO_RESULT WriteFile(IO_HANDLE pDriverData, const char* pBuf, unsigned int& n);
+	virtual IO_RESULT ReadFileV(IO_HANDLE pDriverData, const DeviceIoVector* pVec, int nVec, unsigned long& n);
+	virtual IO_RESULT WriteFileV(IO_HANDLE pDriverData, const DeviceIoVector* pVec, int nVec, unsigned long& n);
+	virtual IO_RESULT ReadFileAt(IO_HANDLE pDriverData, unsigned long pos, char* pBuf, unsigned int& n);
+	virtual IO_RESULT WriteFileAt(IO_HANDLE pDriverData, unsigned long pos, const char* pBuf, unsigned int& n);
+	virtual IO_RESULT MapFile(IO_HANDLE pDriverData, const char*& p, unsigned int& n);
+	virtual IO_RESULT ReleaseFile(IO_HANDLE pDriverData);
+	virtual IO_RESULT ReserveFile(IO_HANDLE pDriverData, char*& p, unsigned int& n);
+	virtual IO_RESULT CommitFile(IO_HANDLE pDriverData, unsigned int nUsed);
 	virtual IO_RESULT Seek(IO_HANDLE pDriverData, seekMode mode, long pos);
 	virtual IO_RESULT Tell(IO_HANDLE pDriverData, unsigned long& pos);
 	virtual IO_RESULT Flush(IO_HANDLE pDriverData);
 	virtual IO_RESULT GetFileSize(IO_HANDLE pDriverData, unsigned long& s);
+	virtual IO_RESULT PreallocateFile(IO_HANDLE pDriverData, unsigned long n);
+	virtual IO_RESULT SetUpdatePolicy(IO_HANDLE pDriverData, updatePolicy policy, unsigned long lInterval);
+	virtual IO_RESULT ReadFileAsync(IO_HANDLE pDriverData, char* pBuf, unsigned int n, BlockDeviceRequest& r, AsyncBlockDeviceInterface*& pDevice);
 	virtual IO_RESULT GetNrOfFreeSectors(const char* szPath/*ignored*/, unsigned long& n);
 	virtual IO_RESULT GetNrOfSectors(const char* szPath, unsigned long& n) {n = m_nSectors; return IO_OK;}
 	virtual IO_RESULT Flush();
+	virtual IO_RESULT LoadSector(unsigned long lba, char** ppData, bool bWritable, bool bPreLoad); // frees an idle file sector when the cache is full
 	
 //	virtual IO_RESULT LoadSector(unsigned long lba, char** ppData, bool bWritable); // map relative lba to absolute lba
 
@@ -432,9 +645,42 @@ public:
 	IO_RESULT UnloadFatSector(char* pData/*, bool bFlush=true*/)
 		{ return UnloadSector(pData/*, bFlush*/); }
 
-	IO_RESULT LookupEntry(const char* szDosName, DirEntryAddress* pMatchingEntry, DirEntry* pEntry=NULL, DirEntryAddress* pEmptyEntry=NULL);
+	FileState_FAT* GetFileState(IO_HANDLE hFile) const; // NULL if the handle is invalid (or stale)
+	IO_HANDLE GetFileHandle(const FileState_FAT* pFS) const;
+	SharedFileState_FAT* FindOpenEntry(const FatAddress& csa, unsigned iTableIndex) const; // NULL if not open
+	SharedFileState_FAT*& GetOpenBucket(const DirEntryAddress& dea) const; // hash chain for an open file
+	void ReplaceOpenEntry(SharedFileState_FAT* pOld, SharedFileState_FAT* pNew); // remove if pNew is NULL
+	bool IsOpenEntry(const FatAddress& csa, unsigned iTableIndex) const
+		{ return FindOpenEntry(csa, iTableIndex)!=NULL; }
+	IO_RESULT SyncFileAddress(FileState_FAT* pFS);
+	static bool ReleaseIdleSector();
+	IO_RESULT SeekFile(FileState_FAT* pFS, seekMode mode, long pos);
+	IO_RESULT ReleaseMapping(FileState_FAT* pFS);
+	IO_RESULT CommitReservation(FileState_FAT* pFS, unsigned int nUsed);
+	IO_RESULT GrowFile(FileState_FAT* pFS, unsigned long newSize);
+	IO_RESULT TrimFile(FileState_FAT* pFS);
+	IO_RESULT FlushFile(FileState_FAT* pFS, bool bForceUpdate);
+	IO_RESULT UpdateEntry(SharedFileState_FAT* pShared, bool bForce);
+	IO_RESULT TransferFile(FileState_FAT* pFS, const DeviceIoVector* pVec, unsigned long& n, bool bWrite, unsigned long lOldSize);
+	IO_RESULT TransferDirect(FileState_FAT* pFS, const FatAddress& fa, char* pBuf, unsigned int& n, bool bWrite);
+	IO_RESULT GetSectorRun(const FatAddress& fa, unsigned long nMax, unsigned long& nRun);
+	IO_RESULT LocateFilePos(const FileState_FAT* pFS, unsigned long pos, FatAddress& fa);
+	IO_RESULT TransferAt(FileState_FAT* pFS, unsigned long pos, char* pBuf, unsigned int& n, bool bWrite, unsigned long lOldSize);
+	IO_RESULT LookupEntry(const char* szDosName, DirEntryAddress* pMatchingEntry, DirEntry* pEntry=NULL, DirEntryAddress* pEmptyEntry=NULL, unsigned long* pDirCluster=NULL, unsigned long lStartDir=NULL_CLUSTER);
+	IO_RESULT ScanDirectory(unsigned long lDirCluster, const char* szDosName, int len, DirEntryAddress* pMatchingEntry, DirEntry* pEntry=NULL, DirEntryAddress* pEmptyEntry=NULL);
+	IO_RESULT ResolveDirectory(const char* szDirPath, unsigned long& lDirCluster, unsigned long lStartDir=NULL_CLUSTER);
+	IO_RESULT IsInDirectory(unsigned long lDir, unsigned long lAncestor, bool& bInside);
+	IO_RESULT NextDirSector(FatAddress& csa);
+#if DIR_SCAN_SECTORS>1
+	IO_RESULT ReadDirSectors(const FatAddress& csa, char* pBuf, unsigned& nSectors);
+#endif
+	FatAddress GetDirStart(unsigned long lDirCluster) const;
 	IO_RESULT Update(DirEntryAddress& dea, unsigned long lStartCluster, unsigned long lFileSize);
+	IO_RESULT MakeDirectory(DirEntryAddress& dea, DirEntryX& de, unsigned long lParentDir, unsigned long& lNewCluster);
+	IO_RESULT RemoveEntry(const DirEntryAddress& dea, unsigned long lStartCluster);
+	IO_RESULT ReleaseChains(unsigned long* pChains, int& nChains);
 	IO_RESULT Update(DirEntryAddress& dea, DirEntryX* dir);
+	IO_RESULT UpdateLfnEntries(GenericFatSector& sector, const DirEntryAddress& dea, const DirEntry* pAlias);
 
 	// simple (but handy) helpers:
 	unsigned long  GetSectorIndex(const FatAddress& csa) const { ASSERT(csa.m_lCluster!=NULL_CLUSTER); return csa.m_lCluster!=FIXED_ROOT ? (m_lFirstDataSector + ((csa.m_lCluster-FIRST_VALID_CLUSTER)<<m_iSectorToClusterShift) + csa.m_iSectorOffset) : csa.m_iSectorOffset; }
@@ -487,6 +733,13 @@ protected:
 	unsigned char  m_cPartitionType;		// PT_XXXX; copied from partition table
 	unsigned long  m_nSectorsPerFat;		// 512 bytes per sector, always 2 byte entries (values = 12 or 16 bit, use 16 !!), first and second entry = copy of byte medium_descr + filling; 16bits:0xF8 0xFF 0xFF 0xFF, 12bits: 0xF0 0xFF 0xFF
 	unsigned long  m_lRootDirCluster;		// cluster number for root dir for FAT32, or FICED_ROOT for FAT12/16
+
+	FileState_FAT* m_pFiles;				// table with states of (open) files, see SetFileTable()
+	unsigned int   m_nFiles;				// nr of entries in m_pFiles
+	FileState_FAT* m_pFreeFiles;			// first unused entry of m_pFiles, or NULL
+	FileState_FAT  m_defaultFiles[MAX_OPEN_FAT_FILES];
+	DeviceIoDriver_FAT* m_pNextFat;			// next FAT driver (see m_pFirstFat)
+	static DeviceIoDriver_FAT* m_pFirstFat;	// all FAT drivers share the cache
 };
 
 
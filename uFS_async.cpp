@@ -0,0 +1,210 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+#include "stdafx.h"
+#include "uFS_async.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoExecutor
+
+IO_RESULT DeviceIoExecutor::Submit(DeviceIoFileRequest* pRequest)
+{
+	if (pRequest->pFile==NULL || (pRequest->op==fileOpen && pRequest->szPath==NULL))
+		return IO_ERROR;
+
+	// the requests of a file must be carried out in order; one at a time
+	if (pRequest->pFile->m_pRequest!=NULL)
+		return IO_FILE_OPEN;
+	pRequest->pFile->m_pRequest = pRequest;
+
+	pRequest->nDone = 0;
+	pRequest->res = IO_PENDING;
+	pRequest->pDevice = NULL;
+	Queue(pRequest);
+	m_nPending++;
+	return IO_PENDING;
+}
+
+int DeviceIoExecutor::Poll()
+{
+	if (m_pInFlight!=NULL)
+	{
+		const int nPending = m_nPending;
+		CollectReads();
+		if (m_pHead==NULL && m_pInFlight!=NULL && m_nPending==nPending)
+		{
+			// nothing to run until a read completes; sleep in the device instead of spinning
+			m_pInFlight->pDevice->PollWait();
+			CollectReads();
+		}
+	}
+
+	DeviceIoFileRequest* p = m_pHead;
+	if (p==NULL)
+		return m_nPending;
+	m_pHead = p->pNext;
+	if (m_pHead==NULL)
+		m_pTail = NULL;
+	p->pNext = NULL;
+
+	const IO_RESULT res = p->res; // IO_PENDING
+	if (RunSlice(p))
+	{
+		Complete(p);
+		return m_nPending;
+	}
+	p->res = res;
+	if (p->pDevice!=NULL)
+	{
+		// wait for the device, see CollectReads()
+		p->pNext = m_pInFlight;
+		m_pInFlight = p;
+	}
+	else
+		Queue(p); // more to do; let the other streams go first
+	return m_nPending;
+}
+
+void DeviceIoExecutor::CollectReads()
+{
+	// move the requests of which the asynchronous read is done back to the queue
+	DeviceIoFileRequest** pp = &m_pInFlight;
+	while (*pp!=NULL)
+	{
+		DeviceIoFileRequest* p = *pp;
+		if (p->io.res==IO_PENDING)
+			p->pDevice->Poll();
+		if (p->io.res==IO_PENDING)
+		{
+			pp = &p->pNext;
+			continue;
+		}
+		*pp = p->pNext;
+		p->pNext = NULL;
+		p->pDevice = NULL;
+		if (p->io.res>=IO_OK)
+			p->nDone += p->io.n*SECTOR_SIZE;
+		if (p->io.res<IO_OK || p->nDone==p->n)
+		{
+			p->res = p->io.res<IO_OK ? p->io.res : IO_OK;
+			Complete(p);
+		}
+		else
+			Queue(p);
+	}
+}
+
+void DeviceIoExecutor::Queue(DeviceIoFileRequest* p)
+{
+	p->pNext = NULL;
+	if (m_pTail!=NULL)
+		m_pTail->pNext = p;
+	else
+		m_pHead = p;
+	m_pTail = p;
+}
+
+void DeviceIoExecutor::Complete(DeviceIoFileRequest* p)
+{
+	m_nPending--;
+	p->pFile->m_pRequest = NULL;
+	if (p->pfnDone!=NULL)
+		p->pfnDone(p); // may submit new requests
+}
+
+bool DeviceIoExecutor::RunSlice(DeviceIoFileRequest* p)
+{
+	DeviceIoFile& f = *p->pFile;
+	switch (p->op)
+	{
+	case fileOpen:
+		p->res = m_manager.OpenFile(p->szPath, f, p->lFlags);
+		return true;
+
+	case fileRead:
+	case fileWrite:
+		{
+			unsigned int n = p->n-p->nDone;
+			if (n>m_nSlice)
+				n = m_nSlice;
+			if (p->op==fileRead && f.ReadAsync(p->pBuf+p->nDone, n, p->io, p->pDevice)==IO_PENDING)
+				return false; // completed by CollectReads()
+			const unsigned int nRequested = n;
+			p->res = p->op==fileRead ? f.Read(p->pBuf+p->nDone, n) : f.Write(p->pBuf+p->nDone, n);
+			p->nDone += n;
+			// done at EOF, on errors, or when all bytes are transferred
+			return p->res!=IO_OK || n<nRequested || p->nDone==p->n;
+		}
+
+	case fileSeek:
+		p->res = f.Seek(p->mode, p->pos);
+		return true;
+
+	case fileFlush:
+		p->res = f.Flush();
+		return true;
+
+	case fileClose:
+		p->res = f.Close();
+		return true;
+	}
+	p->res = IO_ERROR;
+	return true;
+}
+
+IO_RESULT DeviceIoExecutor::Submit(DeviceIoFileRequest& r, fileRequestOp op, DeviceIoFile& f, DEVICE_IO_CALLBACK pfnDone, void* pContext)
+{
+	r.op = op;
+	r.pFile = &f;
+	r.pfnDone = pfnDone;
+	r.pContext = pContext;
+	return Submit(&r);
+}
+
+IO_RESULT DeviceIoExecutor::Open(DeviceIoFileRequest& r, DeviceIoFile& f, const char* szPath, unsigned long lFlags, DEVICE_IO_CALLBACK pfnDone, void* pContext)
+{
+	r.szPath = szPath;
+	r.lFlags = lFlags;
+	return Submit(r, fileOpen, f, pfnDone, pContext);
+}
+
+IO_RESULT DeviceIoExecutor::Read(DeviceIoFileRequest& r, DeviceIoFile& f, char* pBuf, unsigned int n, DEVICE_IO_CALLBACK pfnDone, void* pContext)
+{
+	r.pBuf = pBuf;
+	r.n = n;
+	return Submit(r, fileRead, f, pfnDone, pContext);
+}
+
+IO_RESULT DeviceIoExecutor::Write(DeviceIoFileRequest& r, DeviceIoFile& f, const char* pBuf, unsigned int n, DEVICE_IO_CALLBACK pfnDone, void* pContext)
+{
+	r.pBuf = (char*)pBuf;
+	r.n = n;
+	return Submit(r, fileWrite, f, pfnDone, pContext);
+}
+
+IO_RESULT DeviceIoExecutor::Seek(DeviceIoFileRequest& r, DeviceIoFile& f, seekMode mode, long pos, DEVICE_IO_CALLBACK pfnDone, void* pContext)
+{
+	r.mode = mode;
+	r.pos = pos;
+	return Submit(r, fileSeek, f, pfnDone, pContext);
+}
+
+IO_RESULT DeviceIoExecutor::Flush(DeviceIoFileRequest& r, DeviceIoFile& f, DEVICE_IO_CALLBACK pfnDone, void* pContext)
+{
+	return Submit(r, fileFlush, f, pfnDone, pContext);
+}
+
+IO_RESULT DeviceIoExecutor::Close(DeviceIoFileRequest& r, DeviceIoFile& f, DEVICE_IO_CALLBACK pfnDone, void* pContext)
+{
+	return Submit(r, fileClose, f, pfnDone, pContext);
+}
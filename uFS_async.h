@@ -0,0 +1,136 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+#ifndef __uFS_async_h
+#define __uFS_async_h
+
+#include "uFS.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoFileRequest
+//
+// A file operation that is carried out by a DeviceIoExecutor. The request 
+// must remain valid until it is completed. On completion the executor sets
+// 'res' and then calls pfnDone (if not NULL), which may submit the next 
+// request of the same stream. The request holds the BlockDeviceRequest that
+// reads sectors asynchronously, so it needs no other memory.
+
+enum fileRequestOp
+{
+	fileOpen = 0,	// szPath, lFlags
+	fileRead,		// pBuf, n (nDone holds the nr of bytes read)
+	fileWrite,		// pBuf, n (nDone holds the nr of bytes written)
+	fileSeek,		// mode, pos
+	fileFlush,
+	fileClose
+};
+
+struct DeviceIoFileRequest;
+typedef void (*DEVICE_IO_CALLBACK)(DeviceIoFileRequest* pRequest);
+
+struct DeviceIoFileRequest
+{
+	DeviceIoFileRequest()
+	{
+		op = fileFlush;
+		pFile = NULL;
+		szPath = NULL;
+		lFlags = 0;
+		pBuf = NULL;
+		n = nDone = 0;
+		mode = seekBegin;
+		pos = 0;
+		pfnDone = NULL;
+		pContext = NULL;
+		res = IO_OK;
+		pNext = NULL;
+		pDevice = NULL;
+	}
+
+	fileRequestOp op;
+	DeviceIoFile* pFile;			// the file (to be opened)
+	const char* szPath;
+	unsigned long lFlags;
+	char* pBuf;						// only read from by fileWrite
+	unsigned int n;
+	unsigned int nDone;
+	seekMode mode;
+	long pos;
+	DEVICE_IO_CALLBACK pfnDone;		// completion callback, or NULL
+	void* pContext;					// free for use by the submitter
+	volatile IO_RESULT res;			// IO_PENDING until the request is completed
+	DeviceIoFileRequest* pNext;		// used by the executor while the request is pending
+	BlockDeviceRequest io;			// used by the executor for asynchronous reads
+	AsyncBlockDeviceInterface* pDevice;	// device that carries out 'io', NULL if none
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoExecutor
+//
+// Runs file requests of many streams from a single thread. Each Poll() 
+// carries out one slice of the request at the head of the queue: reads and
+// writes transfer at most nSlice bytes per slice and then go to the back 
+// of the queue, so that a long transfer doesn't hold up the other streams.
+// A file can have only one pending request at a time; submit the next one
+// from the completion callback of the previous one.
+// A read slice of whole sectors that lie on an AsyncBlockDeviceInterface 
+// is submitted to that device (see DeviceIoFile::ReadAsync()); Poll() 
+// picks up its completion later, so several reads can be in progress while
+// other slices run. Other slices are synchronous and wait for the device.
+// When all pending requests wait for a read, Poll() blocks in PollWait() 
+// of a device until one of them completes, so Run() doesn't spin.
+
+class DeviceIoExecutor
+{
+public:
+	DeviceIoExecutor(DeviceIoManager& manager, unsigned int nSlice=8*SECTOR_SIZE)
+		: m_manager(manager)
+	{
+		m_nSlice = nSlice>0 ? nSlice : SECTOR_SIZE;
+		m_pHead = m_pTail = NULL;
+		m_pInFlight = NULL;
+		m_nPending = 0;
+	}
+
+	IO_RESULT Submit(DeviceIoFileRequest* pRequest); // IO_PENDING, or IO_FILE_OPEN if the file has a pending request
+	int Poll();		// nr of requests that are still pending
+	void Run()		// until all requests are completed
+	{
+		while (Poll()>0)
+			;
+	}
+
+	// helpers that fill in a request and submit it
+	IO_RESULT Open(DeviceIoFileRequest& r, DeviceIoFile& f, const char* szPath, unsigned long lFlags, DEVICE_IO_CALLBACK pfnDone=NULL, void* pContext=NULL);
+	IO_RESULT Read(DeviceIoFileRequest& r, DeviceIoFile& f, char* pBuf, unsigned int n, DEVICE_IO_CALLBACK pfnDone=NULL, void* pContext=NULL);
+	IO_RESULT Write(DeviceIoFileRequest& r, DeviceIoFile& f, const char* pBuf, unsigned int n, DEVICE_IO_CALLBACK pfnDone=NULL, void* pContext=NULL);
+	IO_RESULT Seek(DeviceIoFileRequest& r, DeviceIoFile& f, seekMode mode, long pos, DEVICE_IO_CALLBACK pfnDone=NULL, void* pContext=NULL);
+	IO_RESULT Flush(DeviceIoFileRequest& r, DeviceIoFile& f, DEVICE_IO_CALLBACK pfnDone=NULL, void* pContext=NULL);
+	IO_RESULT Close(DeviceIoFileRequest& r, DeviceIoFile& f, DEVICE_IO_CALLBACK pfnDone=NULL, void* pContext=NULL);
+
+protected:
+	IO_RESULT Submit(DeviceIoFileRequest& r, fileRequestOp op, DeviceIoFile& f, DEVICE_IO_CALLBACK pfnDone, void* pContext);
+	bool RunSlice(DeviceIoFileRequest* p); // true if the request is completed
+	void Queue(DeviceIoFileRequest* p);
+	void Complete(DeviceIoFileRequest* p);
+	void CollectReads();
+
+	DeviceIoManager& m_manager;
+	unsigned int m_nSlice;
+	DeviceIoFileRequest* m_pHead;	// request of the next slice
+	DeviceIoFileRequest* m_pTail;
+	DeviceIoFileRequest* m_pInFlight;	// requests that wait for an asynchronous read
+	int m_nPending;
+};
+
+#endif // __uFS_async_h
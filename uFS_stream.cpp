@@ -0,0 +1,205 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+#include "stdafx.h"
+#include "uFS_stream.h"
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoStreamWriter
+
+DeviceIoStreamWriter::DeviceIoStreamWriter()
+{
+	m_pHalf[0] = m_pHalf[1] = NULL;
+	m_nHalfSize = 0;
+	m_nFill[0] = m_nFill[1] = 0;
+	m_nSize[0] = m_nSize[1] = 0;
+	m_bFull[0] = m_bFull[1] = false;
+	m_iAppend = m_iWrite = 0;
+	m_lWritten = m_lAllocated = m_lUpdated = 0;
+	m_lPreallocation = 0;
+	m_lUpdateInterval = 0;
+	m_lLost = 0;
+}
+
+IO_RESULT DeviceIoStreamWriter::Open(DeviceIoManager& manager, const char* szFilePath, char* pBuf, unsigned int nBufSize, unsigned long lFlags)
+{
+	IO_RESULT res = Close();
+	if (res<IO_OK)
+		return res;
+
+	const unsigned int nHalfSize = (nBufSize/2) & ~(SECTOR_SIZE-1);
+	if (pBuf==NULL || nHalfSize==0)
+		return IO_ERROR;
+
+	res = manager.OpenFile(szFilePath, m_file, lFlags|IO_FILE_WRITABLE|IO_FILE_DIRECT);
+	if (res>=IO_OK)
+		res = m_file.Seek(seekEnd, 0);
+	if (res>=IO_OK)
+		res = m_file.Tell(m_lWritten);
+	if (res<IO_OK)
+	{
+		m_file.Close();
+		return res;
+	}
+
+	m_pHalf[0] = pBuf;
+	m_pHalf[1] = pBuf + nHalfSize;
+	m_nHalfSize = nHalfSize;
+	m_nFill[0] = m_nFill[1] = 0;
+	m_nSize[0] = m_nSize[1] = nHalfSize;
+	if (m_lWritten%SECTOR_SIZE!=0)
+	{
+		// the first half only fills up the last sector of the file, 
+		// so that the next ones can be written directly
+		m_nSize[0] = SECTOR_SIZE - m_lWritten%SECTOR_SIZE;
+	}
+	m_bFull[0] = m_bFull[1] = false;
+	m_iAppend = m_iWrite = 0;
+	m_lAllocated = m_lUpdated = m_lWritten;
+	m_lLost = 0;
+	return res;
+}
+
+IO_RESULT DeviceIoStreamWriter::Close()
+{
+	if (!IsOpen())
+		return IO_OK;
+
+	// write the full halves, and what is left in the next one
+	IO_RESULT res = Service();
+	const int i = m_iWrite;
+	if (res>=IO_OK && m_nFill[i]>0)
+	{
+		unsigned int n = m_nFill[i];
+		res = m_file.Write(m_pHalf[i], n);
+		if (res>=IO_OK)
+			m_lWritten += n;
+	}
+	m_nFill[0] = m_nFill[1] = 0;
+	m_bFull[0] = m_bFull[1] = false;
+
+	// closing releases the preallocated space that wasn't used
+	const IO_RESULT r = m_file.Close();
+	return res>=IO_OK ? r : res;
+}
+
+IO_RESULT DeviceIoStreamWriter::Append(const char* p, unsigned int n)
+{
+	// Copy the data into the buffer; this never accesses the file.
+	while (n>0)
+	{
+		const int i = m_iAppend;
+		if (m_bFull[i])
+		{
+			// both halves are waiting for Service()
+			m_lLost += n;
+			return IO_BUFFER_FULL;
+		}
+		unsigned int nCopy = m_nSize[i] - m_nFill[i];
+		if (nCopy>n)
+			nCopy = n;
+		memcpy(m_pHalf[i]+m_nFill[i], p, nCopy);
+		m_nFill[i] += nCopy;
+		p += nCopy;
+		n -= nCopy;
+		if (m_nFill[i]==m_nSize[i])
+		{
+			m_bFull[i] = true; // hand it over to Service()
+			m_iAppend = i^1;
+		}
+	}
+	return IO_OK;
+}
+
+IO_RESULT DeviceIoStreamWriter::Service()
+{
+	// Write the full halves, in the order in which they were filled.
+	IO_RESULT res = IO_OK;
+	while (res>=IO_OK && m_bFull[m_iWrite])
+	{
+		const int i = m_iWrite;
+		if (m_lPreallocation>0 && m_lWritten+m_nSize[i]>m_lAllocated)
+		{
+			const unsigned long n = m_lPreallocation>m_nHalfSize ? m_lPreallocation : m_nHalfSize;
+			res = m_file.Preallocate(n);
+			if (res==IO_DISK_FULL)
+			{
+				// the remaining space may still hold the data; stop preallocating
+				m_file.ClearErrorStatus();
+				m_lPreallocation = 0;
+				res = IO_OK;
+			}
+			else if (res>=IO_OK)
+				m_lAllocated = m_lWritten + n;
+			else
+				break;
+		}
+		unsigned int n = m_nSize[i];
+		res = m_file.Write(m_pHalf[i], n);
+		if (res<IO_OK)
+			break;
+		m_lWritten += n;
+		m_iWrite = i^1;
+		m_nFill[i] = 0;
+		m_nSize[i] = m_nHalfSize; // the file is sector aligned from now on
+		m_bFull[i] = false; // hand the half back to Append()
+
+		if (m_lUpdateInterval>0 && m_lWritten-m_lUpdated>=m_lUpdateInterval)
+		{
+			res = m_file.Flush();
+			m_lUpdated = m_lWritten;
+		}
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoStreamWriter::Write(const char* p, unsigned int n)
+{
+	IO_RESULT res = IO_OK;
+	while (n>0 && res>=IO_OK)
+	{
+		// don't append more than fits, so that nothing is dropped
+		const int i = m_iAppend;
+		unsigned int nPart = m_nSize[i] - m_nFill[i];
+		if (nPart>n)
+			nPart = n;
+		res = Append(p, nPart);
+		if (res>=IO_OK)
+			res = Service();
+		p += nPart;
+		n -= nPart;
+	}
+	return res;
+}
+
+IO_RESULT DeviceIoStreamWriter::Flush()
+{
+	IO_RESULT res = Service();
+
+	// The partly filled half is written where it belongs, but it remains in
+	// the buffer. The next Service() writes it again as a whole, which keeps
+	// the halves aligned to the sectors of the file.
+	const int i = m_iWrite;
+	if (res>=IO_OK && m_nFill[i]>0)
+	{
+		unsigned int n = m_nFill[i];
+		res = m_file.WriteAt(m_lWritten, m_pHalf[i], n);
+	}
+	if (res>=IO_OK)
+	{
+		res = m_file.Flush();
+		m_lUpdated = m_lWritten;
+	}
+	return res;
+}
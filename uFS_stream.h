@@ -0,0 +1,98 @@
+/****************************************************************************/
+/*                                                                          */
+/*            (C) Copyright 2001 Vrije Universiteit Amsterdam TD\FPP        */
+/*                           All Rights Reserved.                           */
+/*                                                                          */
+/*                              Paul FC Groot                               */
+/*                       Vrije Universiteit Amsterdam                       */
+/*          Technische Dienst Faculteit Psychologie en Pedagogiek           */
+/*                Van der Boechorststraat 1, 1081 BT AMSTERDAM              */
+/*               pfc.groot@psy.vu.nl  or //www.psy.vu.nl/~paul              */
+/*                                                                          */
+/****************************************************************************/
+
+#ifndef __uFS_stream_h
+#define __uFS_stream_h
+
+#include "uFS.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceIoStreamWriter
+//
+// Append-only file writer for recordings that consist of many small samples.
+// The data is collected in a buffer that is supplied by the caller, split in 
+// two halves: Append() fills one half while the other one is written to the
+// file by Service(). Append() never accesses the file, so samples can be 
+// appended by an interrupt handler while the main loop calls Service().
+// Write() does both, for simple synchronous use.
+// Full halves are written straight from the buffer as whole sectors 
+// (IO_FILE_DIRECT), so the half size should preferably be a multiple of the
+// cluster size. When appending to a file that doesn't end on a sector 
+// boundary, the first half is cut short so that it ends on one, and the 
+// halves that follow are aligned again. Space is preallocated in chunks of SetPreallocation() bytes,
+// to keep the search for free clusters out of most writes. The directory 
+// entry is updated every SetUpdateInterval() bytes, or only by Flush() and 
+// Close() if that is zero. After a power failure the file ends at the size 
+// that was last recorded in the directory entry.
+
+class DeviceIoStreamWriter
+{
+public:
+	DeviceIoStreamWriter();
+	virtual ~DeviceIoStreamWriter()
+	{
+		Close();
+	}
+
+	// The buffer must remain valid until Close(); its halves are rounded down
+	// to whole sectors. Data is appended to the end of an existing file.
+	IO_RESULT Open(DeviceIoManager& manager, const char* szFilePath, char* pBuf, unsigned int nBufSize, unsigned long lFlags=IO_FILE_CREATE|IO_FILE_RESET);
+	IO_RESULT Close();
+	bool IsOpen() const
+	{
+		return m_file.IsOpen();
+	}
+
+	void SetPreallocation(unsigned long nBytes)
+	{
+		m_lPreallocation = nBytes;
+	}
+
+	void SetUpdateInterval(unsigned long nBytes)
+	{
+		m_lUpdateInterval = nBytes;
+	}
+
+	IO_RESULT Append(const char* p, unsigned int n); // IO_BUFFER_FULL if (part of) the data was dropped
+	IO_RESULT Service();	// write the halves that are full
+	IO_RESULT Write(const char* p, unsigned int n);
+	IO_RESULT Flush();		// write all data and update the directory entry (don't Append() meanwhile)
+
+	unsigned long GetLength() const
+	{
+		return m_lWritten + m_nFill[0] + m_nFill[1];
+	}
+
+	unsigned long GetNrOfLostBytes() const
+	{
+		return m_lLost;
+	}
+
+protected:
+	DeviceIoFile m_file;
+	char* m_pHalf[2];
+	unsigned int m_nHalfSize;
+	volatile unsigned int m_nFill[2];	// nr of bytes in each half
+	volatile unsigned int m_nSize[2];	// nr of bytes at which a half is full (m_nHalfSize, or less for the first one)
+	volatile bool m_bFull[2];			// half is waiting for Service()
+	volatile int m_iAppend;				// half that is filled by Append()
+	int m_iWrite;						// next half to be written by Service()
+	unsigned long m_lWritten;			// file position, i.e. end of the written halves
+	unsigned long m_lAllocated;			// file length for which space is preallocated
+	unsigned long m_lUpdated;			// m_lWritten at the last directory entry update
+	unsigned long m_lPreallocation;
+	unsigned long m_lUpdateInterval;
+	unsigned long m_lLost;				// nr of bytes dropped by Append()
+};
+
+#endif // __uFS_stream_h
@@ -8,6 +8,9 @@
 #include "fatdefs.h"	// standard C FAT definitions
 #include "AmsDeviceFile.h"
 #include "VirtualDisk.h"
+#include "RamDisk.h"
+#include "uFS_FAT.h"
+#include "uFS_stream.h"
 #include <SHLOBJ.H>
 #include "RingBufferX.h"	// standard C FAT definitions
 #include "SampleProcessor.h"	// standard C FAT definitions
@@ -208,6 +211,9 @@ public:
 	virtual IO_RESULT UnmountHW(/*long hSubDevice=-1*/);
 	virtual IO_RESULT ReadSector(unsigned long lba, char* pData);
 	virtual IO_RESULT WriteSector(unsigned long lba, const char* pData);
+	virtual IO_RESULT ReadSectors(unsigned long lba, unsigned int n, char* pData);
+	virtual IO_RESULT WriteSectors(unsigned long lba, unsigned int n, const char* pData);
+	virtual IO_RESULT FlushHW() { return m_vd.Flush() ? IO_OK : IO_ERROR; }
 
 	virtual const char* GetDriverID(/*long hSubDevice=-1*/);
 	int GetSectorSize(/*long hSubDevice=-1*/) { return 512; }
@@ -261,6 +267,16 @@ IO_RESULT BlockDeviceInterface_VirtualDisk::WriteSector(unsigned long lba, const
 	return m_vd.WriteSector(lStartAt+lba, pData) ? IO_OK : IO_ERROR;
 }
 
+IO_RESULT BlockDeviceInterface_VirtualDisk::ReadSectors(unsigned long lba, unsigned int n, char* pData)
+{
+	return m_vd.ReadSectors(lStartAt+lba, n, pData) ? IO_OK : IO_ERROR;
+}
+
+IO_RESULT BlockDeviceInterface_VirtualDisk::WriteSectors(unsigned long lba, unsigned int n, const char* pData)
+{
+	return m_vd.WriteSectors(lStartAt+lba, n, pData) ? IO_OK : IO_ERROR;
+}
+
 const char* BlockDeviceInterface_VirtualDisk::GetDriverID(/*long hSubDevice*/)
 {
 #ifdef NON_MBR_TEST
@@ -447,6 +463,475 @@ inline unsigned long Chop12(long v)
 inline unsigned long Chop12(double v)
 { return Chop12((long)v); }
 
+///////////////////////////////////////////////////////////////////////////////
+// RAM disk tests
+//
+// Behaviour checks that run on a freshly formatted BlockDeviceInterface_RamDisk,
+// so they don't need any hardware. Each test works in its own directory and
+// removes it when done; RamDiskTests() checks that all space is released again.
+
+#define RAMDISK_VOLUME		"\\ATA\\0"
+#define RAMDISK_SECTORS		40000	// 20MB
+#define RAMDISK_START		64		// first sector of the (FAT16) partition
+#define RAMDISK_SPC			4		// sectors per cluster
+#define RAMDISK_FILES		32		// entries in the file table of the FAT driver
+#define RAMDISK_STALE		2048	// sectors at the start of the data area that hold stale entries
+
+#define RAM_CHECK(expr) \
+	if (!(expr)) \
+	{ \
+		cout << "RAM disk test failed at line " << __LINE__ << ": " #expr << endl; \
+		return false; \
+	}
+
+static FileState_FAT _ramFileTable[RAMDISK_FILES];
+static DeviceIoDriver_FAT* _pRamDriver = NULL;
+static unsigned short _nRamSectorsPerFat = 0;
+static char _ramData[80000];
+static char _ramBack[80000];
+
+class RamDiskDriverFactory : public DeviceIoDriverFactory_Heap
+{
+public:
+	virtual DeviceIoDriver* AllocateDriver(const char* szDriverID)
+	{
+		// give the FAT driver a larger file table than the built-in one
+		DeviceIoDriver* pDriver = DeviceIoDriverFactory_Heap::AllocateDriver(szDriverID);
+		if (pDriver!=NULL && strncmp(szDriverID, "FAT", 3)==0)
+		{
+			_pRamDriver = (DeviceIoDriver_FAT*)pDriver;
+			_pRamDriver->SetFileTable(_ramFileTable, RAMDISK_FILES);
+		}
+		return pDriver;
+	}
+};
+
+static IO_RESULT FormatRamDisk(BlockDeviceInterface_RamDisk& disk)
+{
+	// an MBR with a single FAT16 partition; the sectors that aren't written read as zeros
+	char buf[SECTOR_SIZE];
+	const unsigned long nSectors = disk.GetNrOfSectors() - RAMDISK_START;
+	const unsigned short nSectorsPerFat = (unsigned short)((nSectors/RAMDISK_SPC*2 + SECTOR_SIZE-1)/SECTOR_SIZE);
+	_nRamSectorsPerFat = nSectorsPerFat;
+	disk.Clear();
+
+	memset(buf, 0, sizeof(buf));
+	MBR* pMBR = (MBR*)buf;
+	pMBR->partitionTable[0].cBootIndicator = BI_NONBOOTABLE;
+	pMBR->partitionTable[0].cPartitionType = PT_FAT16s;
+	pMBR->partitionTable[0].lbaStart = RAMDISK_START;
+	pMBR->partitionTable[0].nSectors = nSectors;
+	pMBR->iSignature = SIGNATURE_MBR;
+	IO_RESULT res = disk.WriteSector(0, buf);
+	if (res<IO_OK)
+		return res;
+
+	memset(buf, 0, sizeof(buf));
+	BootSector_FAT16* pBoot = (BootSector_FAT16*)buf;
+	pBoot->jumpinstr[0] = 0xEB;
+	pBoot->jumpinstr[1] = 0x3C;
+	pBoot->jumpinstr[2] = 0x90;
+	memcpy(pBoot->sIdentification, "uFS 1.0 ", 8);
+	pBoot->nBytesPerSector = SECTOR_SIZE;
+	pBoot->nSectorsPerCluster = RAMDISK_SPC;
+	pBoot->nReservedSectors = 1;
+	pBoot->nFatCopies = 2;
+	pBoot->nRootDirEntries = 512;
+	pBoot->nSectors = (unsigned short)nSectors;
+	pBoot->cMediaDescriptor = 0xF8;
+	pBoot->nSectorsPerFat = nSectorsPerFat;
+	pBoot->nHiddenSectors = RAMDISK_START;
+	pBoot->cExtSignature = SIGNATURE_EBR;
+	memcpy(pBoot->sLabel, "RAMDISK    ", 11);
+	memcpy(pBoot->sFileSystemID, "FAT16   ", 8);
+	pBoot->iSignature = SIGNATURE_FAT16;
+	res = disk.WriteSector(RAMDISK_START, buf);
+	if (res<IO_OK)
+		return res;
+
+	// both FAT copies start with the media descriptor
+	memset(buf, 0, sizeof(buf));
+	((unsigned short*)buf)[0] = 0xFFF8;
+	((unsigned short*)buf)[1] = 0xFFFF;
+	res = disk.WriteSector(RAMDISK_START+1, buf);
+	if (res>=IO_OK)
+		res = disk.WriteSector(RAMDISK_START+1+nSectorsPerFat, buf);
+
+	// like on a used disk, the data area is not cleared: a directory cluster
+	// that isn't initialized shows stale entries
+	DirEntry* pEntry = (DirEntry*)buf;
+	memset(buf, 0, sizeof(buf));
+	for (unsigned int i=0; i<SECTOR_SIZE/sizeof(DirEntry); i++)
+	{
+		memcpy(pEntry[i].sName, "GHOST   ", 8);
+		memcpy(pEntry[i].sExt, "DAT", 3);
+		pEntry[i].cAttributes = FAT_ATTR_ARCHIVE;
+	}
+	const unsigned long lData = RAMDISK_START + 1 + 2*nSectorsPerFat + 512*sizeof(DirEntry)/SECTOR_SIZE;
+	for (unsigned long lba=lData; res>=IO_OK && lba<lData+RAMDISK_STALE; lba++)
+		res = disk.WriteSector(lba, buf);
+	return res;
+}
+
+static bool CountDirectoryEntries(BlockDeviceInterface_RamDisk& disk, unsigned long lCluster, int& nEntries)
+{
+	// walk the clusters of a directory straight on the disk and count the entries
+	// in use; all entries after the first never used one must be clear
+	const unsigned long lFat = RAMDISK_START + 1;
+	const unsigned long lData = lFat + 2*_nRamSectorsPerFat + 512*sizeof(DirEntry)/SECTOR_SIZE;
+	char buf[SECTOR_SIZE];
+	bool bEnd = false;
+	nEntries = 0;
+	while (lCluster>=2 && lCluster<0xFFF8)
+	{
+		for (unsigned long lba=lData+(lCluster-2)*RAMDISK_SPC; lba<lData+(lCluster-1)*RAMDISK_SPC; lba++)
+		{
+			RAM_CHECK(disk.ReadSector(lba, buf)>=IO_OK);
+			const DirEntry* pEntry = (const DirEntry*)buf;
+			for (unsigned int i=0; i<SECTOR_SIZE/sizeof(DirEntry); i++)
+			{
+				if (pEntry[i].sName[0]==0)
+					bEnd = true;
+				else
+				{
+					RAM_CHECK(!bEnd);
+					if ((unsigned char)pEntry[i].sName[0]!=0xE5)
+						nEntries++;
+				}
+			}
+		}
+		RAM_CHECK(disk.ReadSector(lFat + lCluster*2/SECTOR_SIZE, buf)>=IO_OK);
+		lCluster = ((unsigned short*)buf)[lCluster%(SECTOR_SIZE/2)];
+	}
+	return true;
+}
+
+static bool TestCreateFiles(DeviceIoManager& m, BlockDeviceInterface_RamDisk& disk)
+{
+	// CreateFiles(): a batch that fills several new directory clusters
+	const int nFiles = 150;
+	static char szNames[nFiles+1][16];
+	const char* pszNames[nFiles+1];
+	IO_RESULT results[nFiles+1];
+	DeviceIoFile f;
+	char szPath[64];
+	int i;
+
+	RAM_CHECK(m.CreateDirectory(RAMDISK_VOLUME"\\CREATE")>=IO_OK);
+	for (i=0; i<nFiles; i++)
+	{
+		sprintf(szNames[i], "F%03d.DAT", i);
+		pszNames[i] = szNames[i];
+	}
+	RAM_CHECK(m.CreateFiles(RAMDISK_VOLUME"\\CREATE", pszNames, NULL, nFiles/2, results)==nFiles/2);
+	for (i=0; i<nFiles/2; i++)
+		RAM_CHECK(results[i]==IO_OK);
+
+	// the second batch repeats one name and has an illegal one
+	pszNames[nFiles] = "BAD*NAME.DAT";
+	pszNames[nFiles/2-1] = szNames[0];
+	RAM_CHECK(m.CreateFiles(RAMDISK_VOLUME"\\CREATE", pszNames+nFiles/2-1, NULL, nFiles/2+2, results)==nFiles/2);
+	RAM_CHECK(results[0]==IO_FILE_OR_DIR_EXISTS);
+	RAM_CHECK(results[nFiles/2+1]==IO_ILLEGAL_FILENAME);
+
+	for (i=0; i<nFiles; i++)
+	{
+		DeviceIoFileInfo info;
+		sprintf(szPath, RAMDISK_VOLUME"\\CREATE\\%s", szNames[i]);
+		RAM_CHECK(m.GetFileInfo(szPath, info)>=IO_OK);
+		RAM_CHECK(info.lSize==0 && info.lStartCluster==0 && (info.cAttributes&FAT_ATTR_ARCHIVE));
+	}
+	// the directory holds just these files (and '.' and '..'): the rest
+	// of the new clusters is clear, not stale (see FormatRamDisk())
+	DeviceIoFileInfo info;
+	int nEntries;
+	RAM_CHECK(m.GetFileInfo(RAMDISK_VOLUME"\\CREATE", info)>=IO_OK);
+	RAM_CHECK(m.Flush()>=IO_OK);
+	RAM_CHECK(CountDirectoryEntries(disk, info.lStartCluster, nEntries) && nEntries==nFiles+2);
+	RAM_CHECK(m.FileExist(RAMDISK_VOLUME"\\CREATE\\GHOST.DAT")!=IO_MATCH_ENTRY);
+
+	// new files go after the batch
+	RAM_CHECK(m.OpenFile(RAMDISK_VOLUME"\\CREATE\\LAST.DAT", f, IO_FILE_CREATE|IO_FILE_WRITABLE)>=IO_OK);
+	RAM_CHECK(f.Close()>=IO_OK);
+	RAM_CHECK(m.FileExist(RAMDISK_VOLUME"\\CREATE\\LAST.DAT")==IO_MATCH_ENTRY);
+
+	RAM_CHECK(m.DeleteTree(RAMDISK_VOLUME"\\CREATE", FAT_ATTR_DIRECTORY)>=IO_OK);
+	return true;
+}
+
+static bool TestDeleteTree(DeviceIoManager& m)
+{
+	// DeleteTree(): a tree that is deeper than MAX_DELETE_TREE_DEPTH, with files at each level
+	const int nLevels = MAX_DELETE_TREE_DEPTH+3;
+	char szPath[256];
+	char szFile[sizeof(szPath)+16];
+	unsigned long nFree, nFreeAfter;
+	DeviceIoFile f;
+	int i, k;
+
+	RAM_CHECK(m.GetNrOfFreeSectors(RAMDISK_VOLUME, nFree)>=IO_OK);
+	strcpy(szPath, RAMDISK_VOLUME"\\TREE");
+	for (i=0; i<nLevels; i++)
+	{
+		if (i>0)
+			sprintf(szPath+strlen(szPath), "\\L%d", i);
+		RAM_CHECK(m.CreateDirectories(szPath)>=IO_OK);
+		for (k=0; k<=i%4; k++)
+		{
+			unsigned int n = 1000*k + 1;
+			sprintf(szFile, "%s\\F%d.DAT", szPath, k);
+			RAM_CHECK(m.OpenFile(szFile, f, IO_FILE_CREATE|IO_FILE_WRITABLE)>=IO_OK);
+			RAM_CHECK(f.Write(_ramData, n)>=IO_OK);
+			RAM_CHECK(f.Close()>=IO_OK);
+		}
+	}
+
+	// refused while a file in the tree is open
+	RAM_CHECK(m.OpenFile(szFile, f, 0)>=IO_OK);
+	RAM_CHECK(m.DeleteTree(RAMDISK_VOLUME"\\TREE", FAT_ATTR_DIRECTORY)==IO_FILE_OPEN);
+	RAM_CHECK(f.Close()>=IO_OK);
+
+	RAM_CHECK(m.DeleteTree(RAMDISK_VOLUME"\\TREE", FAT_ATTR_DIRECTORY)>=IO_OK);
+	RAM_CHECK(m.FileExist(RAMDISK_VOLUME"\\TREE")!=IO_MATCH_ENTRY);
+	RAM_CHECK(m.GetNrOfFreeSectors(RAMDISK_VOLUME, nFreeAfter)>=IO_OK);
+	RAM_CHECK(nFreeAfter==nFree);
+	return true;
+}
+
+static bool TestDirectoryScan(DeviceIoManager& m)
+{
+	// lookups in a directory that spans many sectors (read DIR_SCAN_SECTORS at a time)
+	const int nFiles = 300;
+	char szPath[64];
+	DeviceIoDirectory dir;
+	DeviceIoFile f;
+	int i;
+
+	RAM_CHECK(m.CreateDirectory(RAMDISK_VOLUME"\\SCAN")>=IO_OK);
+	RAM_CHECK(m.OpenDirectory(RAMDISK_VOLUME"\\SCAN", dir)>=IO_OK);
+	for (i=0; i<nFiles; i++)
+	{
+		sprintf(szPath, "FILE%04d.DAT", i);
+		RAM_CHECK(m.OpenFile(dir, szPath, f, IO_FILE_CREATE|IO_FILE_WRITABLE)>=IO_OK);
+		RAM_CHECK(f.Close()>=IO_OK);
+	}
+	for (i=nFiles-1; i>=0; i-=7)
+	{
+		sprintf(szPath, "FILE%04d.DAT", i);
+		RAM_CHECK(m.FileExist(dir, szPath)==IO_MATCH_ENTRY);
+	}
+	RAM_CHECK(m.FileExist(dir, "MISSING.DAT")!=IO_MATCH_ENTRY);
+
+	// entries that change while a file of the directory is open are found too
+	RAM_CHECK(m.OpenFile(dir, "FILE0000.DAT", f, IO_FILE_WRITABLE)>=IO_OK);
+	RAM_CHECK(m.Rename(RAMDISK_VOLUME"\\SCAN\\FILE0299.DAT", RAMDISK_VOLUME"\\SCAN\\MOVED.DAT")>=IO_OK);
+	RAM_CHECK(m.FileExist(dir, "FILE0299.DAT")!=IO_MATCH_ENTRY);
+	RAM_CHECK(m.FileExist(dir, "MOVED.DAT")==IO_MATCH_ENTRY);
+	RAM_CHECK(m.DeleteFile(dir, "FILE0150.DAT", FAT_ATTR_ARCHIVE)>=IO_OK);
+	RAM_CHECK(m.FileExist(dir, "FILE0150.DAT")!=IO_MATCH_ENTRY);
+	RAM_CHECK(m.FileExist(dir, "FILE0151.DAT")==IO_MATCH_ENTRY);
+	RAM_CHECK(f.Close()>=IO_OK);
+
+	RAM_CHECK(m.DeleteTree(RAMDISK_VOLUME"\\SCAN", FAT_ATTR_DIRECTORY)>=IO_OK);
+	return true;
+}
+
+static bool TestFileTable(DeviceIoManager& m)
+{
+	// the file table of the driver: all entries in use, sizes of open files, stale handles
+	static DeviceIoFile files[RAMDISK_FILES+1];
+	char szPath[64];
+	int i;
+
+	RAM_CHECK(m.CreateDirectory(RAMDISK_VOLUME"\\FILES")>=IO_OK);
+	for (i=0; i<RAMDISK_FILES; i++)
+	{
+		unsigned int n = 10*i;
+		sprintf(szPath, RAMDISK_VOLUME"\\FILES\\F%d.DAT", i%8);
+		RAM_CHECK(m.OpenFile(szPath, files[i], i<8 ? IO_FILE_CREATE|IO_FILE_WRITABLE : 0)>=IO_OK);
+		if (i<8)
+			RAM_CHECK(files[i].Write(_ramData, n)>=IO_OK);
+	}
+	RAM_CHECK(m.OpenFile(RAMDISK_VOLUME"\\FILES\\MORE.DAT", files[RAMDISK_FILES], IO_FILE_CREATE|IO_FILE_WRITABLE)==IO_OUT_OF_FILE_HANDLES);
+	files[RAMDISK_FILES].ClearErrorStatus();
+	RAM_CHECK(_pRamDriver->SetFileTable(_ramFileTable, RAMDISK_FILES)==IO_FILE_OPEN);
+
+	// the open files report the size that isn't in their directory entry yet
+	for (i=0; i<8; i++)
+	{
+		DeviceIoFileInfo info;
+		sprintf(szPath, RAMDISK_VOLUME"\\FILES\\F%d.DAT", i);
+		RAM_CHECK(m.GetFileInfo(szPath, info)>=IO_OK && info.lSize==(unsigned long)10*i);
+	}
+
+	// close the handles in a mixed order; the others keep seeing the right file
+	for (i=0; i<RAMDISK_FILES; i++)
+	{
+		const int iClose = (i*13)%RAMDISK_FILES;
+		RAM_CHECK(files[iClose].Close()>=IO_OK);
+		for (int k=0; k<RAMDISK_FILES; k++)
+		{
+			unsigned long lSize;
+			if (files[k].IsOpen())
+				RAM_CHECK(files[k].GetFileSize(lSize)>=IO_OK && lSize==(unsigned long)10*(k%8));
+		}
+	}
+
+	// a copy of a closed handle doesn't reach the file that reuses its entry
+	RAM_CHECK(m.OpenFile(RAMDISK_VOLUME"\\FILES\\F1.DAT", files[0], IO_FILE_WRITABLE)>=IO_OK);
+	DeviceIoFile stale;
+	memcpy((void*)&stale, (void*)&files[0], sizeof(stale));
+	RAM_CHECK(files[0].Close()>=IO_OK);
+	RAM_CHECK(m.OpenFile(RAMDISK_VOLUME"\\FILES\\F2.DAT", files[0], IO_FILE_WRITABLE)>=IO_OK);
+	unsigned long lSize;
+	RAM_CHECK(stale.GetFileSize(lSize)==IO_INVALID_HANDLE);
+	memset((void*)&stale, 0, sizeof(stale)); // it doesn't own the file
+	RAM_CHECK(files[0].Close()>=IO_OK);
+
+	RAM_CHECK(_pRamDriver->SetFileTable(_ramFileTable, RAMDISK_FILES)>=IO_OK);
+	RAM_CHECK(m.DeleteTree(RAMDISK_VOLUME"\\FILES", FAT_ATTR_DIRECTORY)>=IO_OK);
+	return true;
+}
+
+static bool TestSharedFiles(DeviceIoManager& m)
+{
+	// one file opened by a writer and two readers
+	const char* szFile = RAMDISK_VOLUME"\\SHARED.DAT";
+	DeviceIoFile w, r1, r2, other;
+	unsigned long lSize;
+	unsigned int n;
+
+	RAM_CHECK(m.OpenFile(szFile, w, IO_FILE_CREATE|IO_FILE_WRITABLE)>=IO_OK);
+	RAM_CHECK(m.OpenFile(szFile, r1, 0)>=IO_OK);
+	RAM_CHECK(m.OpenFile(szFile, r2, 0)>=IO_OK);
+	RAM_CHECK(m.OpenFile(szFile, other, IO_FILE_WRITABLE)==IO_FILE_OPEN);
+	other.ClearErrorStatus();
+
+	// the readers see what the writer adds, also beyond the clusters they started with
+	n = 3000;
+	RAM_CHECK(w.Write(_ramData, n)>=IO_OK);
+	RAM_CHECK(r1.GetFileSize(lSize)>=IO_OK && lSize==3000);
+	n = 3000;
+	RAM_CHECK(r1.Read(_ramBack, n)>=IO_OK && n==3000 && memcmp(_ramBack, _ramData, n)==0);
+	n = 5000;
+	RAM_CHECK(w.Write(_ramData+3000, n)>=IO_OK);
+	n = 5000;
+	RAM_CHECK(r1.Read(_ramBack+3000, n)>=IO_OK && n==5000 && memcmp(_ramBack, _ramData, 8000)==0);
+
+	// the writer overwrites data that a reader has in its current sector
+	RAM_CHECK(r2.Seek(seekBegin, 100)>=IO_OK);
+	n = 1;
+	RAM_CHECK(r2.Read(_ramBack, n)>=IO_OK && _ramBack[0]==_ramData[100]);
+	RAM_CHECK(w.Seek(seekBegin, 101)>=IO_OK);
+	n = 1;
+	RAM_CHECK(w.Write("!", n)>=IO_OK);
+	n = 1;
+	RAM_CHECK(r2.Read(_ramBack, n)>=IO_OK && _ramBack[0]=='!');
+
+	// the readers go on after the writer (which keeps the shared state) is closed
+	RAM_CHECK(w.Close()>=IO_OK);
+	RAM_CHECK(r2.GetFileSize(lSize)>=IO_OK && lSize==8000);
+	RAM_CHECK(m.OpenFile(szFile, other, IO_FILE_WRITABLE|IO_FILE_RESET)==IO_FILE_OPEN); // not under the readers
+	other.ClearErrorStatus();
+	RAM_CHECK(m.OpenFile(szFile, w, IO_FILE_WRITABLE)>=IO_OK); // a new writer is allowed now
+	RAM_CHECK(w.Close()>=IO_OK);
+	RAM_CHECK(r1.Close()>=IO_OK);
+	RAM_CHECK(r2.Seek(seekEnd, 0)>=IO_OK);
+	RAM_CHECK(r2.Tell(lSize)>=IO_OK && lSize==8000);
+	RAM_CHECK(r2.Close()>=IO_OK);
+
+	RAM_CHECK(m.DeleteFile(szFile, FAT_ATTR_ARCHIVE)>=IO_OK);
+	return true;
+}
+
+static bool TestStreamWriter(DeviceIoManager& m)
+{
+	// DeviceIoStreamWriter: small writes, and appending at a size that isn't sector aligned
+	const char* szFile = RAMDISK_VOLUME"\\STREAM.DAT";
+	static char buf[4096];
+	DeviceIoStreamWriter w;
+	unsigned long lTotal = 0;
+	unsigned long lSize;
+	int k = 0;
+
+	w.SetPreallocation(8192);
+	w.SetUpdateInterval(4096);
+	RAM_CHECK(w.Open(m, szFile, buf, sizeof(buf))>=IO_OK);
+	while (lTotal<50001)
+	{
+		unsigned int n = 1 + (k++*37)%61;
+		if (lTotal+n>50001)
+			n = 50001 - lTotal;
+		RAM_CHECK(w.Write(_ramData+lTotal, n)>=IO_OK);
+		lTotal += n;
+	}
+	RAM_CHECK(w.GetLength()==lTotal);
+	RAM_CHECK(w.Close()>=IO_OK);
+
+	RAM_CHECK(w.Open(m, szFile, buf, sizeof(buf), IO_FILE_CREATE)>=IO_OK);
+	RAM_CHECK(w.GetLength()==lTotal);
+	RAM_CHECK(w.Write(_ramData+lTotal, 20000)>=IO_OK);
+	lTotal += 20000;
+	RAM_CHECK(w.Flush()>=IO_OK);
+	RAM_CHECK(w.Append(_ramData+lTotal, 999)>=IO_OK);
+	lTotal += 999;
+	RAM_CHECK(w.Close()>=IO_OK); // writes the appended data
+	RAM_CHECK(w.GetNrOfLostBytes()==0);
+
+	DeviceIoFile f;
+	unsigned int n = sizeof(_ramBack);
+	RAM_CHECK(m.OpenFile(szFile, f, 0)>=IO_OK);
+	RAM_CHECK(f.GetFileSize(lSize)>=IO_OK && lSize==lTotal);
+	f.Read(_ramBack, n);
+	RAM_CHECK(n==lTotal && memcmp(_ramBack, _ramData, n)==0);
+	RAM_CHECK(f.Close()>=IO_OK);
+
+	RAM_CHECK(m.DeleteFile(szFile, FAT_ATTR_ARCHIVE)>=IO_OK);
+	return true;
+}
+
+static bool RamDiskTests()
+{
+	BlockDeviceInterface_RamDisk disk(RAMDISK_SECTORS);
+	RamDiskDriverFactory factory;
+	DeviceIoManager m;
+	DeviceIoDriver* pDriver = NULL;
+	unsigned long nFree, nFreeAfter;
+	int i;
+
+	for (i=0; i<(int)sizeof(_ramData); i++)
+		_ramData[i] = (char)(i*7 + i/509);
+
+	m.Init();
+	m.SetDriverFactory(&factory);
+	RAM_CHECK(disk.MountHW(0, IO_MOUNT_WRITABLE)>=IO_OK);
+	RAM_CHECK(FormatRamDisk(disk)>=IO_OK);
+	RAM_CHECK(m.CreateDriver(&disk, pDriver)>=IO_OK);
+	RAM_CHECK(pDriver->MountSW(&disk)>=IO_OK);
+	RAM_CHECK(m.GetNrOfFreeSectors(RAMDISK_VOLUME, nFree)>=IO_OK);
+
+	bool bOK = TestCreateFiles(m, disk) &&
+		TestDeleteTree(m) &&
+		TestDirectoryScan(m) &&
+		TestFileTable(m) &&
+		TestSharedFiles(m) &&
+		TestStreamWriter(m);
+
+	if (bOK)
+	{
+		RAM_CHECK(m.Flush()>=IO_OK);
+		RAM_CHECK(m.GetNrOfFreeSectors(RAMDISK_VOLUME, nFreeAfter)>=IO_OK);
+		RAM_CHECK(nFreeAfter==nFree);
+		cout << "RAM disk tests passed" << endl;
+	}
+
+	pDriver->UnmountSW();
+	disk.UnmountHW();
+	m.ReleaseDriver(pDriver);
+	_pRamDriver = NULL;
+	return bOK;
+}
+
 int main(int argc, char* argv[])
 {
 	char szFile[256];
@@ -460,6 +945,9 @@ int main(int argc, char* argv[])
 //	SampleStructX samplesX;
 	SampleProcessor sp;
 
+	// check the file system on a RAM disk first, which doesn't need any hardware
+	if (!RamDiskTests())
+		return -1;
 
 	if (argc==2) bDump = true;
 #ifdef _DEBUG